@@ -0,0 +1,363 @@
+/* grf_bench.c : libgrf benchmarks on a synthetic archive
+ *
+ * Writes a synthetic GRF (see synth.h), times the usual operations on it, and
+ * prints the results as one JSON document. Each benchmark runs -r times and
+ * the fastest run is kept, so results can be compared between two builds.
+ */
+
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench {
+  struct synth_opts opts;
+  uint32_t rounds, adds;
+  const char *only; /* comma separated benchmarks to run, NULL for all */
+  char src[1024], tmp[1024];
+  char **names, **missing; /* names of the files of the archive, and names not in it */
+  FILE *out;
+  int results;
+};
+
+/* monotonic clock, in microseconds */
+static uint64_t bench_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* one run, returns its duration in microseconds, ops and bytes being what it processed */
+typedef uint64_t (*bench_func)(struct bench *, uint64_t *ops, uint64_t *bytes);
+
+static bool bench_copy(const char *from, const char *to) {
+  FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+  char *buf = malloc(1024 * 1024);
+  size_t n;
+  bool ok = (in != NULL) && (out != NULL) && (buf != NULL);
+  while (ok && ((n = fread(buf, 1, 1024 * 1024, in)) > 0)) ok = (fwrite(buf, n, 1, out) == 1);
+  if (in != NULL) fclose(in);
+  if ((out != NULL) && (fclose(out) != 0)) ok = false;
+  free(buf);
+  return ok;
+}
+
+static grf_handle bench_open(const char *filename, bool writemode) {
+  grf_handle h = grf_load(filename, writemode);
+  if (h == NULL) {
+    fprintf(stderr, "can't load %s\n", filename);
+    exit(1);
+  }
+  return h;
+}
+
+static uint64_t bench_load(struct bench *b, uint64_t *ops, grf_handle (*load)(const char *)) {
+  uint64_t t0 = bench_usec(), t;
+  grf_handle h = load(b->src);
+  t            = bench_usec() - t0;
+  if (h == NULL) {
+    fprintf(stderr, "can't load %s\n", b->src);
+    exit(1);
+  }
+  *ops = grf_filecount(h);
+  grf_free(h);
+  return t;
+}
+
+static grf_handle bench_load_ro(const char *filename) { return grf_load(filename, false); }
+
+static uint64_t bench_open_regular(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  (void)bytes;
+  return bench_load(b, ops, bench_load_ro);
+}
+
+static uint64_t bench_open_compact(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  (void)bytes;
+  return bench_load(b, ops, grf_load_compact);
+}
+
+static uint64_t bench_open_lazy(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  (void)bytes;
+  return bench_load(b, ops, grf_load_lazy);
+}
+
+static uint64_t bench_lookups(struct bench *b, uint64_t *ops, char **names, bool found) {
+  grf_handle h = bench_open(b->src, false);
+  uint64_t t0, t;
+  uint32_t hits = 0;
+  t0 = bench_usec();
+  for (uint32_t i = 0; i < b->opts.files; i++)
+    if (grf_get_file(h, names[i]) != NULL) hits++;
+  t = bench_usec() - t0;
+  if (hits != (found ? b->opts.files : 0)) {
+    fprintf(stderr, "lookups: %u files found out of %u\n", hits, b->opts.files);
+    exit(1);
+  }
+  grf_free(h);
+  *ops = b->opts.files;
+  return t;
+}
+
+static uint64_t bench_lookup_hit(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  (void)bytes;
+  return bench_lookups(b, ops, b->names, true);
+}
+
+static uint64_t bench_lookup_miss(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  (void)bytes;
+  return bench_lookups(b, ops, b->missing, false);
+}
+
+static uint64_t bench_tree(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  grf_handle h = bench_open(b->src, false);
+  uint64_t t0  = bench_usec(), t;
+  (void)bytes;
+  grf_create_tree(h);
+  t    = bench_usec() - t0;
+  *ops = grf_filecount(h);
+  grf_free(h);
+  return t;
+}
+
+static uint64_t bench_extract(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  grf_handle h = bench_open(b->src, false);
+  void *buf    = malloc(b->opts.max_size + 1);
+  uint64_t t0, t;
+  t0 = bench_usec();
+  for (grf_node f = grf_get_file_first(h); f != NULL; f = grf_get_file_next(f)) {
+    uint32_t size = grf_file_get_size(f);
+    if (grf_file_get_contents(f, buf) != size) {
+      fprintf(stderr, "can't extract %s\n", grf_file_get_filename(f));
+      exit(1);
+    }
+    (*ops)++;
+    *bytes += size;
+  }
+  t = bench_usec() - t0;
+  free(buf);
+  grf_free(h);
+  return t;
+}
+
+static uint64_t bench_add(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  uint32_t count = (b->adds < b->opts.files) ? b->adds : b->opts.files;
+  unsigned char **data = malloc(sizeof(unsigned char *) * (count + 1));
+  grf_handle h;
+  uint64_t t0, t;
+  for (uint32_t i = 0; i < count; i++) {
+    data[i] = malloc(synth_size(&b->opts, i));
+    synth_data(&b->opts, i, data[i]);
+  }
+  unlink(b->tmp);
+  h  = grf_new(b->tmp, true);
+  t0 = bench_usec();
+  for (uint32_t i = 0; i < count; i++) {
+    if (grf_file_add(h, b->names[i], data[i], synth_size(&b->opts, i)) == NULL) {
+      fprintf(stderr, "can't add %s\n", b->names[i]);
+      exit(1);
+    }
+    *bytes += synth_size(&b->opts, i);
+  }
+  t    = bench_usec() - t0;
+  *ops = count;
+  grf_free(h);
+  for (uint32_t i = 0; i < count; i++) free(data[i]);
+  free(data);
+  return t;
+}
+
+static uint64_t bench_merge(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  grf_handle src = bench_open(b->src, false), dest;
+  uint64_t t0, t;
+  unlink(b->tmp);
+  dest = grf_new(b->tmp, true);
+  t0   = bench_usec();
+  if (!grf_merge(dest, src, GRF_REPACK_FAST)) {
+    fprintf(stderr, "merge failed\n");
+    exit(1);
+  }
+  t = bench_usec() - t0;
+  for (grf_node f = grf_get_file_first(src); f != NULL; f = grf_get_file_next(f)) *bytes += grf_file_get_storage_size(f);
+  *ops = grf_filecount(src);
+  grf_free(dest);
+  grf_free(src);
+  return t;
+}
+
+static uint64_t bench_repack(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  grf_handle h;
+  uint64_t t0, t;
+  (void)bytes;
+  if (!bench_copy(b->src, b->tmp)) exit(1);
+  h  = bench_open(b->tmp, true);
+  t0 = bench_usec();
+  if (!grf_repack(h, GRF_REPACK_FAST)) {
+    fprintf(stderr, "repack failed\n");
+    exit(1);
+  }
+  t    = bench_usec() - t0;
+  *ops = grf_filecount(h);
+  grf_free(h);
+  return t;
+}
+
+static uint64_t bench_save(struct bench *b, uint64_t *ops, uint64_t *bytes) {
+  grf_handle h;
+  uint64_t t0, t;
+  (void)bytes;
+  if (!bench_copy(b->src, b->tmp)) exit(1);
+  h = bench_open(b->tmp, true);
+  grf_file_add(h, "data\\grf_bench.txt", "grf_bench", 9); /* something to save */
+  t0 = bench_usec();
+  if (!grf_save(h)) {
+    fprintf(stderr, "save failed\n");
+    exit(1);
+  }
+  t    = bench_usec() - t0;
+  *ops = grf_filecount(h);
+  grf_free(h);
+  return t;
+}
+
+static void bench_run(struct bench *b, const char *name, bench_func func) {
+  uint64_t best = UINT64_MAX, ops = 0, bytes = 0;
+  if (b->only != NULL) {
+    const char *p = strstr(b->only, name);
+    size_t l      = strlen(name);
+    if ((p == NULL) || ((p != b->only) && (p[-1] != ',')) || ((p[l] != 0) && (p[l] != ','))) return;
+  }
+  for (uint32_t r = 0; r < b->rounds; r++) {
+    uint64_t t;
+    ops   = 0;
+    bytes = 0;
+    t     = func(b, &ops, &bytes);
+    if (t < best) best = t;
+  }
+  if (best == 0) best = 1;
+  fprintf(b->out, "%s\n    {\"name\":\"%s\",\"usec\":%llu,\"ops\":%llu,\"ops_per_sec\":%.0f", (b->results++ > 0) ? "," : "", name,
+          (unsigned long long)best, (unsigned long long)ops, ops * 1e6 / best);
+  if (bytes > 0) fprintf(b->out, ",\"bytes\":%llu,\"mb_per_sec\":%.1f", (unsigned long long)bytes, bytes / (double)best);
+  fprintf(b->out, "}");
+  fflush(b->out);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Call: %s [options]\n"
+          "  -n files     files in the archive (10000)\n"
+          "  -s seed      generator seed (1)\n"
+          "  -v version   0x200, or 0x103 for DES/mixcrypt encrypted files (0x200)\n"
+          "  -D dirs      distinct directories (500)\n"
+          "  -d depth     maximum directory depth (4)\n"
+          "  -k percent   directory levels with EUC-KR names (20)\n"
+          "  -z min:max   file sizes, log-uniform (64:32768)\n"
+          "  -f percent   files followed by a hole (0)\n"
+          "  -S           files table in storage order (shuffled by default)\n"
+          "  -a files     files added by the add benchmark (2000)\n"
+          "  -r rounds    runs of each benchmark, the fastest is kept (3)\n"
+          "  -b list      benchmarks to run, comma separated (all)\n"
+          "  -w dir       work directory (.)\n"
+          "  -o file      write the results there (stdout)\n"
+          "  -g file      only write the synthetic archive to file\n",
+          argv0);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench b;
+  struct synth_opts init = SYNTH_OPTS_INIT;
+  const char *dir = ".", *output = NULL, *generate = NULL;
+  struct stat s;
+  uint64_t t0, gen_time;
+  char name[512];
+  int c;
+  memset(&b, 0, sizeof(b));
+  b.opts   = init;
+  b.rounds = 3;
+  b.adds   = 2000;
+  b.out    = stdout;
+  while ((c = getopt(argc, argv, "n:s:v:D:d:k:z:f:Sa:r:b:w:o:g:h")) != -1) {
+    switch (c) {
+      case 'n': b.opts.files = strtoul(optarg, NULL, 0); break;
+      case 's': b.opts.seed = strtoul(optarg, NULL, 0); break;
+      case 'v': b.opts.version = strtoul(optarg, NULL, 0); break;
+      case 'D': b.opts.dirs = strtoul(optarg, NULL, 0); break;
+      case 'd': b.opts.depth = strtoul(optarg, NULL, 0); break;
+      case 'k': b.opts.euc_kr = strtoul(optarg, NULL, 0); break;
+      case 'z':
+        if (sscanf(optarg, "%u:%u", &b.opts.min_size, &b.opts.max_size) != 2) usage(argv[0]);
+        break;
+      case 'f': b.opts.frag = strtoul(optarg, NULL, 0); break;
+      case 'S': b.opts.shuffle = false; break;
+      case 'a': b.adds = strtoul(optarg, NULL, 0); break;
+      case 'r': b.rounds = strtoul(optarg, NULL, 0); break;
+      case 'b': b.only = optarg; break;
+      case 'w': dir = optarg; break;
+      case 'o': output = optarg; break;
+      case 'g': generate = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((b.opts.min_size == 0) || (b.opts.min_size > b.opts.max_size) || (b.rounds == 0)) usage(argv[0]);
+  if (generate != NULL) {
+    if (!synth_write(&b.opts, generate)) {
+      fprintf(stderr, "can't write %s\n", generate);
+      return 1;
+    }
+    return 0;
+  }
+  snprintf(b.src, sizeof(b.src), "%s/grf_bench_src.grf", dir);
+  snprintf(b.tmp, sizeof(b.tmp), "%s/grf_bench_tmp.grf", dir);
+  t0 = bench_usec();
+  if (!synth_write(&b.opts, b.src)) {
+    fprintf(stderr, "can't write %s\n", b.src);
+    return 1;
+  }
+  gen_time  = bench_usec() - t0;
+  b.names   = malloc(sizeof(char *) * (b.opts.files + 1));
+  b.missing = malloc(sizeof(char *) * (b.opts.files + 1));
+  for (uint32_t i = 0; i < b.opts.files; i++) {
+    synth_name(&b.opts, i, name, sizeof(name) - 2);
+    b.names[i] = strdup(name);
+    strcat(name, ".x");
+    b.missing[i] = strdup(name);
+  }
+  if ((output != NULL) && ((b.out = fopen(output, "w")) == NULL)) {
+    fprintf(stderr, "can't write %s\n", output);
+    return 1;
+  }
+  stat(b.src, &s);
+  fprintf(b.out,
+          "{\n  \"params\":{\"files\":%u,\"seed\":%u,\"version\":\"0x%x\",\"dirs\":%u,\"depth\":%u,\"euc_kr\":%u,\"min_size\":%u,"
+          "\"max_size\":%u,\"frag\":%u,\"shuffle\":%s,\"adds\":%u,\"rounds\":%u},\n"
+          "  \"archive\":{\"size\":%llu,\"generate_usec\":%llu},\n  \"results\":[",
+          b.opts.files, b.opts.seed, b.opts.version, b.opts.dirs, b.opts.depth, b.opts.euc_kr, b.opts.min_size, b.opts.max_size,
+          b.opts.frag, b.opts.shuffle ? "true" : "false", b.adds, b.rounds, (unsigned long long)s.st_size, (unsigned long long)gen_time);
+  bench_run(&b, "open", bench_open_regular);
+  if (b.opts.version == 0x200) { /* the compact stores only know 0x200 tables */
+    bench_run(&b, "open_compact", bench_open_compact);
+    bench_run(&b, "open_lazy", bench_open_lazy);
+  }
+  bench_run(&b, "lookup_hit", bench_lookup_hit);
+  bench_run(&b, "lookup_miss", bench_lookup_miss);
+  bench_run(&b, "tree", bench_tree);
+  bench_run(&b, "extract", bench_extract);
+  bench_run(&b, "add", bench_add);
+  bench_run(&b, "merge", bench_merge);
+  bench_run(&b, "repack", bench_repack);
+  bench_run(&b, "save", bench_save);
+  fprintf(b.out, "\n  ]\n}\n");
+  if (b.out != stdout) fclose(b.out);
+  unlink(b.src);
+  unlink(b.tmp);
+  for (uint32_t i = 0; i < b.opts.files; i++) {
+    free(b.names[i]);
+    free(b.missing[i]);
+  }
+  free(b.names);
+  free(b.missing);
+  return 0;
+}
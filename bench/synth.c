@@ -0,0 +1,363 @@
+/* synth.c : deterministic synthetic GRF archives
+ *
+ * Everything about the i-th file (directory, name, size, contents) comes from
+ * a generator seeded by (seed, i), so it doesn't depend on the other files.
+ * Archives are written directly, without the library, so any number of files
+ * can be generated in one pass.
+ */
+
+#include <grf.h> /* the archive format, before synth.h brings libgrf.h */
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define SYNTH_DIR 1
+#define SYNTH_NAME 2
+#define SYNTH_SIZE 3
+#define SYNTH_DATA 4
+#define SYNTH_HOLE 5
+#define SYNTH_ORDER 6
+
+static const char *synth_ascii[] = {"texture", "sprite", "model", "wav",   "effect", "monster", "npc",  "item",
+                                    "map",     "prontera", "geffen", "payon", "alberta", "morocc", "common", "ui"};
+static const char *synth_korean[] = {
+    "\xc0\xaf\xc0\xfa\xc0\xce\xc5\xcd\xc6\xe4\xc0\xcc\xbd\xba", /* user interface */
+    "\xb8\xf3\xbd\xba\xc5\xcd",                                 /* monster */
+    "\xbe\xc6\xc0\xcc\xc5\xdb",                                 /* item */
+    "\xc0\xcc\xc6\xe5\xc6\xae",                                 /* effect */
+    "\xc5\xd8\xbd\xba\xc3\xc4",                                 /* texture */
+    "\xbd\xba\xc7\xc1\xb6\xf3\xc0\xcc\xc6\xae",                 /* sprite */
+    "\xc0\xce\xb0\xa3\xc1\xb7",                                 /* human */
+    "\xb8\xf6\xc5\xeb",                                         /* body */
+    "\xb8\xd3\xb8\xae\xc5\xeb",                                 /* head */
+    "\xbe\xc7\xbc\xbc\xbb\xe7\xb8\xae",                         /* accessory */
+    "\xb0\xcb\xbb\xe7",                                         /* swordman */
+    "\xb8\xb6\xb9\xfd\xbb\xe7",                                 /* magician */
+};
+/* extensions, weighted about like a client data.grf */
+static const char *synth_ext[] = {"spr", "spr", "spr", "act", "act", "act", "bmp", "bmp", "bmp", "bmp",
+                                  "tga", "rsm", "rsm", "wav", "gat", "gnd", "rsw", "str", "txt", "xml"};
+static const char *synth_words[] = {"the ", "grf ", "file ", "data ", "sprite ", "0 ", "1 ", "255 ", "\r\n", "\t",
+                                    "mob ",  "npc ", "map ",  "item ", "skill ", "use ", "id ", "=", ",", "; "};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t synth_state(const struct synth_opts *opts, uint32_t i, uint32_t what) {
+  return (uint64_t)opts->seed * 0x9E3779B97F4A7C15ULL + (uint64_t)i * 0xD1B54A32D192ED03ULL + what;
+}
+
+/* splitmix64 */
+static uint32_t synth_rand(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z          = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z          = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return (z ^ (z >> 31)) >> 32;
+}
+
+static const char *synth_word(const struct synth_opts *opts, uint64_t *state) {
+  if (synth_rand(state) % 100 < opts->euc_kr) return synth_korean[synth_rand(state) % COUNT(synth_korean)];
+  return synth_ascii[synth_rand(state) % COUNT(synth_ascii)];
+}
+
+void synth_name(const struct synth_opts *opts, uint32_t i, char *buf, size_t len) {
+  uint64_t state = synth_state(opts, i, SYNTH_NAME), dstate;
+  uint32_t dirs  = (opts->dirs > 0) ? opts->dirs : 1, dir, depth;
+  size_t p;
+  // a few big directories and many small ones
+  dir    = (uint64_t)(synth_rand(&state) % dirs) * (synth_rand(&state) % dirs) / dirs;
+  dstate = synth_state(opts, dir, SYNTH_DIR);
+  depth  = (opts->depth > 0) ? 1 + synth_rand(&dstate) % opts->depth : 0;
+  p      = snprintf(buf, len, "data");
+  for (uint32_t d = 0; (d < depth) && (p < len); d++)
+    p += snprintf(buf + p, len - p, "\\%s", synth_word(opts, &dstate));
+  if (p < len) p += snprintf(buf + p, len - p, "_%u", dir);
+  if (p < len) snprintf(buf + p, len - p, "\\%s%u.%s", synth_word(opts, &state), i, synth_ext[synth_rand(&state) % COUNT(synth_ext)]);
+}
+
+uint32_t synth_size(const struct synth_opts *opts, uint32_t i) {
+  uint64_t state = synth_state(opts, i, SYNTH_SIZE), size;
+  uint32_t lo = 0, hi = 0, bits;
+  while ((2ULL << lo) <= opts->min_size) lo++;
+  while ((2ULL << hi) <= opts->max_size) hi++;
+  bits = lo + synth_rand(&state) % (hi - lo + 1);
+  size = (1ULL << bits) + synth_rand(&state) % (1ULL << bits);
+  if (size < opts->min_size) size = opts->min_size;
+  if (size > opts->max_size) size = opts->max_size;
+  return (size > 0) ? size : 1;
+}
+
+void synth_data(const struct synth_opts *opts, uint32_t i, unsigned char *buf) {
+  uint64_t state = synth_state(opts, i, SYNTH_DATA);
+  uint32_t size  = synth_size(opts, i), p = 0;
+  // text-like with some noise, deflates to about a third
+  while (p < size) {
+    uint32_t r = synth_rand(&state);
+    if (r % 4 == 0) {
+      buf[p++] = r >> 8;
+      continue;
+    }
+    for (const char *w = synth_words[(r >> 8) % COUNT(synth_words)]; (*w != 0) && (p < size); w++) buf[p++] = *w;
+  }
+}
+
+/* Encoding of the 0x103 archives. The library only decodes them, so the DES
+ * tables and helpers of grf.c are copied here, followed by the inverses of its
+ * decode_des_etc() and decode_filename().
+ */
+static const unsigned char BitMaskTable[8] = {0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
+
+static const char BitSwapTable1[64] = {58, 50, 42, 34, 26, 18, 10, 2,  60, 52, 44, 36, 28, 20, 12, 4,  62, 54, 46, 38, 30, 22,
+                                 14, 6,  64, 56, 48, 40, 32, 24, 16, 8,  57, 49, 41, 33, 25, 17, 9,  1,  59, 51, 43, 35,
+                                 27, 19, 11, 3,  61, 53, 45, 37, 29, 21, 13, 5,  63, 55, 47, 39, 31, 23, 15, 7};
+static const char BitSwapTable2[64] = {40, 8,  48, 16, 56, 24, 64, 32, 39, 7,  47, 15, 55, 23, 63, 31, 38, 6,  46, 14, 54, 22,
+                                 62, 30, 37, 5,  45, 13, 53, 21, 61, 29, 36, 4,  44, 12, 52, 20, 60, 28, 35, 3,  43, 11,
+                                 51, 19, 59, 27, 34, 2,  42, 10, 50, 18, 58, 26, 33, 1,  41, 9,  49, 17, 57, 25};
+static const char BitSwapTable3[32] = {16, 7, 20, 21, 29, 12, 28, 17, 1,  15, 23, 26, 5,  18, 31, 10,
+                                 2,  8, 24, 14, 32, 27, 3,  9,  19, 13, 30, 6,  22, 11, 4,  25};
+
+static const unsigned char NibbleData[4][64] = {
+    {
+        0xef, 0x03, 0x41, 0xfd, 0xd8, 0x74, 0x1e, 0x47, 0x26, 0xef, 0xfb, 0x22, 0xb3, 0xd8, 0x84, 0x1e, 0x39, 0xac, 0xa7, 0x60, 0x62, 0xc1,
+        0xcd, 0xba, 0x5c, 0x96, 0x90, 0x59, 0x05, 0x3b, 0x7a, 0x85, 0x40, 0xfd, 0x1e, 0xc8, 0xe7, 0x8a, 0x8b, 0x21, 0xda, 0x43, 0x64, 0x9f,
+        0x2d, 0x14, 0xb1, 0x72, 0xf5, 0x5b, 0xc8, 0xb6, 0x9c, 0x37, 0x76, 0xec, 0x39, 0xa0, 0xa3, 0x05, 0x52, 0x6e, 0x0f, 0xd9,
+    },
+    {
+        0xa7, 0xdd, 0x0d, 0x78, 0x9e, 0x0b, 0xe3, 0x95, 0x60, 0x36, 0x36, 0x4f, 0xf9, 0x60, 0x5a, 0xa3, 0x11, 0x24, 0xd2, 0x87, 0xc8, 0x52,
+        0x75, 0xec, 0xbb, 0xc1, 0x4c, 0xba, 0x24, 0xfe, 0x8f, 0x19, 0xda, 0x13, 0x66, 0xaf, 0x49, 0xd0, 0x90, 0x06, 0x8c, 0x6a, 0xfb, 0x91,
+        0x37, 0x8d, 0x0d, 0x78, 0xbf, 0x49, 0x11, 0xf4, 0x23, 0xe5, 0xce, 0x3b, 0x55, 0xbc, 0xa2, 0x57, 0xe8, 0x22, 0x74, 0xce,
+    },
+    {
+        0x2c, 0xea, 0xc1, 0xbf, 0x4a, 0x24, 0x1f, 0xc2, 0x79, 0x47, 0xa2, 0x7c, 0xb6, 0xd9, 0x68, 0x15, 0x80, 0x56, 0x5d, 0x01, 0x33, 0xfd,
+        0xf4, 0xae, 0xde, 0x30, 0x07, 0x9b, 0xe5, 0x83, 0x9b, 0x68, 0x49, 0xb4, 0x2e, 0x83, 0x1f, 0xc2, 0xb5, 0x7c, 0xa2, 0x19, 0xd8, 0xe5,
+        0x7c, 0x2f, 0x83, 0xda, 0xf7, 0x6b, 0x90, 0xfe, 0xc4, 0x01, 0x5a, 0x97, 0x61, 0xa6, 0x3d, 0x40, 0x0b, 0x58, 0xe6, 0x3d,
+    },
+    {
+        0x4d, 0xd1, 0xb2, 0x0f, 0x28, 0xbd, 0xe4, 0x78, 0xf6, 0x4a, 0x0f, 0x93, 0x8b, 0x17, 0xd1, 0xa4, 0x3a, 0xec, 0xc9, 0x35, 0x93, 0x56,
+        0x7e, 0xcb, 0x55, 0x20, 0xa0, 0xfe, 0x6c, 0x89, 0x17, 0x62, 0x17, 0x62, 0x4b, 0xb1, 0xb4, 0xde, 0xd1, 0x87, 0xc9, 0x14, 0x3c, 0x4a,
+        0x7e, 0xa8, 0xe2, 0x7d, 0xa0, 0x9f, 0xf6, 0x5c, 0x6a, 0x09, 0x8d, 0xf0, 0x0f, 0xe3, 0x53, 0x25, 0x95, 0x36, 0x28, 0xcb,
+    }};
+
+static void NibbleSwap(unsigned char *src, int len) {
+  for (; 0 < len; len--, src++) *src = (*src >> 4) | (*src << 4);
+}
+
+static void BitConvert(unsigned char *Src, const char *BitSwapTable) {
+  unsigned char tmp[8] = {0};
+  for (int lop = 0; lop != 64; lop++) {
+    int prm = BitSwapTable[lop] - 1;
+    if (Src[(prm >> 3) & 7] & BitMaskTable[prm & 7]) tmp[(lop >> 3) & 7] |= BitMaskTable[lop & 7];
+  }
+  memcpy(Src, tmp, 8);
+}
+
+static void BitConvert4(unsigned char *Src) {
+  unsigned char tmp[8];
+  tmp[0] = ((Src[7] << 5) | (Src[4] >> 3)) & 0x3f;
+  tmp[1] = ((Src[4] << 1) | (Src[5] >> 7)) & 0x3f;
+  tmp[2] = ((Src[4] << 5) | (Src[5] >> 3)) & 0x3f;
+  tmp[3] = ((Src[5] << 1) | (Src[6] >> 7)) & 0x3f;
+  tmp[4] = ((Src[5] << 5) | (Src[6] >> 3)) & 0x3f;
+  tmp[5] = ((Src[6] << 1) | (Src[7] >> 7)) & 0x3f;
+  tmp[6] = ((Src[6] << 5) | (Src[7] >> 3)) & 0x3f;
+  tmp[7] = ((Src[7] << 1) | (Src[4] >> 7)) & 0x3f;
+  for (int lop = 0; lop != 4; lop++) tmp[lop] = (NibbleData[lop][tmp[lop * 2]] & 0xf0) | (NibbleData[lop][tmp[lop * 2 + 1]] & 0x0f);
+  memset(tmp + 4, 0, 4);
+  for (int lop = 0; lop != 32; lop++) {
+    int prm = BitSwapTable3[lop] - 1;
+    if (tmp[prm >> 3] & BitMaskTable[prm & 7]) tmp[(lop >> 3) + 4] |= BitMaskTable[lop & 7];
+  }
+  for (int lop = 0; lop != 4; lop++) Src[lop] ^= tmp[lop + 4];
+}
+
+/* byte substitution of the shuffled blocks, its own inverse */
+static unsigned char synth_shuffle_byte(unsigned char a) {
+  static const unsigned char pairs[] = {0x00, 0x2b, 0x01, 0x68, 0x48, 0x77, 0x60, 0xff, 0x6c, 0x80, 0xb9, 0xc0, 0xeb, 0xfe};
+  for (int i = 0; i < (int)sizeof(pairs); i++)
+    if (pairs[i] == a) return pairs[i ^ 1];
+  return a;
+}
+
+/* the DES rounds are their own inverse, only the shuffle has to be undone */
+static void synth_encode_des_etc(unsigned char *buf, int len, int type, int cycle) {
+  int cnt = 0;
+  if (cycle < 3)
+    cycle = 3;
+  else if (cycle < 5)
+    cycle++;
+  else if (cycle < 7)
+    cycle += 9;
+  else
+    cycle += 15;
+  for (int lop = 0; lop * 8 < len; lop++, buf += 8) {
+    if (lop < 20 || (type == 0 && lop % cycle == 0)) {
+      BitConvert(buf, BitSwapTable1);
+      BitConvert4(buf);
+      BitConvert(buf, BitSwapTable2);
+    } else {
+      if (cnt == 7 && type == 0) {
+        unsigned char tmp[8];
+        memcpy(tmp, buf, 8);
+        cnt    = 0;
+        buf[3] = tmp[0];
+        buf[4] = tmp[1];
+        buf[6] = tmp[2];
+        buf[0] = tmp[3];
+        buf[1] = tmp[4];
+        buf[2] = tmp[5];
+        buf[5] = tmp[6];
+        buf[7] = synth_shuffle_byte(tmp[7]);
+      }
+      cnt++;
+    }
+  }
+}
+
+/* len being a multiple of 8 */
+static void synth_encode_filename(unsigned char *buf, int len) {
+  for (int lop = 0; lop < len; lop += 8) {
+    BitConvert(&buf[lop], BitSwapTable1);
+    BitConvert4(&buf[lop]);
+    BitConvert(&buf[lop], BitSwapTable2);
+    NibbleSwap(&buf[lop], 8);
+  }
+}
+
+/* decode type: map files only have their beginning encrypted (1), the other ones are mixcrypt (0) */
+static int synth_des_type(const char *name) {
+  const char *ext = strrchr(name, '.');
+  if ((ext != NULL) && ((strcmp(ext, ".gnd") == 0) || (strcmp(ext, ".gat") == 0) || (strcmp(ext, ".act") == 0) || (strcmp(ext, ".str") == 0)))
+    return 1;
+  return 0;
+}
+
+struct synth_entry {
+  uint64_t pos;
+  uint32_t len, len_aligned, size;
+};
+
+static bool synth_write_table(const struct synth_opts *opts, FILE *f, const struct synth_entry *entries, uint64_t table_offset) {
+  uint64_t state = synth_state(opts, 0, SYNTH_ORDER);
+  uint32_t *order = malloc(sizeof(uint32_t) * (opts->files + 1));
+  size_t size = 0, alloc = 65536;
+  unsigned char *table = malloc(alloc), *comp = NULL;
+  struct grf_header head;
+  char name[512];
+  bool ok = (order != NULL) && (table != NULL);
+  for (uint32_t i = 0; ok && (i < opts->files); i++) order[i] = i;
+  if (ok && opts->shuffle)
+    for (uint32_t i = opts->files; i > 1; i--) {
+      uint32_t j = synth_rand(&state) % i, t = order[i - 1];
+      order[i - 1] = order[j];
+      order[j]     = t;
+    }
+  for (uint32_t k = 0; ok && (k < opts->files); k++) {
+    const struct synth_entry *e = &entries[order[k]];
+    struct grf_table_entry_data te;
+    size_t len;
+    synth_name(opts, order[k], name, sizeof(name));
+    len = strlen(name) + 1;
+    if (size + len + 16 + sizeof(te) > alloc) {
+      unsigned char *t = realloc(table, alloc * 2);
+      if (t == NULL) {
+        ok = false;
+        break;
+      }
+      table = t;
+      alloc *= 2;
+    }
+    te.size  = e->size;
+    te.flags = GRF_FLAG_FILE;
+    te.pos   = e->pos;
+    if (opts->version == 0x103) {
+      // encoded name, padded to the DES block size, with its length and 2 unknown bytes in front
+      uint32_t nlen = (len + 7) & ~7, l = nlen + 2;
+      memcpy(table + size, &l, 4);
+      memset(table + size + 4, 0, 2 + nlen);
+      memcpy(table + size + 6, name, len);
+      synth_encode_filename(table + size + 6, nlen);
+      size += 6 + nlen;
+      te.len         = e->len + e->size + 715;
+      te.len_aligned = e->len_aligned + 37579;
+    } else {
+      memcpy(table + size, name, len);
+      size += len;
+      te.len         = e->len;
+      te.len_aligned = e->len_aligned;
+    }
+    memcpy(table + size, &te, sizeof(te));
+    size += sizeof(te);
+  }
+  if (ok && (opts->version == 0x103)) {
+    ok = (fwrite(table, size, 1, f) == 1);
+  } else if (ok) {
+    // compressed size, real size, then the compressed table
+    uLongf clen    = compressBound(size);
+    uint32_t pi[2] = {0, size};
+    comp           = malloc(clen);
+    ok             = (comp != NULL) && (compress(comp, &clen, table, size) == Z_OK);
+    pi[0]          = clen;
+    ok             = ok && (fwrite(pi, sizeof(pi), 1, f) == 1) && (fwrite(comp, clen, 1, f) == 1);
+  }
+  memset(&head, 0, sizeof(head));
+  strncpy(head.header_magic, GRF_HEADER_MAGIC, sizeof(head.header_magic));
+  head.offset    = table_offset;
+  head.filecount = opts->files + 7;
+  head.version   = opts->version;
+  ok             = ok && (fseek(f, 0, SEEK_SET) == 0) && (fwrite(&head, GRF_HEADER_SIZE, 1, f) == 1);
+  free(order);
+  free(table);
+  free(comp);
+  return ok;
+}
+
+bool synth_write(const struct synth_opts *opts, const char *filename) {
+  struct synth_entry *entries = malloc(sizeof(struct synth_entry) * (opts->files + 1));
+  uLongf max_comp             = compressBound(opts->max_size) + 8;
+  unsigned char *data = malloc(opts->max_size + 1), *comp = malloc(max_comp);
+  uint64_t pos = 0;
+  char name[512];
+  bool ok = (entries != NULL) && (data != NULL) && (comp != NULL);
+  FILE *f = ok ? fopen(filename, "wb") : NULL;
+  if (f == NULL) ok = false;
+  if ((opts->version != 0x200) && (opts->version != 0x103)) ok = false;
+  memset(comp, 0, max_comp);
+  ok = ok && (fwrite(comp, GRF_HEADER_SIZE, 1, f) == 1); /* header, written once the table is known */
+  for (uint32_t i = 0; ok && (i < opts->files); i++) {
+    uint64_t state = synth_state(opts, i, SYNTH_HOLE);
+    uLongf clen    = max_comp;
+    uint32_t size  = synth_size(opts, i), aligned;
+    synth_data(opts, i, data);
+    if (compress(comp, &clen, data, size) != Z_OK) {
+      ok = false;
+      break;
+    }
+    aligned = (clen + 7) & ~7;
+    memset(comp + clen, 0, aligned - clen);
+    if (opts->version == 0x103) {
+      int type, cycle = 1;
+      synth_name(opts, i, name, sizeof(name));
+      type = synth_des_type(name);
+      for (uint32_t d = 10; clen >= d; d *= 10) cycle++;
+      synth_encode_des_etc(comp, aligned, type, (type == 1) ? 0 : cycle);
+    }
+    ok         = (fwrite(comp, aligned, 1, f) == 1);
+    entries[i] = (struct synth_entry){pos, clen, aligned, size};
+    pos += aligned;
+    if (synth_rand(&state) % 100 < opts->frag) {
+      // a hole, as left by files deleted or replaced by a patch
+      uint32_t hole = 8 * (1 + synth_rand(&state) % (aligned / 8 + 1));
+      memset(comp, 0, MIN(hole, max_comp));
+      for (uint32_t h = 0; ok && (h < hole); h += max_comp) ok = (fwrite(comp, MIN(hole - h, max_comp), 1, f) == 1);
+      pos += hole;
+    }
+  }
+  if (pos > UINT32_MAX) ok = false; /* positions are 32 bits in those versions */
+  ok = ok && synth_write_table(opts, f, entries, pos);
+  if ((f != NULL) && (fclose(f) != 0)) ok = false;
+  free(entries);
+  free(data);
+  free(comp);
+  return ok;
+}
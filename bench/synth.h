@@ -0,0 +1,38 @@
+/* synth.h : deterministic synthetic GRF archives
+ *
+ * The same options (seed included) always give the same archive, byte for
+ * byte, and the name and size of the i-th file can be found again without
+ * reading it, so benchmarks can look files up.
+ */
+
+#ifndef __SYNTH_H_INCLUDED
+#define __SYNTH_H_INCLUDED
+
+#include <stddef.h>
+#include <libgrf.h>
+
+struct synth_opts {
+  uint32_t files;
+  uint32_t seed;
+  uint32_t version;            /* 0x200, or 0x103 (files DES/mixcrypt encrypted, as old clients have them) */
+  uint32_t dirs;               /* distinct directories */
+  uint32_t depth;              /* maximum depth of a directory below data\ */
+  uint32_t euc_kr;             /* % of directory levels with a Korean (EUC-KR) name */
+  uint32_t min_size, max_size; /* file sizes are log-uniform in [min, max] */
+  uint32_t frag;               /* % of files followed by a hole (unused space) */
+  bool shuffle;                /* files table not in storage order */
+};
+
+#define SYNTH_OPTS_INIT \
+  { 10000, 1, 0x200, 500, 4, 20, 64, 32768, 0, true }
+
+/* name of the i-th file (EUC-KR, '\\' separated), len being the size of buf */
+void synth_name(const struct synth_opts *, uint32_t, char *, size_t);
+/* uncompressed size of the i-th file */
+uint32_t synth_size(const struct synth_opts *, uint32_t);
+/* contents of the i-th file, buf being synth_size() long */
+void synth_data(const struct synth_opts *, uint32_t, unsigned char *);
+/* write the archive */
+bool synth_write(const struct synth_opts *, const char *);
+
+#endif /* __SYNTH_H_INCLUDED */
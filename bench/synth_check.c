@@ -0,0 +1,92 @@
+/* synth_check.c : checks the synthetic archives against the library
+ *
+ * Writes small archives with synth.h, in each version and layout the
+ * generator knows, then reads them back through the regular, compact and lazy
+ * loads, and grf_probe(): every file must be found with its own contents.
+ * Exits with 1 on the first mismatch.
+ */
+
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK_FILE "synth_check.grf"
+
+static void check(bool ok, const char *what, const struct synth_opts *opts) {
+  if (ok) return;
+  fprintf(stderr, "synth_check: %s (version 0x%x, shuffle %d, frag %u)\n", what, opts->version, opts->shuffle, opts->frag);
+  unlink(CHECK_FILE);
+  exit(1);
+}
+
+/* every file of opts has its name, size and contents in h */
+static void check_files(const struct synth_opts *opts, grf_handle h) {
+  unsigned char *want = malloc(opts->max_size + 1), *got = malloc(opts->max_size + 1);
+  char name[512];
+  check((h != NULL) && (want != NULL) && (got != NULL), "can't load", opts);
+  check(grf_filecount(h) == opts->files, "bad file count", opts);
+  for (uint32_t i = 0; i < opts->files; i++) {
+    uint32_t size = synth_size(opts, i);
+    grf_node f;
+    synth_name(opts, i, name, sizeof(name));
+    f = grf_get_file(h, name);
+    check(f != NULL, "file not found", opts);
+    synth_data(opts, i, want);
+    check((grf_file_get_size(f) == size) && (grf_file_get_contents(f, got) == size), "bad size", opts);
+    check(memcmp(want, got, size) == 0, "bad contents", opts);
+  }
+  free(want);
+  free(got);
+  grf_free(h);
+}
+
+/* the same options give the same archive */
+static void check_same(const struct synth_opts *opts) {
+  FILE *a = fopen(CHECK_FILE, "rb"), *b;
+  int c;
+  check(a != NULL, "can't read", opts);
+  check(synth_write(opts, CHECK_FILE ".2"), "can't write", opts);
+  b = fopen(CHECK_FILE ".2", "rb");
+  check(b != NULL, "can't read", opts);
+  while (((c = fgetc(a)) != EOF) && (c == fgetc(b)))
+    ;
+  check((c == EOF) && (fgetc(b) == EOF), "not deterministic", opts);
+  fclose(a);
+  fclose(b);
+  unlink(CHECK_FILE ".2");
+}
+
+static void check_archive(struct synth_opts *opts) {
+  grf_probe_info info;
+  check(synth_write(opts, CHECK_FILE), "can't write", opts);
+  check_same(opts);
+  check_files(opts, grf_load(CHECK_FILE, false));
+  check(grf_probe(CHECK_FILE, &info, GRF_PROBE_TABLE), "can't probe", opts);
+  check((info.version == opts->version) && (info.filecount == opts->files), "bad probe", opts);
+  if (opts->version == 0x200) {
+    check((info.files == opts->files) && ((info.wasted_space > 0) == (opts->frag > 0)), "bad probe of the table", opts);
+    check_files(opts, grf_load_compact(CHECK_FILE));
+    check_files(opts, grf_load_lazy(CHECK_FILE));
+  }
+  unlink(CHECK_FILE);
+}
+
+int main(void) {
+  struct synth_opts opts = SYNTH_OPTS_INIT;
+  opts.files             = 2000;
+  opts.euc_kr            = 50;
+  opts.max_size          = 8192;
+  check_archive(&opts);
+  opts.frag    = 30;
+  opts.shuffle = false;
+  check_archive(&opts);
+  opts.version = 0x103;
+  check_archive(&opts);
+  opts.frag    = 0;
+  opts.shuffle = true;
+  check_archive(&opts);
+  puts("synth_check: OK");
+  return 0;
+}
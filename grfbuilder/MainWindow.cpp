@@ -133,7 +133,7 @@ static bool grf_callback_caller(void *MW_, void *grf, int pos, int max, const ch
   return MW->progress_callback(grf, pos, max);
 }
 
-QString MainWindow::showSizeAsString(unsigned int s) {
+QString MainWindow::showSizeAsString(quint64 s) {
   if (s > (1024 * 1024 * 1024 * 1.4)) {
     return tr("%1 GiB").arg((double)(s / (1024 * 1024 * 1024)), 0, 'f', 1);
   }
@@ -147,25 +147,26 @@ QString MainWindow::showSizeAsString(unsigned int s) {
 }
 
 unsigned int MainWindow::fillFilesTree(void *dir, QTreeWidgetItem *parent) {
-  void **list             = grf_tree_list_node(dir);
+  grf_cursor cursor       = GRF_CURSOR_INIT;
   unsigned int total_size = 0;
   QBrush fg_des(qRgb(0, 0x80, 0));
   QBrush fg_mixcrypt(qRgb(0, 0, 255));
-  for (int i = 0; list[i] != NULL; i++) {
+  void *entry;
+  while ((entry = grf_tree_iterate(dir, &cursor)) != NULL) {
     unsigned int s;
     QTreeWidgetItem *__f;
-    if (grf_tree_is_dir(list[i])) {
+    if (grf_tree_is_dir(entry)) {
       __f = new QTreeWidgetItem(parent, -1);
-      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(list[i]))));  // name
-      s = MainWindow::fillFilesTree(list[i], __f);
+      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(entry))));  // name
+      s = MainWindow::fillFilesTree(entry, __f);
       total_size += s;
       // __f->setText(1, QString("[%1]").arg(s));
       __f->setText(1, QString("[") + this->showSizeAsString(s) + QString("]"));  // realsize
     } else {
-      void *f            = grf_tree_get_file(list[i]);
+      void *f            = grf_tree_get_file(entry);
       unsigned int flags = grf_file_get_storage_flags(f);
       __f                = new QTreeWidgetItem(parent, grf_file_get_id(f));
-      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(list[i]))));  // name
+      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(entry))));  // name
       if ((flags & GRF_FLAG_MIXCRYPT) == GRF_FLAG_MIXCRYPT) {
         __f->setForeground(0, fg_mixcrypt);
         __f->setForeground(1, fg_mixcrypt);
@@ -178,30 +179,30 @@ unsigned int MainWindow::fillFilesTree(void *dir, QTreeWidgetItem *parent) {
       __f->setText(1, this->showSizeAsString(s));  // realsize
     }
   }
-  delete list;
   return total_size;
 }
 
 unsigned int MainWindow::fillFilesTree(void *dir, QTreeWidget *parent) {
-  void **list             = grf_tree_list_node(dir);
+  grf_cursor cursor       = GRF_CURSOR_INIT;
   unsigned int total_size = 0;
   QBrush fg_des(qRgb(0, 0x80, 0));
   QBrush fg_mixcrypt(qRgb(0, 0, 255));
-  for (int i = 0; list[i] != NULL; i++) {
+  void *entry;
+  while ((entry = grf_tree_iterate(dir, &cursor)) != NULL) {
     unsigned int s;
     QTreeWidgetItem *__f;
-    if (grf_tree_is_dir(list[i])) {
+    if (grf_tree_is_dir(entry)) {
       __f = new QTreeWidgetItem(parent, -1);
-      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(list[i]))));  // name
-      s = MainWindow::fillFilesTree(list[i], __f);
+      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(entry))));  // name
+      s = MainWindow::fillFilesTree(entry, __f);
       total_size += s;
       // __f->setText(1, QString("[%1]").arg(s));
       __f->setText(1, QString("[") + this->showSizeAsString(s) + QString("]"));  // realsize
     } else {
-      void *f            = grf_tree_get_file(list[i]);
+      void *f            = grf_tree_get_file(entry);
       unsigned int flags = grf_file_get_storage_flags(f);
       __f                = new QTreeWidgetItem(parent, grf_file_get_id(f));
-      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(list[i]))));  // name
+      __f->setText(0, QString::fromUtf8(euc_kr_to_utf8(grf_tree_get_name(entry))));  // name
       if ((flags & GRF_FLAG_MIXCRYPT) == GRF_FLAG_MIXCRYPT) {
         __f->setForeground(0, fg_mixcrypt);
         __f->setForeground(1, fg_mixcrypt);
@@ -214,7 +215,6 @@ unsigned int MainWindow::fillFilesTree(void *dir, QTreeWidget *parent) {
       __f->setText(1, this->showSizeAsString(s));  // realsize
     }
   }
-  delete list;
   return total_size;
 }
 
@@ -244,7 +244,6 @@ void MainWindow::RefreshAfterLoad() {
   QBrush fg_des(qRgb(0, 0x80, 0));
   QBrush fg_mixcrypt(qRgb(0, 0, 255));
   ui.tab_sel->setCurrentIndex(0);
-  grf_update_id_list(this->grf);
   f = grf_get_file_first(this->grf);
   ui.view_allfiles->clear();
   while (f != NULL) {
@@ -257,7 +256,7 @@ void MainWindow::RefreshAfterLoad() {
     }
     __item->setText(0, this->showSizeAsString(grf_file_get_storage_size(f)));  // compsize
     __item->setText(1, this->showSizeAsString(grf_file_get_size(f)));          // realsize
-    __item->setText(2, QString("%1").arg(grf_file_get_storage_pos(f)));        // pos
+    __item->setText(2, QString("%1").arg(grf_file_get_storage_pos64(f)));      // pos
     // if (euc_kr_to_utf8(grf_file_get_filename(f)) == NULL) printf("ARGH %s\n", grf_file_get_filename(f));
     __item->setText(3, QString::fromUtf8(euc_kr_to_utf8(grf_file_get_filename(f))));  // name
     // __item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsUserCheckable | Qt::ItemIsEnabled |
@@ -306,10 +305,10 @@ static bool grf_repack_callback_caller(void *PROG_, void *grf, int pos, int max,
 void MainWindow::on_btn_repack_clicked() {
   double gained_space;
   if (this->grf == NULL) return;
-  gained_space = (grf_wasted_space(this->grf) * 100 / this->grf_file.size());
+  gained_space = (grf_wasted_space64(this->grf) * 100 / this->grf_file.size());
   if (QMessageBox::question(this, tr("GrfBuilder"), tr("Repacking this file will reduce it by %1% (%2). Do you want to continue?")
                                                         .arg(gained_space, 0, 'f', 1)
-                                                        .arg(this->showSizeAsString(grf_wasted_space(this->grf))),
+                                                        .arg(this->showSizeAsString(grf_wasted_space64(this->grf))),
                             QMessageBox::Ok | QMessageBox::Cancel, QMessageBox::Ok) == QMessageBox::Cancel)
     return;
   QProgressDialog prog(tr("Repack in progress..."), tr("Cancel"), 0, grf_filecount(this->grf), this);
@@ -393,7 +392,8 @@ void MainWindow::on_btn_mergedir_clicked() {
   this->do_recurse_dirscan(&l, xpath, QString("data\\"));
   // printf("Found %d files\n", l.size());
   prog.setRange(0, l.size());
-  // ok now, loop the files, open each, and add to grf
+  // ok now, loop the files, open each, and add to grf (the files table is written once, at the end)
+  grf_begin(this->grf);
   while (l.size() > 0) {
     struct files_list *x = l.takeLast();
     prog.setLabelText(tr("Adding file `%1'...").arg(x->p));
@@ -409,7 +409,7 @@ void MainWindow::on_btn_mergedir_clicked() {
     x->f.close();
     delete x;
   }
-  grf_save(this->grf);
+  grf_commit(this->grf);
 
   prog.close();
   prog.reset();
@@ -1019,15 +1019,21 @@ void MainWindow::DoUpdateFilter(QString text) {
   if (this->last_search == text) return;
   this->last_search = text;
   QTreeWidgetItemIterator it(ui.view_allfiles, QTreeWidgetItemIterator::NoChildren);
-  QRegExp r(text, Qt::CaseInsensitive, QRegExp::Wildcard);
-  bool match;
+  void *search = grf_search_compile(utf8_to_euc_kr(text.toUtf8().constData()), GRF_SEARCH_BASENAME);
+  uint32_t *ids, count = 0;
   int i = 0, max = grf_filecount(this->grf);
   ui.viewSearch->clear();
+  if (search == NULL) return;
+  // match the names once in the lib, then only pick the matching items
+  count = grf_search_run(this->grf, search, 0, &ids);
+  grf_search_free(search);
+  int id_max = grf_get_id_list_size(this->grf);
+  QVector<bool> match(id_max + 1, false);
+  for (uint32_t j = 0; j < count; j++)
+    if (ids[j] < (uint32_t)id_max) match[ids[j]] = true;
+  if (ids != NULL) free(ids);
   while (*it) {
-    void *cur_file    = grf_get_file_by_id(this->grf, (*it)->type());
-    match             = r.exactMatch(QString::fromUtf8(euc_kr_to_utf8(grf_file_get_filename(cur_file))));
-    if (!match) match = r.exactMatch(QString::fromUtf8(euc_kr_to_utf8(grf_file_get_basename(cur_file))));
-    if (match) {
+    if (((*it)->type() >= 0) && ((*it)->type() < id_max) && match[(*it)->type()]) {
       QTreeWidgetItem *__item = new QTreeWidgetItem(ui.viewSearch, (*it)->type());
       __item->setText(0, (*it)->text(0));
       __item->setText(1, (*it)->text(1));  // compsize
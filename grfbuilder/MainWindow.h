@@ -113,7 +113,7 @@ class MainWindow : public QMainWindow {
   void do_display_wav(void *);
   void DoUpdateFilter(QString);
   void doOpenFileById(int);
-  QString showSizeAsString(unsigned int);
+  QString showSizeAsString(quint64);
   void setCompressionLevel(int);
   void setRepackType(int);
   void RefreshAfterLoad();
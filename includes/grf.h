@@ -29,8 +29,8 @@
 #endif
 
 #define VERSION_MAJOR 0
-#define VERSION_MINOR 1
-#define VERSION_REVISION 31
+#define VERSION_MINOR 2
+#define VERSION_REVISION 0
 
 #ifdef __WIN32
 #define VERSION_TYPE "Win32"
@@ -57,6 +57,9 @@
 typedef struct grf_handler *grf_handle;
 typedef struct grf_node *grf_node;
 typedef struct grf_treenode *grf_treenode;
+typedef struct grf_vfs *grf_vfs;
+typedef struct grf_vfs_entry *grf_vfs_file;
+typedef struct grf_search *grf_search;
 #define __LIBGRF_HAS_TYPEDEF
 
 struct grf_node {
@@ -64,37 +67,146 @@ struct grf_node {
   struct grf_handler *parent;
   struct grf_treenode *tree_parent;
   char *filename, flags;
-  uint32_t size, len, len_aligned, pos, id;
+  uint32_t size, len, len_aligned, id;
+  uint64_t pos;
   int cycle;
 };
 
 struct grf_treenode {
   bool is_dir;
-  char *name;
-  hash_table *subdir;
+  bool loaded;                  /* directory entries created (lazy tree) */
+  char *name;                   /* stored in the tree arena */
+  struct grf_treenode **child;  /* directory entries, sorted by name */
+  uint32_t child_count, child_alloc;
   struct grf_node *ptr;
   struct grf_treenode *parent;
+  struct grf_handler *grf; /* root only */
+};
+
+struct grf_tree_arena {
+  struct grf_tree_arena *next;
+  size_t used, size;
+  char data[];
 };
 
 struct grf_handler {
-  uint32_t filecount, table_offset, table_size, wasted_space;
+  uint32_t filecount, table_size;
+  uint64_t table_offset, wasted_space;
   uint32_t version;
   int fd;
   int compression_level;
   bool need_save, write_mode;
-  struct grf_node *first_node;
+  uint32_t transaction; /* grf_begin() nesting level */
+  uint8_t sync_policy;
+  struct grf_node *first_node, *last_node; /* files, sorted by position */
   hash_table *fast_table;
   struct grf_treenode *root;
+  struct grf_tree_arena *tree_arena; /* tree names and nodes */
+  bool tree_lazy;                    /* directories are filled when first listed */
   bool (*callback)(void *, grf_handle, int, int, const char *);
   void *callback_etc;
-  struct grf_node **node_table;
+  uint32_t progress_pos, progress_max; /* running long operation, read with grf_progress() from any thread */
+  uint32_t progress_interval;          /* ms between two callback calls */
+  uint64_t progress_next;              /* time of the next callback call, 0 = right away */
+  bool cancel;                         /* set by grf_cancel() */
+  struct grf_stats *stats;             /* grf_stats_enable(), NULL when disabled */
+  struct grf_node **node_table;              /* indexed by ID, NULL for IDs of deleted files */
+  uint32_t id_count, id_alloc;               /* IDs given so far, size of node_table */
+  uint32_t *id_free, id_free_count, id_free_alloc; /* IDs of deleted files, to reuse */
+  bool trace_enabled;
+  uint32_t *trace, trace_count, trace_alloc; /* IDs of the files read since grf_trace_start() */
+  struct grf_vfs *vfs;                       /* grf_vfs this grf is mounted in, if any */
+  bool bloom_enabled;
+  uint64_t *bloom; /* Bloom filter of the filenames, see grf_file_may_exist() */
+  uint32_t bloom_bits, bloom_count, bloom_stale;
+  struct grf_node **sorted; /* files sorted by name, built on demand, see grf_sorted_get() */
+  uint32_t sorted_count;
+  bool sorted_valid;
+  char *names; /* normalized copy of the filenames, for grf_search_run() */
+  uint32_t *names_off, names_count;
+  struct grf_node **names_node;
+  bool names_valid;
+  struct grf_ext *exts; /* extensions, sorted */
+  uint32_t ext_count;
+  struct grf_node **ext_nodes; /* files grouped by extension */
+  bool ext_valid;
+  struct grf_compact *compact; /* files store of grf_load_compact(), NULL otherwise */
+};
+
+struct grf_ext {
+  char *name; /* lower case, without the dot */
+  uint32_t first, count; /* files in grf_handler.ext_nodes */
+  uint64_t size, len;
+};
+
+/* read-only files store: one entry per file, sorted by position, the entry
+ * index being the file ID. grf_node handles are only created when asked for.
+ * A lazy store (grf_load_lazy) keeps the inflated table instead, entries being
+ * in table order and only read from it when their handle is created. */
+struct grf_compact {
+  uint32_t count;
+  bool lazy, large;
+  uint64_t *pos;
+  uint32_t *len, *len_aligned, *size;
+  uint32_t *name; /* offset in names */
+  uint8_t *flags;
+  char *names;
+  char *table;  /* lazy: files table */
+  uint32_t *off; /* lazy: offset of each entry in table */
+  uint32_t *slots, slot_mask; /* open addressing on the filenames, entry + 1 (0 = free) */
+  struct grf_node **nodes;    /* handles given so far, by entry */
+};
+
+struct grf_vfs_layer {
+  struct grf_handler *grf; /* NULL for a directory */
+  char *path;              /* directory */
+  int priority;
+  uint32_t seq; /* mount order, the last mounted wins on same priority */
+};
+
+struct grf_vfs_entry {
+  struct grf_vfs_layer *layer;
+  struct grf_node *node; /* NULL if the file is in a directory */
+  char *path;            /* else, its full path */
+};
+
+struct grf_vfs {
+  struct grf_vfs_layer **layers; /* winning layer first */
+  uint32_t layer_count, seq;
+  hash_table *index; /* filename -> winning struct grf_vfs_entry */
+};
+
+struct grf_search_chunk {
+  char *str; /* part of the pattern between two '*' */
+  size_t len;
+  bool wild; /* contains '?' */
+};
+
+struct grf_search {
+  int flags;
+  bool anchor_start, anchor_end; /* pattern doesn't start/end with '*' */
+  uint32_t chunk_count;
+  struct grf_search_chunk *chunks;
+  char *str; /* normalized pattern, chunks point inside */
 };
 
 #define GRF_HEADER_SIZE 0x2e /* sizeof(grf_header) */
 #define GRF_HEADER_MAGIC "Master of Magic"
 #define GRF_FILE_OUTPUT_VERISON 0x200
+#define GRF_FILE_LARGE_VERSION 0x300 /* used instead of 0x200 when the files table can't be placed below 4GB */
 #define GRF_HASH_TABLE_SIZE 128
-#define GRF_TREE_HASH_SIZE 32
+#define GRF_TREE_ARENA_SIZE 65536
+#define GRF_VFS_HASH_SIZE 1024 /* initial size, grows with the number of files */
+#define GRF_BLOOM_BITS_PER_FILE 10 /* with 5 hashes, about 1% false positives */
+#define GRF_BLOOM_HASHES 5
+#ifndef GRF_TABLE_CHUNK
+#define GRF_TABLE_CHUNK 65536 /* the files table is inflated and parsed by chunks of that size */
+#endif
+#define GRF_LOAD_THREADS_MAX 16
+#define GRF_PROGRESS_INTERVAL 50 /* default ms between two progress callback calls */
+#ifndef GRF_LOAD_THREADS_MIN_FILES
+#define GRF_LOAD_THREADS_MIN_FILES 65536 /* smaller tables are loaded on one thread */
+#endif
 
 /* values specific to all directories */
 #define GRF_DIRECTORY_LEN 1094
@@ -107,9 +219,9 @@ struct grf_header {
   char header_magic[16];                           // "Master of Magic" + 0x00
   char header_key[14];                             // 0x01 -> 0x0e, or 0x00 -> 0x00 (no crypt)
   uint32_t offset __attribute__((__packed__));     // offset of file table
-  uint32_t seed __attribute__((__packed__));       //
-  uint32_t filecount __attribute__((__packed__));  // Real filecount = filecount - seed - 7
-  uint32_t version __attribute__((__packed__));    // 0x102 0x103 0x200 0xCACA
+  uint32_t seed __attribute__((__packed__));       // 0x300: high 32 bits of offset
+  uint32_t filecount __attribute__((__packed__));  // Real filecount = filecount - seed - 7 (0x300: filecount - 7)
+  uint32_t version __attribute__((__packed__));    // 0x102 0x103 0x200 0x300 0xCACA
 };
 
 struct grf_table_entry_data {
@@ -121,10 +233,89 @@ struct grf_table_entry_data {
   uint32_t pos __attribute__((__packed__));          // position in the grf
 };
 
-int zlib_buffer_inflate(void *, int, void *, int);      /* private: zlib.c */
-int zlib_buffer_deflate(void *, int, void *, int, int); /* private: zlib.c */
+/* 0x300 table entry, same as above with a 64 bits position */
+struct grf_table_entry_data64 {
+  uint32_t len __attribute__((__packed__));
+  uint32_t len_aligned __attribute__((__packed__));
+  uint32_t size __attribute__((__packed__));
+  uint8_t flags;
+  uint64_t pos __attribute__((__packed__));
+};
+
+/* grf_repack() journal, stored right after the (original) files table while the
+ * header says 0xCACA. Two slots are written alternately, the valid one with the
+ * highest seq wins. Data of the pending batch (if any) follows the two slots. */
+#define GRF_REPACK_JOURNAL_MAGIC "RPKJ"
+#define GRF_REPACK_LARGE 0x10000 /* 0xCACA header flag: the table is a 0x300 one */
+#ifndef GRF_REPACK_BATCH_SIZE
+#define GRF_REPACK_BATCH_SIZE (8 * 1024 * 1024) /* bytes moved between two checkpoints */
+#endif
+
+struct grf_repack_journal {
+  char magic[4];                                  // GRF_REPACK_JOURNAL_MAGIC
+  uint32_t seq __attribute__((__packed__));       // incremented on each write
+  uint32_t done __attribute__((__packed__));      // entries (in table order) already at their final position
+  uint32_t count __attribute__((__packed__));     // entries in the pending batch, 0 if none
+  uint32_t data_len __attribute__((__packed__));  // batch data stored after the slots, 0 = replay from original position
+  uint32_t data_crc __attribute__((__packed__));  // crc32 of the batch data
+  uint32_t reserved __attribute__((__packed__));  //
+  uint32_t crc __attribute__((__packed__));       // crc32 of all the previous fields
+};
+
+int zlib_buffer_inflate(void *, int, void *, int);                                   /* private: zlib.c */
+int zlib_buffer_deflate(void *, int, void *, int, int);                              /* private: zlib.c */
+struct zlib_stream *zlib_stream_open(int, uint32_t, uint32_t *, struct grf_stats *); /* private: zlib.c */
+int zlib_stream_read(struct zlib_stream *, void *, int);                             /* private: zlib.c */
+void zlib_stream_close(struct zlib_stream *);                                        /* private: zlib.c */
+void vfs_update_file(struct grf_vfs *, const char *);                                /* private: vfs.c */
+uint64_t prv_grf_usec(void);                                                         /* private: grf.c */
+void prv_grf_stat_time(struct grf_stats *, int, uint64_t);                           /* private: grf.c */
+
+/* relaxed atomic access, for the values polled from other threads */
+#ifdef __GNUC__
+#define GRF_ATOMIC_GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define GRF_ATOMIC_SET(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+#define GRF_ATOMIC_ADD(v, x) __atomic_fetch_add(&(v), (x), __ATOMIC_RELAXED)
+#else
+#define GRF_ATOMIC_GET(v) (v)
+#define GRF_ATOMIC_SET(v, x) ((v) = (x))
+#define GRF_ATOMIC_ADD(v, x) ((v) += (x))
+#endif
+
+/* stats recording, s being a struct grf_stats pointer (NULL when disabled) */
+#define GRF_STAT_START(s) (((s) != NULL) ? prv_grf_usec() : 0)
+#define GRF_STAT_END(s, phase, t0)                    \
+  do {                                                \
+    if ((s) != NULL) prv_grf_stat_time(s, phase, t0); \
+  } while (0)
+#define GRF_STAT_ADD(s, field, n)                   \
+  do {                                              \
+    if ((s) != NULL) GRF_ATOMIC_ADD((s)->field, n); \
+  } while (0)
+
+/* static tracepoints for perf/bpftrace (cmake -DGRF_USDT=ON), provider "libgrf":
+ *   load(handle, filecount, version, ok, usec)       get_contents(handle, id, len, result, usec)
+ *   des(len, cycle, usec)                             inflate(srclen, destlen, result, usec)
+ *   deflate(srclen, result, level, usec)              file_add(handle, id, size, len, usec)
+ *   save(handle, filecount, ok, usec)
+ * Without GRF_USDT, nothing is compiled in, the clock isn't even read. */
+#ifdef GRF_USDT
+#include <sys/sdt.h>
+#define GRF_TRACE_START() prv_grf_usec()
+#define GRF_TRACE_ELAPSED(t0) (prv_grf_usec() - (t0))
+#define GRF_TRACE(name, ...) STAP_PROBEV(libgrf, name, __VA_ARGS__)
+#else
+static inline void prv_grf_trace_nop(int unused, ...) { (void)unused; }
+#define GRF_TRACE_START() 0
+#define GRF_TRACE_ELAPSED(t0) (0 * (t0))
+#define GRF_TRACE(name, ...)                        \
+  do {                                              \
+    if (0) prv_grf_trace_nop(0, __VA_ARGS__);       \
+  } while (0)
+#endif
 
 #define MAX(a, b) ((a > b) ? a : b)
+#define MIN(a, b) ((a < b) ? a : b)
 
 #include "libgrf.h"
 
@@ -49,9 +49,13 @@ list_element *hash_lookup_raw(hash_table *, const char *);
 void *hash_lookup(hash_table *, const char *);
 int hash_set_element(hash_table *, char *, void *, int);
 int hash_add_element(hash_table *, char *, void *);
+list_element *hash_prepare_element(hash_table *, const char *, void *, unsigned long *);
+int hash_insert_element(hash_table *, list_element *, unsigned long);
+int hash_resize(hash_table *, unsigned long);
 int hash_del_element(hash_table *, char *);
 int hash_remove_element(hash_table *, char *);
 void hash_free_table(hash_table *);
+list_element *hash_next(hash_table *, unsigned long *, list_element *);
 list_element **hash_foreach(hash_table *);
 void **hash_foreach_val(hash_table *);
 
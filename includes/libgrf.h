@@ -28,6 +28,7 @@ extern "C" {
 #else  /* __STDC_VERSION__ >= 199901L */
 /* We're most likely using ANSI C (C89), which does not provide bool, etc..
  * Let's use typedef for a few things... */
+typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t;
 typedef unsigned char uint8_t;
 #ifndef __bool_true_false_are_defined
@@ -55,9 +56,60 @@ typedef int bool;
 typedef void *grf_handle;
 typedef void *grf_node;
 typedef void *grf_treenode;
+typedef void *grf_vfs;
+typedef void *grf_vfs_file;
+typedef void *grf_search;
 #define __LIBGRF_HAS_TYPEDEF
 #endif
 
+/* Cursor of the iteration functions (grf_file_iterate(), grf_tree_iterate()).
+ * Start with a zeroed one (GRF_CURSOR_INIT), and don't change the GRF while
+ * iterating.
+ */
+typedef struct grf_cursor {
+  void *ptr;
+  unsigned long pos;
+} grf_cursor;
+#define GRF_CURSOR_INIT \
+  { 0, 0 }
+
+/* What grf_probe() finds about a GRF file */
+typedef struct grf_probe_info {
+  uint32_t version;         /* 0x102, 0x103, 0x200, 0x300 or 0xCACA (interrupted repack) */
+  uint32_t filecount;       /* table entries, directories included, as said by the header */
+  uint64_t file_size;
+  uint64_t table_offset;    /* from the start of the file */
+  uint32_t table_size;      /* as stored (compressed) */
+  uint32_t table_real_size; /* once inflated */
+  /* with GRF_PROBE_TABLE */
+  uint32_t table_crc;    /* crc32 of the stored table */
+  uint32_t files;        /* same as grf_filecount(), 0x200 and newer only */
+  uint64_t wasted_space; /* same as grf_wasted_space64(), 0x200 and newer only */
+} grf_probe_info;
+
+/* Phases timed by the stats (grf_stats_enable()) */
+#define GRF_STAT_TABLE_READ 0    /* reading the files table */
+#define GRF_STAT_TABLE_INFLATE 1 /* inflating it */
+#define GRF_STAT_TABLE_PARSE 2   /* building the files list out of it */
+#define GRF_STAT_SORT 3          /* sorting the files by position */
+#define GRF_STAT_TREE 4          /* grf_create_tree() */
+#define GRF_STAT_DES 5           /* decrypting files */
+#define GRF_STAT_INFLATE 6       /* inflating files */
+#define GRF_STAT_DEFLATE 7       /* compressing added files */
+#define GRF_STAT_WRITE 8         /* any write to the archive, the table too */
+#define GRF_STAT_TABLE_SAVE 9    /* writing the files table and header */
+#define GRF_STAT_PHASES 10
+
+/* What grf_stats_get() returns */
+typedef struct grf_stats {
+  uint64_t time[GRF_STAT_PHASES];     /* microseconds spent in each phase */
+  uint64_t count[GRF_STAT_PHASES];    /* times each phase was entered */
+  uint64_t bytes_read, bytes_written; /* archive I/O */
+  uint64_t lookups, lookup_hits;      /* grf_get_file() calls, and files found */
+  uint64_t bloom_rejects;             /* lookups answered by the Bloom filter alone */
+  uint64_t allocs;                    /* file handles and data buffers allocated */
+} grf_stats;
+
 /* Some defines used by grf_merge() and grf_repack() :
  *  - GRF_REPACK_FAST
  *    only move data, do not care about what we move
@@ -73,6 +125,16 @@ typedef void *grf_treenode;
 #define GRF_REPACK_DECRYPT 2
 #define GRF_REPACK_RECOMPRESS 3
 
+/* Policies for grf_set_sync_policy() :
+ *  - GRF_SYNC_NONE
+ *    leave it to the system (default)
+ *  - GRF_SYNC_SAVE
+ *    on each actual save, fsync() the files data before writing the files
+ *    table, and the table once written
+ */
+#define GRF_SYNC_NONE 0
+#define GRF_SYNC_SAVE 1
+
 /* do not ask questions about that */
 #define GRF_FLAG_FILE 1
 #define GRF_FLAG_MIXCRYPT 2
@@ -127,11 +189,50 @@ GRFEXPORT grf_handle grf_load(const char *, bool); /* grf.c */
  */
 GRFEXPORT grf_handle grf_load_from_new(grf_handle); /* grf.c */
 
+/* (grf_handle) grf_load_compact(const char *filename)
+ * Loads filename read-only, keeping the files table as packed arrays instead
+ * of one grf_node per file, which takes a fraction of the memory. The
+ * grf_node of a file is only created when a lookup, an ID or an iteration
+ * reaches it, and stays valid until grf_free(). File IDs follow the storage
+ * order. Only lookups, iteration and reading functions are available on such
+ * a handle: trees, sorted/extension indexes, search and vfs mounting are not.
+ * Versions older than 0x200 are loaded the regular way.
+ */
+GRFEXPORT grf_handle grf_load_compact(const char *); /* grf.c */
+
+/* (grf_handle) grf_load_lazy(const char *filename)
+ * Same as grf_load_compact(), but the files table is only indexed, not
+ * parsed: opening costs little more than inflating it, which suits tools
+ * looking up a few files in a big archive. File IDs and iteration follow the
+ * table order instead of the storage order, and overlapping files aren't
+ * detected.
+ */
+GRFEXPORT grf_handle grf_load_lazy(const char *); /* grf.c */
+
 /* (bool) grf_save(grf_handle handle)
- * Write the grf's files table to disk.
+ * Write the grf's files table to disk. Nothing is written if no change was
+ * made since the last save, and inside a grf_begin()/grf_commit() block the
+ * write is left to grf_commit().
  */
 GRFEXPORT bool grf_save(grf_handle); /* grf.c */
 
+/* (bool) grf_begin(grf_handle handle)
+ * (bool) grf_commit(grf_handle handle)
+ * Group many grf_file_add(), grf_file_delete(), grf_file_rename() etc. so
+ * the files table gets written only once, by grf_commit(). Calls to
+ * grf_save() in between do nothing. Blocks can be nested, only the outermost
+ * grf_commit() writes. grf_begin() fails on read-only grf, grf_commit() fails
+ * without a matching grf_begin() or if the save fails.
+ * Until grf_commit(), the archive on disk stays the one of grf_begin(): new
+ * data is written after its files table instead of in the holes, which are
+ * reused again once committed. grf_repack(), grf_repack_layout() and
+ * grf_defrag_step() don't run, and loading an archive whose repack was
+ * interrupted (see grf_repack()) fails, as finishing it rewrites the archive.
+ * grf_free() commits a pending block.
+ */
+GRFEXPORT bool grf_begin(grf_handle);  /* grf.c */
+GRFEXPORT bool grf_commit(grf_handle); /* grf.c */
+
 /* grf_free(grf_handle handle)
  * Free a GRF file and all the memory used by it, and closes the grf's fd.
  * If any change was made to the grf, grf_free() will call grf_save() just
@@ -145,10 +246,30 @@ GRFEXPORT void grf_free(grf_handle); /* grf.c */
  * Callback: bool callback(void *param, grf_handle handle, int position,
  * 		int max, const char *filename)
  * Defines a callback function for all the long operations. This includes
- * loading, repack, merge, etc...
+ * loading, repack, merge, etc... The callback is called at most once per
+ * progress interval (see grf_set_progress_interval()), plus once with a NULL
+ * filename when the operation completes. Returning false stops the operation,
+ * like grf_cancel().
  */
 GRFEXPORT void grf_set_callback(grf_handle, bool (*)(void *, grf_handle, int, int, const char *), void *); /* grf.c */
 
+/* grf_set_progress_interval(grf_handle handle, uint32_t msec)
+ * Minimum time between two calls of the callback, GRF_PROGRESS_INTERVAL (50ms)
+ * by default. 0 calls it on each step. */
+GRFEXPORT void grf_set_progress_interval(grf_handle, uint32_t); /* grf.c */
+
+/* (uint32_t) grf_progress(grf_handle handle, uint32_t *max)
+ * Returns the position of the running (or last) long operation, and sets max
+ * if not NULL. Can be polled from another thread, instead of using a callback.
+ */
+GRFEXPORT uint32_t grf_progress(grf_handle, uint32_t *); /* grf.c */
+
+/* grf_cancel(grf_handle handle)
+ * Stops the running long operation at its next step, can be called from
+ * another thread. A stopped load or repack fails (the repack is resumed by the
+ * next grf_load()), a stopped merge keeps what was already done. */
+GRFEXPORT void grf_cancel(grf_handle); /* grf.c */
+
 /* grf_set_compression_level(grf_handle handle, int level)
  * Sets the compression level used on this GRF file. This affects newly added
  * files, repack/merge when using GRF_REPACK_RECOMPRESS mode, and files table.
@@ -156,6 +277,10 @@ GRFEXPORT void grf_set_callback(grf_handle, bool (*)(void *, grf_handle, int, in
  * compression) and 9. */
 GRFEXPORT void grf_set_compression_level(grf_handle, int); /* grf.c */
 
+/* grf_set_sync_policy(grf_handle handle, uint8_t policy)
+ * Defines when data is forced to the disk, see GRF_SYNC_* */
+GRFEXPORT void grf_set_sync_policy(grf_handle, uint8_t); /* grf.c */
+
 /* (unsigned int) grf_filecount(grf_handle handle)
  * Returns the number of files currently in the GRF. Directory entries are
  * excluded from this count.
@@ -163,12 +288,28 @@ GRFEXPORT void grf_set_compression_level(grf_handle, int); /* grf.c */
 GRFEXPORT uint32_t grf_filecount(grf_handle); /* grf.c */
 
 /* (unsigned int) grf_wasted_space(void *handle)
+ * (uint64_t) grf_wasted_space64(void *handle)
  * Returns the amount of data (in bytes) that would be theorically saved if the
  * file gets repacked.
  * A good application would be to check this value each time the patch client is
  * run, and ask the user about repacking if the value is over 20MB.
+ * The 32 bits version returns 0xFFFFFFFF if the value doesn't fit.
  */
-GRFEXPORT uint32_t grf_wasted_space(grf_handle); /* grf.c */
+GRFEXPORT uint32_t grf_wasted_space(grf_handle);   /* grf.c */
+GRFEXPORT uint64_t grf_wasted_space64(grf_handle); /* grf.c */
+
+/* (bool) grf_probe(const char *filename, grf_probe_info *info, int flags)
+ * (bool) grf_probe_fd(int fd, grf_probe_info *info, int flags)
+ * Fills info from the header and table preamble of a GRF file without loading
+ * it. With GRF_PROBE_TABLE, the table is also read and inflated by chunks to
+ * get its checksum, files count and wasted space, still without keeping any
+ * of it. Both are reentrant, so many files can be probed in parallel (with
+ * one fd each for grf_probe_fd()). Returns false if the file isn't a valid
+ * GRF.
+ */
+#define GRF_PROBE_TABLE 1
+GRFEXPORT bool grf_probe(const char *, grf_probe_info *, int); /* grf.c */
+GRFEXPORT bool grf_probe_fd(int, grf_probe_info *, int);       /* grf.c */
 
 /*****************************************************************************
  **************************** FILES FUNCTIONS ********************************
@@ -190,6 +331,20 @@ GRFEXPORT grf_node grf_file_add_path(grf_handle, const char *, const char *); /*
  */
 GRFEXPORT grf_node grf_get_file(grf_handle, const char *); /* grf.c */
 
+/* (bool) grf_file_may_exist(grf_handle handle, const char *filename)
+ * Quick check against a Bloom filter of the filenames: false means the file
+ * is surely not in the GRF, true that it probably is (about 1% of false
+ * positives). grf_get_file() already uses it, this is useful to skip a GRF
+ * cheaply when searching several of them.
+ */
+GRFEXPORT bool grf_file_may_exist(grf_handle, const char *); /* grf.c */
+
+/* grf_set_bloom(grf_handle handle, bool enable)
+ * The filter is enabled by default and costs about 10 bits per file, it can
+ * be disabled (and freed) here.
+ */
+GRFEXPORT void grf_set_bloom(grf_handle, bool); /* grf.c */
+
 /* (const char *) grf_file_get_filename(grf_node)
  * Returns the full filename of a file.
  */
@@ -206,9 +361,13 @@ GRFEXPORT const char *grf_file_get_basename(grf_node); /* grf.c */
 GRFEXPORT uint32_t grf_file_get_size(grf_node); /* grf.c */
 
 /* (unsigned int) grf_file_get_storage_pos(grf_node)
- * Returns the position of the file in the archive.
+ * (uint64_t) grf_file_get_storage_pos64(grf_node)
+ * Returns the position of the file in the archive. Archives larger than 4GB
+ * (version 0x300) need the 64 bits version, the other one returns 0xFFFFFFFF
+ * for files stored after 4GB.
  */
-GRFEXPORT uint32_t grf_file_get_storage_pos(grf_node); /* grf.c */
+GRFEXPORT uint32_t grf_file_get_storage_pos(grf_node);   /* grf.c */
+GRFEXPORT uint64_t grf_file_get_storage_pos64(grf_node); /* grf.c */
 
 /* (unsigned int) grf_file_get_storage_size(grf_node)
  * Returns the real (compressed) size of the file.
@@ -271,6 +430,14 @@ GRFEXPORT bool grf_file_delete(grf_node); /* grf.c */
  */
 GRFEXPORT void grf_create_tree(grf_handle); /* grf.c */
 
+/* grf_create_tree_lazy(grf_handle)
+ * Same as grf_create_tree(), but only the root is created. The entries of a
+ * directory are created the first time it is listed (or counted), using the
+ * sorted index, so opening a big GRF only costs the size of what is shown.
+ * grf_file_get_tree() creates the directories leading to the file.
+ */
+GRFEXPORT void grf_create_tree_lazy(grf_handle); /* grf.c */
+
 /* (grf_treenode) grf_tree_get_root(grf_handle)
  * Returns the root node of the tree.
  */
@@ -282,6 +449,12 @@ GRFEXPORT grf_treenode grf_tree_get_root(grf_handle); /* grf.c */
  */
 GRFEXPORT grf_treenode *grf_tree_list_node(grf_treenode); /* grf.c */
 
+/* (grf_treenode) grf_tree_iterate(grf_treenode dir, grf_cursor *cursor)
+ * Returns the next entry of a directory (sorted by name, like
+ * grf_tree_list_node()), or NULL after the last one. Nothing is allocated.
+ */
+GRFEXPORT grf_treenode grf_tree_iterate(grf_treenode, grf_cursor *); /* grf.c */
+
 /* (bool) grf_tree_is_dir(grf_treenode)
  * Return true if this node is a tree. Return false if it's a regular file.
  * There's no other possible type for a node.
@@ -332,6 +505,12 @@ GRFEXPORT uint32_t grf_tree_dir_count_files(grf_treenode); /* grf.c */
  */
 GRFEXPORT grf_node *grf_get_file_list(grf_handle); /* grf.c */
 
+/* (grf_node) grf_file_iterate(grf_handle, grf_cursor *cursor)
+ * Returns the next file of the index, in the same (random) order as
+ * grf_get_file_list(), or NULL after the last one. Nothing is allocated.
+ */
+GRFEXPORT grf_node grf_file_iterate(grf_handle, grf_cursor *); /* grf.c */
+
 /* (grf_node) grf_get_file_first(grf_handle)
  * Returns the first file's node pointer in the GRF, or NULL if no file were
  * found.
@@ -352,14 +531,26 @@ GRFEXPORT grf_node grf_get_file_prev(grf_node); /* grf.c */
  ***************************** FILE ID FUNCTIONS *****************************
  ****************************************************************************/
 
+/* Files are numbered in storage order when the GRF is loaded. A file keeps
+ * its ID until it is deleted, and new files get the ID of a deleted file if
+ * there is one (or a new one), so the list never needs to be recomputed.
+ */
+
 /* (grf_node*) grf_get_file_id_list(grf_handle)
- * Returns the global list of files. The order may change each time you call
- * grf_update_id_list().
+ * Returns the global list of files, indexed by ID. It has
+ * grf_get_id_list_size() entries, those of deleted files being NULL, and may
+ * move in memory when files are added.
  */
 GRFEXPORT grf_node *grf_get_file_id_list(grf_handle);
 
+/* (unsigned int) grf_get_id_list_size(grf_handle)
+ * Returns the number of entries of the ID list (the highest ID + 1).
+ */
+GRFEXPORT uint32_t grf_get_id_list_size(grf_handle); /* grf.c */
+
 /* grf_update_id_list(grf_handle)
- * Recompute the ID list (needed after add/remove)
+ * Numbers the files if this wasn't done yet. IDs are now kept up to date on
+ * add/remove, so calling this is no longer needed.
  */
 GRFEXPORT void grf_update_id_list(grf_handle); /* grf.c */
 
@@ -369,10 +560,92 @@ GRFEXPORT void grf_update_id_list(grf_handle); /* grf.c */
 GRFEXPORT uint32_t grf_file_get_id(grf_node); /* grf.c */
 
 /* (grf_node) grf_get_file_by_id(grf_handle, unsigned int id)
- * Returns the file corresponding to the given ID.
+ * Returns the file corresponding to the given ID, or NULL if there is none.
  */
 GRFEXPORT grf_node grf_get_file_by_id(grf_handle, uint32_t); /* grf.c */
 
+/*****************************************************************************
+ ************************** SORTED INDEX FUNCTIONS ***************************
+ ****************************************************************************/
+
+/* The sorted index lists the files by name (case insensitive, '/' and '\\'
+ * being the same), so everything under a directory is a single range of it.
+ * It is built on the first call, and again after files are added, renamed or
+ * removed. Positions are only valid until the next change.
+ */
+
+/* (unsigned int) grf_sorted_count(grf_handle)
+ * Returns the number of files in the sorted index.
+ */
+GRFEXPORT uint32_t grf_sorted_count(grf_handle); /* grf.c */
+
+/* (grf_node) grf_sorted_get(grf_handle, unsigned int pos)
+ * Returns the file at the given position of the sorted index, or NULL if pos
+ * is out of range.
+ */
+GRFEXPORT grf_node grf_sorted_get(grf_handle, uint32_t); /* grf.c */
+
+/* (unsigned int) grf_sorted_lower_bound(grf_handle, const char *name)
+ * Returns the position of the first file whose name isn't lower than name
+ * (grf_sorted_count() if there is none).
+ */
+GRFEXPORT uint32_t grf_sorted_lower_bound(grf_handle, const char *); /* grf.c */
+
+/* (unsigned int) grf_sorted_prefix(grf_handle, const char *prefix, unsigned int *first)
+ * Returns the number of files whose name starts with prefix, and stores the
+ * position of the first one in *first (if not NULL). For example prefix
+ * "data\\sprite\\" gives every file under that directory.
+ */
+GRFEXPORT uint32_t grf_sorted_prefix(grf_handle, const char *, uint32_t *); /* grf.c */
+
+/* (unsigned int) grf_sorted_count_range(grf_handle, const char *from, const char *to)
+ * Returns the number of files with from <= name < to. A NULL bound means no
+ * limit on that side.
+ */
+GRFEXPORT uint32_t grf_sorted_count_range(grf_handle, const char *, const char *); /* grf.c */
+
+/*****************************************************************************
+ ************************ EXTENSION INDEX FUNCTIONS **************************
+ ****************************************************************************/
+
+/* Files are indexed by extension (lower case, without the dot, "" for files
+ * without one) when the GRF is loaded, and again on the next call after
+ * files are added, renamed or removed. Extensions are numbered from 0 to
+ * grf_ext_count() - 1, in alphabetical order.
+ */
+
+/* (unsigned int) grf_ext_count(grf_handle)
+ * Returns the number of different extensions in the GRF.
+ */
+GRFEXPORT uint32_t grf_ext_count(grf_handle); /* grf.c */
+
+/* (const char *) grf_ext_get_name(grf_handle, unsigned int ext)
+ * Returns the name of an extension, or NULL if it doesn't exist.
+ */
+GRFEXPORT const char *grf_ext_get_name(grf_handle, uint32_t); /* grf.c */
+
+/* (unsigned int) grf_ext_get_filecount(grf_handle, unsigned int ext)
+ * Returns the number of files with that extension.
+ */
+GRFEXPORT uint32_t grf_ext_get_filecount(grf_handle, uint32_t); /* grf.c */
+
+/* (uint64_t) grf_ext_get_size(grf_handle, unsigned int ext)
+ * Returns the total (uncompressed) size of the files with that extension.
+ */
+GRFEXPORT uint64_t grf_ext_get_size(grf_handle, uint32_t); /* grf.c */
+
+/* (uint64_t) grf_ext_get_compressed_size(grf_handle, unsigned int ext)
+ * Returns the total compressed size of the files with that extension.
+ */
+GRFEXPORT uint64_t grf_ext_get_compressed_size(grf_handle, uint32_t); /* grf.c */
+
+/* (grf_node *) grf_ext_get_files(grf_handle, const char *ext, unsigned int *count)
+ * Returns the files having the given extension (case insensitive, with or
+ * without the dot), and stores their number in *count. The list belongs to
+ * the library (don't free it), and is only valid until the next change.
+ */
+GRFEXPORT grf_node *grf_ext_get_files(grf_handle, const char *, uint32_t *); /* grf.c */
+
 /*****************************************************************************
  *************************** GRF MASS OPERATIONS *****************************
  ****************************************************************************/
@@ -390,9 +663,69 @@ GRFEXPORT grf_node grf_get_file_by_id(grf_handle, uint32_t); /* grf.c */
  *   encrypted)
  * - GRF_REPACK_RECOMPRESS (recompress all files, and replace if newly
  *   compressed file is smaller than the one previously stored)
+ * Progress is journaled in the file: if the repack gets interrupted (crash,
+ * power loss, ...), the next grf_load() resumes it from the last checkpoint
+ * (or, for read-only opens, just finds the files where they currently are).
+ * Returns false if the repack failed or was canceled (see grf_cancel()); the
+ * journal is then kept, and the repack is resumed by the next grf_load().
  */
 GRFEXPORT bool grf_repack(grf_handle, uint8_t);
 
+/* Layouts for grf_repack_layout() :
+ *  - GRF_LAYOUT_DIRECTORY
+ *    files are sorted by full name, so each directory ends up in one block
+ *  - GRF_LAYOUT_TRACE
+ *    files are stored in the order they appear in an access trace (see
+ *    grf_trace_start()), files not found in the trace follow, by directory
+ */
+#define GRF_LAYOUT_DIRECTORY 1
+#define GRF_LAYOUT_TRACE 2
+
+/* (bool) grf_repack_layout(grf_handle, char options, char layout,
+ *                          const unsigned int *ids, unsigned int count)
+ * Same as grf_repack(), but also reorders the files physically, so that files
+ * usually read together (eg. everything needed to load a map) can be read
+ * sequentially. For GRF_LAYOUT_TRACE, ids/count is the trace to follow; if ids
+ * is NULL, the trace recorded on this handle is used. ids are the ones from
+ * grf_file_get_id(), and must be valid for the current ID list: the IDs of
+ * deleted files are given to the files added later, so a trace kept outside
+ * of the handle is only valid as long as no file was deleted. The trace
+ * recorded on the handle is safe, IDs are not reused while it isn't empty.
+ * This needs as much free disk space as the files to move, which are first
+ * copied at the end of the archive in the right order.
+ */
+GRFEXPORT bool grf_repack_layout(grf_handle, uint8_t, uint8_t, const uint32_t *, uint32_t);
+
+/* grf_trace_start(grf_handle)
+ * grf_trace_stop(grf_handle)
+ * Start (or restart from scratch) and stop recording the IDs of the files
+ * read with grf_file_get_contents() and friends.
+ */
+GRFEXPORT void grf_trace_start(grf_handle); /* grf.c */
+GRFEXPORT void grf_trace_stop(grf_handle);  /* grf.c */
+
+/* (const unsigned int *) grf_trace_get(grf_handle, unsigned int *count)
+ * Returns the recorded trace (the IDs in access order, repeated reads of the
+ * same file are only recorded once in a row) and stores its length in count.
+ * The list belongs to the handle, do not free() it.
+ */
+GRFEXPORT const uint32_t *grf_trace_get(grf_handle, uint32_t *); /* grf.c */
+
+/* (unsigned int) grf_defrag_step(grf_handle, unsigned int max_bytes)
+ * Online, incremental alternative to grf_repack(): moves files from the end
+ * of the archive to the first hole big enough to receive them, until about
+ * max_bytes were moved (at least one file is moved, even if larger), then
+ * writes the files table and shrinks the archive. The GRF is consistent and
+ * loadable after each call, so this can be called from time to time (eg. when
+ * idle) to keep grf_wasted_space() low. Pending changes are saved first, and
+ * nothing is moved (0 is returned) inside a transaction (see grf_begin()).
+ * Returns the number of bytes moved, 0 when no more file can be moved this
+ * way (a full grf_repack() is then needed to recover the remaining space).
+ * NB: like any other function, do not call it while another thread uses the
+ * same grf_handle.
+ */
+GRFEXPORT uint32_t grf_defrag_step(grf_handle, uint32_t); /* grf.c */
+
 /* (bool) grf_merge(grf_handle dest, grf_handle src, char options)
  * Copy files from "src" grf_handle (can be opened read-only) to "dest"
  * grf_handle (must be opened read/write). Takes the same options as
@@ -401,6 +734,143 @@ GRFEXPORT bool grf_repack(grf_handle, uint8_t);
  */
 GRFEXPORT bool grf_merge(grf_handle, grf_handle, uint8_t);
 
+/*****************************************************************************
+ ****************************** VFS FUNCTIONS ********************************
+ ****************************************************************************/
+
+/* (grf_vfs) grf_vfs_new()
+ * Creates an empty virtual filesystem. GRF files and directories can be
+ * mounted on it with a priority, then each filename is resolved to the
+ * version of the file found in the mounted GRF/directory with the highest
+ * priority (the last mounted wins on same priority) with a single lookup,
+ * whatever the number of layers.
+ */
+GRFEXPORT grf_vfs grf_vfs_new(void); /* vfs.c */
+
+/* (bool) grf_vfs_mount(grf_vfs vfs, grf_handle handle, int priority)
+ * (bool) grf_vfs_mount_dir(grf_vfs vfs, const char *path, int priority)
+ * Adds a layer to the vfs. A grf_handle can only be mounted in one vfs at
+ * once, and changes made to it (add, delete, rename, merge) are reflected by
+ * the vfs immediately. grf_free() unmounts the grf.
+ * Directories are scanned when mounted, file "data\a.txt" being read from
+ * path/data/a.txt, call grf_vfs_refresh() after changing them.
+ */
+GRFEXPORT bool grf_vfs_mount(grf_vfs, grf_handle, int);       /* vfs.c */
+GRFEXPORT bool grf_vfs_mount_dir(grf_vfs, const char *, int); /* vfs.c */
+
+/* (bool) grf_vfs_unmount(grf_vfs vfs, grf_handle handle)
+ * Removes a grf from the vfs. Files it was hiding become visible again.
+ */
+GRFEXPORT bool grf_vfs_unmount(grf_vfs, grf_handle); /* vfs.c */
+
+/* grf_vfs_refresh(grf_vfs vfs)
+ * Rebuilds the whole index, scanning mounted directories again.
+ */
+GRFEXPORT void grf_vfs_refresh(grf_vfs); /* vfs.c */
+
+/* (unsigned int) grf_vfs_filecount(grf_vfs vfs)
+ * Returns the number of distinct files visible through the vfs.
+ */
+GRFEXPORT uint32_t grf_vfs_filecount(grf_vfs); /* vfs.c */
+
+/* (grf_vfs_file) grf_vfs_get_file(grf_vfs vfs, const char *filename)
+ * Returns the winning version of filename, or NULL if no layer has it. The
+ * returned handle is valid until the vfs or one of its grf changes.
+ */
+GRFEXPORT grf_vfs_file grf_vfs_get_file(grf_vfs, const char *); /* vfs.c */
+
+/* (grf_node) grf_vfs_file_get_node(grf_vfs_file file)
+ * (grf_handle) grf_vfs_file_get_grf(grf_vfs_file file)
+ * Returns the GRF file node (and the grf it belongs to), or NULL if the file
+ * comes from a directory.
+ */
+GRFEXPORT grf_node grf_vfs_file_get_node(grf_vfs_file);  /* vfs.c */
+GRFEXPORT grf_handle grf_vfs_file_get_grf(grf_vfs_file); /* vfs.c */
+
+/* (unsigned int) grf_vfs_file_get_size(grf_vfs_file file)
+ * (unsigned int) grf_vfs_file_get_contents(grf_vfs_file file, void *buffer)
+ * Same as grf_file_get_size() and grf_file_get_contents(), for files coming
+ * from a GRF or a directory.
+ */
+GRFEXPORT uint32_t grf_vfs_file_get_size(grf_vfs_file);             /* vfs.c */
+GRFEXPORT uint32_t grf_vfs_file_get_contents(grf_vfs_file, void *); /* vfs.c */
+
+/* grf_vfs_free(grf_vfs vfs)
+ * Frees the vfs. Mounted grf are unmounted, not freed.
+ */
+GRFEXPORT void grf_vfs_free(grf_vfs); /* vfs.c */
+
+/*****************************************************************************
+ ***************************** SEARCH FUNCTIONS ******************************
+ ****************************************************************************/
+
+/* Flags for grf_search_compile() :
+ *  - GRF_SEARCH_SUBSTRING
+ *    the pattern is a plain string, matching files whose name contains it
+ *  - GRF_SEARCH_BASENAME
+ *    a file also matches if its basename (name without the path) matches
+ */
+#define GRF_SEARCH_SUBSTRING 1
+#define GRF_SEARCH_BASENAME 2
+
+/* (grf_search) grf_search_compile(const char *pattern, int flags)
+ * Compiles a search pattern. By default the pattern is a wildcard matching
+ * the whole filename: '*' stands for any string, '?' for any character.
+ * Case is ignored, and '/' is the same as '\\'. Returns NULL if out of
+ * memory. A compiled pattern can be used on any number of GRF files.
+ */
+GRFEXPORT grf_search grf_search_compile(const char *, int); /* search.c */
+
+/* (bool) grf_search_match(grf_search, const char *filename)
+ * Returns true if filename matches the compiled pattern.
+ */
+GRFEXPORT bool grf_search_match(grf_search, const char *); /* search.c */
+
+/* (unsigned int) grf_search_run(grf_handle, grf_search, int threads, unsigned int **ids)
+ * Looks for the files matching a compiled pattern, and stores their IDs (see
+ * grf_file_get_id()) in
+ * *ids, which you will have to free(). Returns the number of matches.
+ * Names are split among the given number of threads (0 means one for each
+ * CPU), when the library is built with thread support.
+ */
+GRFEXPORT uint32_t grf_search_run(grf_handle, grf_search, int, uint32_t **); /* search.c */
+
+/* grf_search_free(grf_search)
+ * Frees a compiled pattern.
+ */
+GRFEXPORT void grf_search_free(grf_search); /* search.c */
+
+/*****************************************************************************
+ ***************************** STATS FUNCTIONS *******************************
+ ****************************************************************************/
+
+/* grf_stats_enable(grf_handle handle, bool enable)
+ * Starts (from zero) or stops recording stats on this handle: time and count
+ * of each GRF_STAT_* phase, I/O bytes, lookups and allocations. To get the
+ * loading too, enable it between grf_new() and grf_load_from_new(). Stats cost
+ * nothing while disabled (default), and two clock reads per timed phase
+ * otherwise.
+ */
+GRFEXPORT void grf_stats_enable(grf_handle, bool); /* grf.c */
+
+/* grf_stats_reset(grf_handle handle)
+ * Sets all the recorded stats back to zero.
+ */
+GRFEXPORT void grf_stats_reset(grf_handle); /* grf.c */
+
+/* (bool) grf_stats_get(grf_handle handle, grf_stats *stats)
+ * Copies the stats recorded so far, returns false if they aren't enabled.
+ */
+GRFEXPORT bool grf_stats_get(grf_handle, grf_stats *); /* grf.c */
+
+/* (char *) grf_stats_json(grf_handle handle)
+ * Same as grf_stats_get(), as a JSON object:
+ * {"phases":{"table_read":{"count":1,"usec":42},...},"bytes_read":...}
+ * Returns NULL if the stats aren't enabled.
+ * NB: You will have to free() this result after use.
+ */
+GRFEXPORT char *grf_stats_json(grf_handle); /* grf.c */
+
 /*****************************************************************************
  **************************** CHARSET FUNCTIONS ******************************
  ****************************************************************************/
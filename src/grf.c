@@ -6,8 +6,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef GRF_HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #ifndef __WIN32
 #include <libgen.h>
+#include <time.h> /* clock_gettime() */
+#else
+#include <io.h> /* _commit() */
 #endif
 
 /* BEGIN: INCLUDE FROM GRFIO.C */
@@ -224,65 +230,483 @@ static char *dirname(char *d) {
 }
 #endif
 
+static bool prv_grf_save(struct grf_handler *);
+static bool prv_grf_read_at(struct grf_handler *, uint64_t, void *, uint32_t);
+static bool prv_grf_write_at(struct grf_handler *, uint64_t, const void *, uint32_t);
+static bool prv_grf_write_header(struct grf_handler *);
+static bool prv_grf_write_table(struct grf_handler *, int);
+static bool prv_grf_sorted_build(struct grf_handler *);
+static bool prv_grf_ext_build(struct grf_handler *);
+static uint32_t prv_grf_sorted_prefix_start(struct grf_handler *, const char *, size_t);
+static uint32_t prv_grf_sorted_prefix_end(struct grf_handler *, const char *, size_t);
+
+/* where prv_grf_write_table() puts the table */
+#define PRV_GRF_TABLE_TAIL 0 /* right after the last file, then truncate (grf_save) */
+#define PRV_GRF_TABLE_EOF 1  /* at the end of the file, nothing truncated (grf_repack) */
+#define PRV_GRF_TABLE_SAFE 2 /* after the last file without overwriting the current table, nothing truncated */
+#define PRV_GRF_TABLE_CHUNK 65536 /* size of the buffers used to build and compress the table */
+
+/* 0x300 archives (and 0xCACA ones flagged GRF_REPACK_LARGE) use 64 bits positions */
+static inline bool prv_grf_version_large(uint32_t version) {
+  if ((version & 0xFFFF) == 0xCACA) return (version & GRF_REPACK_LARGE) != 0;
+  return version == GRF_FILE_LARGE_VERSION;
+}
+
+/* write the part of a files table entry following the filename, returns its size */
+static size_t prv_grf_table_entry_put(void *buf, const struct grf_node *node, bool large) {
+  struct grf_table_entry_data te;
+  struct grf_table_entry_data64 te64;
+  if (large) {
+    te64.len         = node->len;
+    te64.len_aligned = node->len_aligned;
+    te64.size        = node->size;
+    te64.flags       = node->flags;
+    te64.pos         = node->pos;
+    memcpy(buf, &te64, sizeof(te64));
+    return sizeof(te64);
+  }
+  te.len         = node->len;
+  te.len_aligned = node->len_aligned;
+  te.size        = node->size;
+  te.flags       = node->flags;
+  te.pos         = node->pos;
+  memcpy(buf, &te, sizeof(te));
+  return sizeof(te);
+}
+
+/* read it back, whatever the version */
+static void prv_grf_table_entry_get(const void *buf, struct grf_table_entry_data64 *res, bool large) {
+  struct grf_table_entry_data te;
+  if (large) {
+    memcpy(res, buf, sizeof(*res));
+    return;
+  }
+  memcpy(&te, buf, sizeof(te));
+  res->len         = te.len;
+  res->len_aligned = te.len_aligned;
+  res->size        = te.size;
+  res->flags       = te.flags;
+  res->pos         = te.pos;
+}
+
+/* decryption cycle of a 0x200 (or newer) entry, -1 if it isn't encrypted */
+static int prv_grf_entry_cycle(uint8_t flags, uint32_t len) {
+  int cycle = -1;
+  if (flags & GRF_FLAG_MIXCRYPT) {
+    cycle = 1;
+    for (uint64_t i = 10; len >= i; i = i * 10) cycle++;
+  }
+  if (flags & GRF_FLAG_DES) cycle = 0;
+  return cycle;
+}
+
+static void prv_grf_list_unlink(struct grf_handler *handler, struct grf_node *node) {
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    handler->last_node = node->prev;
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    handler->first_node = node->next;
+  node->prev = node->next = NULL;
+}
+
+/* insert node just after prev (or first if prev is NULL) */
+static void prv_grf_list_insert(struct grf_handler *handler, struct grf_node *prev, struct grf_node *node) {
+  node->prev = prev;
+  node->next = (prev == NULL) ? handler->first_node : prev->next;
+  if (node->prev != NULL)
+    node->prev->next = node;
+  else
+    handler->first_node = node;
+  if (node->next != NULL)
+    node->next->prev = node;
+  else
+    handler->last_node = node;
+}
+
+// Bloom filter of the filenames (see grf_file_may_exist). Hash is FNV-1a with the same normalization as the
+// fast_table keys, so no allocation is needed. Removed files keep their bits until the next rebuild.
+static uint64_t prv_grf_name_hash(const char *name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *name != 0; name++) {
+    unsigned char c = *name;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    if (c == '\\') c = '/';
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void prv_grf_bloom_set(struct grf_handler *handler, const char *name) {
+  uint64_t h  = prv_grf_name_hash(name);
+  uint32_t h1 = h, h2 = (h >> 32) | 1;
+  for (int i = 0; i < GRF_BLOOM_HASHES; i++, h1 += h2) {
+    uint32_t b = h1 & (handler->bloom_bits - 1);
+    handler->bloom[b >> 6] |= 1ULL << (b & 63);
+  }
+}
+
+static void prv_grf_bloom_build(struct grf_handler *handler) {
+  uint64_t want = (uint64_t)handler->fast_table->count * GRF_BLOOM_BITS_PER_FILE;
+  uint32_t bits = 1024;
+  if (handler->bloom != NULL) free(handler->bloom);
+  handler->bloom = NULL;
+  if (!handler->bloom_enabled) return;
+  while ((bits < want) && (bits < 0x80000000)) bits <<= 1;
+  handler->bloom = calloc(bits / 64, sizeof(uint64_t));
+  if (handler->bloom == NULL) return; /* no filter, lookups just don't get the shortcut */
+  handler->bloom_bits  = bits;
+  handler->bloom_count = 0;
+  handler->bloom_stale = 0;
+  for (struct grf_node *node = handler->first_node; node != NULL; node = node->next) {
+    prv_grf_bloom_set(handler, node->filename);
+    handler->bloom_count++;
+  }
+}
+
+/* name was added to the files table (and list), rebuild a larger filter when it gets too full */
+static void prv_grf_bloom_add(struct grf_handler *handler, const char *name) {
+  if (!handler->bloom_enabled) return;
+  if ((handler->bloom == NULL) || (++handler->bloom_count > handler->bloom_bits / GRF_BLOOM_BITS_PER_FILE)) {
+    prv_grf_bloom_build(handler);
+    return;
+  }
+  prv_grf_bloom_set(handler, name);
+}
+
+/* a file was removed, rebuild once removed files make a good part of the filter */
+static void prv_grf_bloom_del(struct grf_handler *handler) {
+  if (handler->bloom == NULL) return;
+  if (++handler->bloom_stale > handler->bloom_count / 2) prv_grf_bloom_build(handler);
+}
+
+/* drop node from the files table (freeing it), and let the vfs know */
+static int prv_grf_del_node(struct grf_handler *handler, struct grf_node *node) {
+  char *name = (handler->vfs != NULL) ? strdup(node->filename) : NULL;
+  int res    = hash_del_element(handler->fast_table, node->filename);
+  if (res == 0) {
+    prv_grf_bloom_del(handler);
+    handler->sorted_valid = false;
+    handler->names_valid  = false;
+    handler->ext_valid    = false;
+  }
+  if (name != NULL) {
+    vfs_update_file(handler->vfs, name);
+    free(name);
+  }
+  return res;
+}
+
+/* filename appeared in (or left) the files table */
+static void prv_grf_name_changed(struct grf_handler *handler, const char *filename) {
+  handler->sorted_valid = false;
+  handler->names_valid  = false;
+  handler->ext_valid    = false;
+  if (handler->vfs != NULL) vfs_update_file(handler->vfs, filename);
+}
+
+/* give node an ID, reusing the one of a deleted file if possible (but not while an access trace is recorded, it could
+ * still contain it). Returns false if out of memory, node has no ID then. */
+static bool prv_grf_id_assign(struct grf_handler *handler, struct grf_node *node) {
+  uint32_t id;
+  if ((handler->id_free_count > 0) && (handler->trace_count == 0)) {
+    id = handler->id_free[--handler->id_free_count];
+  } else {
+    if (handler->id_count + 1 >= handler->id_alloc) {
+      uint32_t alloc            = MAX(64, handler->id_alloc * 2);
+      struct grf_node **table   = realloc(handler->node_table, sizeof(struct grf_node *) * alloc);
+      if (table == NULL) return false;
+      handler->node_table = table;
+      handler->id_alloc   = alloc;
+    }
+    id                                     = handler->id_count++;
+    handler->node_table[handler->id_count] = NULL;
+  }
+  handler->node_table[id] = node;
+  node->id                = id;
+  return true;
+}
+
+/* node is being freed, its ID can be reused */
+static void prv_grf_id_release(struct grf_handler *handler, struct grf_node *node) {
+  if ((handler->node_table == NULL) || (node->id >= handler->id_count) || (handler->node_table[node->id] != node)) return;
+  handler->node_table[node->id] = NULL;
+  if (handler->id_free_count == handler->id_free_alloc) {
+    uint32_t alloc = MAX(64, handler->id_free_alloc * 2);
+    uint32_t *ids  = realloc(handler->id_free, sizeof(uint32_t) * alloc);
+    if (ids == NULL) return; /* this ID just won't be reused */
+    handler->id_free       = ids;
+    handler->id_free_alloc = alloc;
+  }
+  handler->id_free[handler->id_free_count++] = node->id;
+}
+
+/* number all the files in storage order, from scratch. Returns false if out of memory */
+static bool prv_grf_id_renumber(struct grf_handler *handler) {
+  uint32_t i = 0;
+  if (handler->node_table != NULL) free(handler->node_table);
+  handler->id_alloc      = handler->fast_table->count + 1;
+  handler->node_table    = calloc(handler->id_alloc, sizeof(struct grf_node *));
+  handler->id_count      = 0;
+  handler->id_free_count = 0;
+  if (handler->node_table == NULL) {
+    handler->id_alloc = 0;
+    return false;
+  }
+  for (struct grf_node *cur = handler->first_node; (cur != NULL) && (i + 1 < handler->id_alloc); cur = cur->next) {
+    handler->node_table[i] = cur;
+    cur->id                = i++;
+  }
+  handler->id_count = i;
+  return true;
+}
+
 static void prv_grf_free_node(struct grf_node *node) {
+  prv_grf_id_release(node->parent, node);
   free(node->filename);
-  if (node->next != NULL) node->next->prev = node->prev;
-  if (node->prev != NULL) node->prev->next = node->next;
+  prv_grf_list_unlink(node->parent, node);
   free(node);
 }
 
-static void prv_grf_tree_table_free_node(struct grf_treenode *node) {
-  if (node->is_dir) {
-    hash_free_table(node->subdir);
+/* tree labels and nodes are carved from arena blocks, released all at once with the tree */
+static void *prv_grf_tree_alloc(struct grf_handler *handler, size_t size) {
+  struct grf_tree_arena *arena = handler->tree_arena;
+  void *ptr;
+  size = (size + 7) & ~(size_t)7;
+  if ((arena == NULL) || (arena->used + size > arena->size)) {
+    size_t block = MAX(size, GRF_TREE_ARENA_SIZE);
+    arena        = malloc(sizeof(struct grf_tree_arena) + block);
+    if (arena == NULL) return NULL;
+    arena->next         = handler->tree_arena;
+    arena->used         = 0;
+    arena->size         = block;
+    handler->tree_arena = arena;
   }
-  if (node->name != NULL) free(node->name);  // does not apply to root
-  free(node);
+  ptr = arena->data + arena->used;
+  arena->used += size;
+  return ptr;
 }
 
-static void prv_grf_reg_tree_node(struct grf_treenode *root, struct grf_node *cur_node) {
-  char *fn = cur_node->filename;
-  char dirname[4096];
-  struct grf_treenode *parent = root;
+static struct grf_treenode *prv_grf_tree_new(struct grf_handler *handler, struct grf_treenode *parent, const char *name,
+                                             size_t len, bool is_dir) {
+  struct grf_treenode *node = prv_grf_tree_alloc(handler, sizeof(struct grf_treenode));
+  if (node == NULL) return NULL;
+  memset(node, 0, sizeof(struct grf_treenode));
+  node->is_dir = is_dir;
+  node->loaded = !handler->tree_lazy;
+  node->parent = parent;
+  if (name == NULL) return node;  // root does not have a name
+  node->name = prv_grf_tree_alloc(handler, len + 1);
+  if (node->name == NULL) return NULL;
+  memcpy(node->name, name, len);
+  node->name[len] = 0;
+  return node;
+}
+
+static void prv_grf_tree_free(struct grf_handler *handler, struct grf_treenode *node) {
+  for (uint32_t i = 0; i < node->child_count; i++)
+    if (node->child[i]->is_dir) prv_grf_tree_free(handler, node->child[i]);
+  if (node->child != NULL) free(node->child);
+  if (node != handler->root) return;
+  while (handler->tree_arena != NULL) {
+    struct grf_tree_arena *next = handler->tree_arena->next;
+    free(handler->tree_arena);
+    handler->tree_arena = next;
+  }
+  handler->root = NULL;
+}
+
+// compare a tree label with the len first chars of name (case insensitive)
+static int prv_grf_tree_label_cmp(const char *label, const char *name, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char x = label[i], y = name[i];
+    if ((x >= 'A') && (x <= 'Z')) x += 32;
+    if ((y >= 'A') && (y <= 'Z')) y += 32;
+    if (x != y) return x - y;
+  }
+  return (label[len] != 0);
+}
+
+/* position of the child of dir named name (len chars), or the position where it should be inserted */
+static uint32_t prv_grf_tree_find(struct grf_treenode *dir, const char *name, size_t len, bool *found) {
+  uint32_t lo = 0, hi = dir->child_count;
+  int c;
+  *found = false;
+  if (hi == 0) return 0;
+  // files are mostly registered in name order, so try the last child first
+  c = prv_grf_tree_label_cmp(dir->child[hi - 1]->name, name, len);
+  if (c < 0) return hi;
+  if (c == 0) {
+    *found = true;
+    return hi - 1;
+  }
+  hi--;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    c            = prv_grf_tree_label_cmp(dir->child[mid]->name, name, len);
+    if (c == 0) {
+      *found = true;
+      return mid;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static bool prv_grf_tree_insert(struct grf_treenode *dir, uint32_t pos, struct grf_treenode *node) {
+  if (dir->child_count == dir->child_alloc) {
+    uint32_t alloc              = (dir->child_alloc == 0) ? 4 : dir->child_alloc * 2;
+    struct grf_treenode **child = realloc(dir->child, sizeof(struct grf_treenode *) * alloc);
+    if (child == NULL) return false;
+    dir->child       = child;
+    dir->child_alloc = alloc;
+  }
+  memmove(dir->child + pos + 1, dir->child + pos, sizeof(struct grf_treenode *) * (dir->child_count - pos));
+  dir->child[pos] = node;
+  dir->child_count++;
+  return true;
+}
+
+static void prv_grf_reg_tree_node(struct grf_handler *handler, struct grf_node *cur_node) {
+  const char *fn              = cur_node->filename;
+  struct grf_treenode *parent = handler->root;
   struct grf_treenode *new;
   while (1) {
-    size_t pos;
+    size_t len;
+    uint32_t pos;
+    bool found;
+    if (!parent->loaded) return;  // will be found when the directory gets listed
     // locate either / or \ in filename...
-    for (pos = 0; (*(fn + pos) != 0) && (*(fn + pos) != '/') && (*(fn + pos) != '\\'); pos++)
+    for (len = 0; (fn[len] != 0) && (fn[len] != '/') && (fn[len] != '\\'); len++)
       ;
-    memcpy(&dirname, fn, pos + 1);
-    if (*(fn + pos) == 0) break;  // record file~
+    pos = prv_grf_tree_find(parent, fn, len, &found);
+    if (fn[len] == 0) {
+      // record file
+      if (found) {
+        // bogus grf file: file with same name as a directory, attach it to the directory
+        new = parent->child[pos];
+      } else {
+        new = prv_grf_tree_new(handler, parent, fn, len, false);
+        if ((new == NULL) || !prv_grf_tree_insert(parent, pos, new)) return;
+      }
+      new->ptr              = cur_node;
+      cur_node->tree_parent = new;
+      return;
+    }
     // this is a directory, check if already existing...
-    dirname[pos] = 0;
-    fn += pos + 1;
-    new = hash_lookup(parent->subdir, dirname);
-    if (new != NULL) {  // found it !
+    if (found) {
+      new = parent->child[pos];
+      // bogus grf file: directory with same name as a file... convert to directory !
       if (!new->is_dir) {
-        // bogus grf file: directory with same name as a file... convert to directory !
         new->is_dir = true;
-        new->subdir = hash_create_table(GRF_TREE_HASH_SIZE, prv_grf_tree_table_free_node);
+        new->loaded = !handler->tree_lazy;
       }
-      parent = new;
-      continue;
+    } else {
+      new = prv_grf_tree_new(handler, parent, fn, len, true);
+      if ((new == NULL) || !prv_grf_tree_insert(parent, pos, new)) return;
     }
-    // not found -> create a new node
-    new = (struct grf_treenode *)calloc(1, sizeof(struct grf_treenode));
-    memset(new, 0, sizeof(struct grf_treenode));
-    new->is_dir = true;
-    new->subdir = hash_create_table(GRF_TREE_HASH_SIZE, prv_grf_tree_table_free_node);
-    new->parent = parent;
-    new->name   = strdup((char *)&dirname);
-    hash_add_element(parent->subdir, (char *)&dirname, new);
     parent = new;
+    fn += len + 1;
+  }
+}
+
+/* full path of dir, with a trailing separator ("" for the root) */
+static char *prv_grf_tree_path(struct grf_treenode *dir, size_t *len) {
+  size_t l = 0;
+  char *path;
+  for (struct grf_treenode *cur = dir; cur->parent != NULL; cur = cur->parent) l += strlen(cur->name) + 1;
+  path = malloc(l + 1);
+  if (path == NULL) return NULL;
+  path[l] = 0;
+  *len    = l;
+  for (struct grf_treenode *cur = dir; cur->parent != NULL; cur = cur->parent) {
+    size_t n  = strlen(cur->name);
+    path[--l] = '\\';
+    l -= n;
+    memcpy(path + l, cur->name, n);
+  }
+  return path;
+}
+
+/* lazy tree: create the entries of dir from the sorted index, skipping over subdirectories */
+static void prv_grf_tree_load(struct grf_handler *handler, struct grf_treenode *dir) {
+  uint32_t i, end;
+  size_t plen;
+  char *path;
+  if (dir->loaded) return;
+  if (!prv_grf_sorted_build(handler)) return;
+  path = prv_grf_tree_path(dir, &plen);
+  if (path == NULL) return;
+  i   = prv_grf_sorted_prefix_start(handler, path, plen);
+  end = prv_grf_sorted_prefix_end(handler, path, plen);
+  free(path);
+  dir->loaded = true;
+  while (i < end) {
+    struct grf_node *cur_node = handler->sorted[i];
+    const char *fn            = cur_node->filename + plen;
+    struct grf_treenode *new;
+    size_t len;
+    uint32_t pos;
+    bool found;
+    for (len = 0; (fn[len] != 0) && (fn[len] != '/') && (fn[len] != '\\'); len++)
+      ;
+    pos = prv_grf_tree_find(dir, fn, len, &found);
+    if (found) {
+      new = dir->child[pos];
+    } else {
+      new = prv_grf_tree_new(handler, dir, fn, len, fn[len] != 0);
+      if ((new == NULL) || !prv_grf_tree_insert(dir, pos, new)) return;
+    }
+    if (fn[len] == 0) {
+      new->ptr              = cur_node;
+      cur_node->tree_parent = new;
+      i++;
+      continue;
+    }
+    new->is_dir = true;  // may have been a file of the same name
+    // everything below is the business of the subdirectory
+    i = prv_grf_sorted_prefix_end(handler, cur_node->filename, plen + len + 1);
   }
-  // record file
-  new = (struct grf_treenode *)calloc(1, sizeof(struct grf_treenode));
-  memset(new, 0, sizeof(struct grf_treenode));
-  new->is_dir           = false;
-  new->ptr              = cur_node;
-  new->parent           = parent;
-  cur_node->tree_parent = new;
-  new->name             = strdup((char *)&dirname);
-  hash_add_element(parent->subdir, (char *)&dirname, new);
+}
+
+/* lazy tree: load the directories leading to cur_node */
+static void prv_grf_tree_reveal(struct grf_handler *handler, struct grf_node *cur_node) {
+  const char *fn           = cur_node->filename;
+  struct grf_treenode *dir = handler->root;
+  while (cur_node->tree_parent == NULL) {
+    size_t len;
+    uint32_t pos;
+    bool found;
+    prv_grf_tree_load(handler, dir);
+    for (len = 0; (fn[len] != 0) && (fn[len] != '/') && (fn[len] != '\\'); len++)
+      ;
+    if (fn[len] == 0) return;
+    pos = prv_grf_tree_find(dir, fn, len, &found);
+    if (!found) return;
+    dir = dir->child[pos];
+    fn += len + 1;
+  }
+}
+
+/* file is leaving the tree (deleted or renamed) */
+static void prv_grf_unreg_tree_node(struct grf_node *cur_node) {
+  struct grf_treenode *node = cur_node->tree_parent, *dir;
+  uint32_t pos;
+  bool found;
+  if (node == NULL) return;
+  cur_node->tree_parent = NULL;
+  node->ptr             = NULL;
+  if (node->is_dir) return;  // also a directory, keep it as such
+  dir = node->parent;
+  pos = prv_grf_tree_find(dir, node->name, strlen(node->name), &found);
+  if (!found) return;
+  dir->child_count--;
+  memmove(dir->child + pos, dir->child + pos + 1, sizeof(struct grf_treenode *) * (dir->child_count - pos));
 }
 
 GRFEXPORT grf_handle grf_new_by_fd(int fd, bool writemode) {
@@ -301,23 +725,35 @@ GRFEXPORT grf_handle grf_new_by_fd(int fd, bool writemode) {
   handler->need_save         = writemode;  // file should be new (flag will be unset by prv_grf_load)
   handler->write_mode        = writemode;
   handler->compression_level = 5;                       /* default ZLIB compression level */
+  handler->bloom_enabled     = true;
   handler->version           = GRF_FILE_OUTPUT_VERISON; /* default version */
+  handler->progress_interval = GRF_PROGRESS_INTERVAL;
   return handler;
 }
 
-grf_node prv_grf_find_free_space(grf_handle handler, size_t size, grf_node inode) {
+grf_node prv_grf_find_free_space(grf_handle handler, size_t size, grf_node inode, uint64_t *pos) {
   // find a "leak" between two files, to put our own file
   // our files are sorted, that's a good thing:)
   // We just have to return the node where the space is available, the other func will
   // insert his new node just after this one, so everything stays cool
   grf_node cur = handler->first_node;
+  if (handler->transaction > 0) {
+    // the table on disk, and the files it lists (even those deleted or replaced since grf_begin()), must stay intact
+    // until grf_commit(): append after both the data and that table
+    *pos = handler->table_offset + handler->table_size;
+    if (handler->last_node != NULL) *pos = MAX(*pos, handler->last_node->pos + handler->last_node->len_aligned);
+    cur = handler->last_node;
+    if ((cur != NULL) && (cur == inode)) cur = cur->prev;
+    return cur;
+  }
   // case: inode is the first node (and is not null)
   if ((cur == inode) && (cur != NULL)) cur = cur->next;
   // case: there's no (other) file
+  *pos = 0;
   if (cur == NULL) return NULL; /* special case : nothing in the grf */
   while (cur->next != NULL) {
     struct grf_node *next = cur->next;
-    uint32_t avail;
+    uint64_t avail;
     if (next == inode) { /* skip the file refered by "inode" */
       next = next->next;
       if (next == NULL) break; /* ignore file is EOF */
@@ -327,6 +763,7 @@ grf_node prv_grf_find_free_space(grf_handle handler, size_t size, grf_node inode
     if (avail >= size) break; /* yatta! */
     cur = next;
   }
+  *pos = cur->pos + cur->len_aligned;
   return cur;
 }
 
@@ -337,57 +774,163 @@ GRFEXPORT grf_handle grf_new(const char *filename, bool writemode) {
   return grf_new_by_fd(fd, writemode);
 }
 
+/* monotonic clock, in microseconds */
+uint64_t prv_grf_usec(void) {
+#ifdef __WIN32
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (c.QuadPart / f.QuadPart) * 1000000 + (c.QuadPart % f.QuadPart) * 1000000 / f.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t prv_grf_msec(void) { return prv_grf_usec() / 1000; }
+
+/* phase started at t0 is over */
+void prv_grf_stat_time(struct grf_stats *stats, int phase, uint64_t t0) {
+  GRF_ATOMIC_ADD(stats->time[phase], prv_grf_usec() - t0);
+  GRF_ATOMIC_ADD(stats->count[phase], 1);
+}
+
+/* decrypt a file, see decode_des_etc() */
+static void prv_grf_decode(struct grf_handler *handler, void *buf, uint32_t len, int cycle) {
+  uint64_t t0 = GRF_STAT_START(handler->stats), tt = GRF_TRACE_START();
+  decode_des_etc((unsigned char *)buf, len, cycle == 0, cycle);
+  GRF_STAT_END(handler->stats, GRF_STAT_DES, t0);
+  GRF_TRACE(des, len, cycle, GRF_TRACE_ELAPSED(tt));
+}
+
+/* a long operation starts, going from 0 to max */
+static void prv_grf_progress_begin(struct grf_handler *handler, uint32_t max) {
+  GRF_ATOMIC_SET(handler->progress_max, max);
+  GRF_ATOMIC_SET(handler->progress_pos, 0);
+  GRF_ATOMIC_SET(handler->cancel, false);
+  handler->progress_next = 0;
+}
+
+/* operation reached pos, returns false if it has to stop. The clock is only read when there is a callback, which is
+ * called at most once per progress_interval */
+static bool prv_grf_progress(struct grf_handler *handler, uint32_t pos, const char *filename) {
+  uint64_t now;
+  GRF_ATOMIC_SET(handler->progress_pos, pos);
+  if (GRF_ATOMIC_GET(handler->cancel)) return false;
+  if (handler->callback == NULL) return true;
+  now = prv_grf_msec();
+  if (now < handler->progress_next) return true;
+  handler->progress_next = now + handler->progress_interval;
+  if (handler->callback(handler->callback_etc, handler, pos, handler->progress_max, filename)) return true;
+  GRF_ATOMIC_SET(handler->cancel, true); /* so nested steps stop too */
+  return false;
+}
+
+/* operation over, always reported. A stopped one keeps its position */
+static void prv_grf_progress_done(struct grf_handler *handler) {
+  uint32_t pos = handler->progress_max;
+  if (GRF_ATOMIC_GET(handler->cancel))
+    pos = handler->progress_pos;
+  else
+    GRF_ATOMIC_SET(handler->progress_pos, pos);
+  if (handler->callback != NULL) handler->callback(handler->callback_etc, handler, pos, handler->progress_max, NULL);
+}
+
 GRFEXPORT void grf_set_callback(grf_handle handler, bool (*callback)(void *, grf_handle, int, int, const char *), void *etc) {
   handler->callback     = callback;
   handler->callback_etc = etc;
 }
 
+GRFEXPORT void grf_set_progress_interval(grf_handle handler, uint32_t msec) { handler->progress_interval = msec; }
+
+GRFEXPORT uint32_t grf_progress(grf_handle handler, uint32_t *max) {
+  if (max != NULL) *max = GRF_ATOMIC_GET(handler->progress_max);
+  return GRF_ATOMIC_GET(handler->progress_pos);
+}
+
+GRFEXPORT void grf_cancel(grf_handle handler) { GRF_ATOMIC_SET(handler->cancel, true); }
+
+GRFEXPORT void grf_stats_enable(grf_handle handler, bool enable) {
+  if (handler->stats != NULL) free(handler->stats);
+  handler->stats = enable ? calloc(1, sizeof(struct grf_stats)) : NULL;
+}
+
+GRFEXPORT void grf_stats_reset(grf_handle handler) {
+  if (handler->stats != NULL) memset(handler->stats, 0, sizeof(struct grf_stats));
+}
+
+GRFEXPORT bool grf_stats_get(grf_handle handler, grf_stats *stats) {
+  if (handler->stats == NULL) return false;
+  memcpy(stats, handler->stats, sizeof(grf_stats));
+  return true;
+}
+
+GRFEXPORT char *grf_stats_json(grf_handle handler) {
+  static const char *phases[GRF_STAT_PHASES] = {"table_read", "table_inflate", "table_parse", "sort",  "tree",
+                                                "des",        "inflate",       "deflate",     "write", "table_save"};
+  size_t size = 2048, len;
+  grf_stats st;
+  char *res;
+  if (!grf_stats_get(handler, &st)) return NULL;
+  res = malloc(size);
+  if (res == NULL) return NULL;
+  len = snprintf(res, size, "{\"phases\":{");
+  for (int i = 0; i < GRF_STAT_PHASES; i++)
+    len += snprintf(res + len, size - len, "%s\"%s\":{\"count\":%llu,\"usec\":%llu}", (i > 0) ? "," : "", phases[i],
+                    (unsigned long long)st.count[i], (unsigned long long)st.time[i]);
+  snprintf(res + len, size - len,
+           "},\"bytes_read\":%llu,\"bytes_written\":%llu,\"lookups\":%llu,\"lookup_hits\":%llu,\"bloom_rejects\":%llu,"
+           "\"allocs\":%llu}",
+           (unsigned long long)st.bytes_read, (unsigned long long)st.bytes_written, (unsigned long long)st.lookups,
+           (unsigned long long)st.lookup_hits, (unsigned long long)st.bloom_rejects, (unsigned long long)st.allocs);
+  return res;
+}
+
 GRFEXPORT bool grf_merge(grf_handle dest, grf_handle src, uint8_t repack_type) {
   struct grf_node *cur, *rep, *prev;
   void *ptr;
   uint32_t i = 0;
+  uint64_t pos;
+  bool ok = false;
   if (!dest->write_mode) return false;
+  prv_grf_progress_begin(dest, src->filecount);
   // Rather simple :
   // 1. For each node in src
   cur = src->first_node;
   while (cur != NULL) {
     i++;
-    if (dest->callback != NULL)
-      if (!dest->callback(dest->callback_etc, dest, i, src->filecount, cur->filename)) break;
+    if (!prv_grf_progress(dest, i, cur->filename)) break;
     dest->need_save = true;
     // 2. Seek same file in dst, if found, remove it from list. If not found, allocate a new grf_node struct
     rep  = hash_lookup(dest->fast_table, cur->filename);
-    prev = prv_grf_find_free_space(dest, cur->len_aligned, rep);
+    prev = prv_grf_find_free_space(dest, cur->len_aligned, rep, &pos);
     if (rep != NULL) {
       // YAY! Everything made (almost) easy, but count file as replaced
       free(rep->filename);
-      if (rep->next != NULL) rep->next->prev = rep->prev;
-      if (rep->prev != NULL) rep->prev->next = rep->next;
+      prv_grf_list_unlink(dest, rep);
       dest->wasted_space += rep->len_aligned;
       rep->filename = strdup(cur->filename);
     } else {
       // Regular add file~ (argh)
       rep           = calloc(1, sizeof(struct grf_node));
+      GRF_STAT_ADD(dest->stats, allocs, 1);
       rep->filename = strdup(cur->filename);
+      rep->parent   = dest;
+      if (!prv_grf_id_assign(dest, rep)) {
+        free(rep->filename);
+        free(rep);
+        goto done;
+      }
       hash_add_element(dest->fast_table, rep->filename, rep);
-      if (dest->root != NULL) prv_grf_reg_tree_node(dest->root, rep);
+      if (dest->root != NULL) prv_grf_reg_tree_node(dest, rep);
     }
     // filename: replace '/' with '\\' (if any)
     for (int i                                              = 0; *(rep->filename + i) != 0; i++)
       if (*(rep->filename + i) == '/') *(rep->filename + i) = '\\';
-    if (prev == NULL) {
-      rep->pos                               = 0;
-      if (rep != dest->first_node) rep->next = dest->first_node;  // if we insert a new file, do some cleaning
-      rep->prev                              = NULL;
-      dest->first_node                       = rep;
-    } else {
-      // insert entry in the chained list
-      rep->pos                               = prev->pos + prev->len_aligned;
-      rep->next                              = prev->next;
-      prev->next                             = rep;
-      rep->prev                              = prev;
-      if (rep->next != NULL) rep->next->prev = rep;
-    }
+    // insert entry in the chained list
+    rep->pos = pos;
+    prv_grf_list_insert(dest, prev, rep);
     rep->size        = cur->size;
     rep->cycle       = cur->cycle;
     rep->len         = cur->len;
@@ -395,8 +938,6 @@ GRFEXPORT bool grf_merge(grf_handle dest, grf_handle src, uint8_t repack_type) {
     rep->flags       = cur->flags;
     rep->parent      = dest;
     // 5. Copy memory to file, and free() it
-    lseek(dest->fd, rep->pos + GRF_HEADER_SIZE, SEEK_SET);
-    lseek(src->fd, cur->pos + GRF_HEADER_SIZE, SEEK_SET);
 #if 0
 		if (repack_type == GRF_REPACK_FAST) {
 //			off_t offset = cur->pos + GRF_HEADER_SIZE;
@@ -409,14 +950,16 @@ GRFEXPORT bool grf_merge(grf_handle dest, grf_handle src, uint8_t repack_type) {
 		} else {
 #endif
     ptr = calloc(1, cur->len_aligned + 1024);  // in case of decrypt
-    if (read(src->fd, ptr, cur->len_aligned) != cur->len_aligned) {
+    GRF_STAT_ADD(dest->stats, allocs, 1);
+    if (!prv_grf_read_at(src, cur->pos, ptr, cur->len_aligned)) {
       free(ptr);
-      hash_del_element(dest->fast_table, rep->filename);
-      return false;
+      prv_grf_unreg_tree_node(rep);
+      prv_grf_del_node(dest, rep);
+      goto done;
     }
     if (repack_type >= GRF_REPACK_DECRYPT) {
       // we have at least to decrypt the file, if encrypted.
-      if (rep->cycle >= 0) decode_des_etc((unsigned char *)ptr, rep->len_aligned, (rep->cycle) == 0, rep->cycle);
+      if (rep->cycle >= 0) prv_grf_decode(dest, ptr, rep->len_aligned, rep->cycle);
       // clear encryption flags...
       rep->cycle = -1;
       rep->flags = rep->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
@@ -424,10 +967,11 @@ GRFEXPORT bool grf_merge(grf_handle dest, grf_handle src, uint8_t repack_type) {
     if (repack_type >= GRF_REPACK_RECOMPRESS) {
       // whoohoo recompress the file x.x
     }
-    if (write(dest->fd, ptr, rep->len_aligned) != rep->len_aligned) {
+    if (!prv_grf_write_at(dest, rep->pos, ptr, rep->len_aligned)) {
       free(ptr);
-      hash_del_element(dest->fast_table, rep->filename);
-      return false;
+      prv_grf_unreg_tree_node(rep);
+      prv_grf_del_node(dest, rep);
+      goto done;
     }
     free(ptr);
 #if 0
@@ -437,15 +981,19 @@ GRFEXPORT bool grf_merge(grf_handle dest, grf_handle src, uint8_t repack_type) {
     if (rep->next != NULL) {
       dest->wasted_space -= rep->len_aligned;
     }
+    prv_grf_bloom_add(dest, rep->filename);
+    prv_grf_name_changed(dest, rep->filename);
     cur = cur->next;
   }
-  if (dest->callback != NULL) dest->callback(dest->callback_etc, dest, src->filecount, src->filecount, NULL);
-  return true;
+  ok = true;
+done:
+  prv_grf_progress_done(dest);
+  return ok;
 }
 
 static void prv_grf_recount_wasted_space(struct grf_handler *handler) {
   struct stat s;
-  uint32_t w;
+  uint64_t w;
   struct grf_node *node;
 
   if (fstat(handler->fd, &s) != 0) return;
@@ -458,13 +1006,209 @@ static void prv_grf_recount_wasted_space(struct grf_handler *handler) {
   handler->wasted_space = w;
 }
 
+static bool prv_grf_sync(int fd) {
+#ifdef __WIN32
+  return _commit(fd) == 0;
+#else
+  return fsync(fd) == 0;
+#endif
+}
+
+static bool prv_grf_read_at(struct grf_handler *handler, uint64_t pos, void *buf, uint32_t len) {
+  uint32_t p = 0;
+  lseek(handler->fd, (off_t)(pos + GRF_HEADER_SIZE), SEEK_SET);
+  while (p < len) {
+    int i = read(handler->fd, (char *)buf + p, len - p);
+    if (i <= 0) return false;
+    p += i;
+  }
+  GRF_STAT_ADD(handler->stats, bytes_read, len);
+  return true;
+}
+
+static bool prv_grf_write_at(struct grf_handler *handler, uint64_t pos, const void *buf, uint32_t len) {
+  uint64_t t0 = GRF_STAT_START(handler->stats);
+  uint32_t p  = 0;
+  lseek(handler->fd, (off_t)(pos + GRF_HEADER_SIZE), SEEK_SET);
+  while (p < len) {
+    int i = write(handler->fd, (const char *)buf + p, len - p);
+    if (i <= 0) return false;
+    p += i;
+  }
+  GRF_STAT_END(handler->stats, GRF_STAT_WRITE, t0);
+  GRF_STAT_ADD(handler->stats, bytes_written, len);
+  return true;
+}
+
+struct prv_grf_repack_state {
+  uint64_t journal_pos; /* position of the two journal slots, batch data follows them */
+  uint32_t seq;         /* sequence of the last slot written */
+};
+
+static bool prv_grf_repack_journal_write(struct grf_handler *handler, struct prv_grf_repack_state *state, uint32_t done, uint32_t count,
+                                         uint32_t data_len, uint32_t data_crc) {
+  struct grf_repack_journal j;
+  memset(&j, 0, sizeof(j));
+  memcpy(j.magic, GRF_REPACK_JOURNAL_MAGIC, sizeof(j.magic));
+  j.seq      = ++state->seq;
+  j.done     = done;
+  j.count    = count;
+  j.data_len = data_len;
+  j.data_crc = data_crc;
+  j.crc      = crc32(0, (const Bytef *)&j, offsetof(struct grf_repack_journal, crc));
+  if (!prv_grf_write_at(handler, state->journal_pos + (j.seq % 2) * sizeof(j), &j, sizeof(j))) return false;
+  return prv_grf_sync(handler->fd);
+}
+
+static bool prv_grf_repack_journal_read(struct grf_handler *handler, uint64_t journal_pos, struct grf_repack_journal *res) {
+  struct grf_repack_journal j[2];
+  int best = -1;
+  if (!prv_grf_read_at(handler, journal_pos, &j, sizeof(j))) return false;
+  for (int i = 0; i < 2; i++) {
+    if (memcmp(j[i].magic, GRF_REPACK_JOURNAL_MAGIC, sizeof(j[i].magic)) != 0) continue;
+    if (j[i].crc != crc32(0, (const Bytef *)&j[i], offsetof(struct grf_repack_journal, crc))) continue;
+    if ((best == -1) || (j[i].seq > j[best].seq)) best = i;
+  }
+  if (best == -1) return false;
+  memcpy(res, &j[best], sizeof(*res));
+  return true;
+}
+
+// Move files toward the beginning of the archive, in storage order, starting at the `done`-th one (the previous ones are
+// already at their final place). Files are moved by batches of GRF_REPACK_BATCH_SIZE bytes, and each batch is recorded
+// in the journal before anything gets overwritten, so prv_grf_load() can finish the job if we get interrupted.
+static bool prv_grf_repack_run(struct grf_handler *handler, uint8_t repack_type, struct prv_grf_repack_state *state, uint32_t done) {
+  struct grf_node *node = handler->first_node;
+  uint64_t dest = 0;
+  uint32_t i;
+  prv_grf_progress_begin(handler, handler->filecount);
+  for (i = 0; (i < done) && (node != NULL); i++) {
+    dest = node->pos + node->len_aligned;
+    node = node->next;
+  }
+  while (node != NULL) {
+    struct grf_node *cur, *end;
+    uint32_t bytes = 0, count = 0, p = 0;
+    bool need_write = false, overlap;
+    void *filemem;
+    for (end = node; (end != NULL) && ((count == 0) || (bytes + end->len_aligned <= GRF_REPACK_BATCH_SIZE)); end = end->next) {
+      if (end->pos != dest + bytes) need_write = true;
+      if ((repack_type >= GRF_REPACK_DECRYPT) && (end->cycle >= 0)) need_write = true;
+      bytes += end->len_aligned;
+      count++;
+    }
+    if (!prv_grf_progress(handler, i + count, node->filename)) return false; /* canceled, the journal is left as is */
+    if (!need_write) { /* already in place */
+      dest += bytes;
+      i += count;
+      node = end;
+      continue;
+    }
+    filemem = malloc(bytes + 1024);  // 1024 is needed in case of decryption
+    if (filemem == NULL) return false;
+    GRF_STAT_ADD(handler->stats, allocs, 1);
+    for (cur = node; cur != end; cur = cur->next) {
+      // read one file after the other, as decryption may write a few bytes after the file
+      if (!prv_grf_read_at(handler, cur->pos, filemem + p, cur->len_aligned)) {
+        free(filemem);
+        return false;
+      }
+      if ((repack_type >= GRF_REPACK_DECRYPT) && (cur->cycle >= 0))
+        prv_grf_decode(handler, filemem + p, cur->len_aligned, cur->cycle);
+      p += cur->len_aligned;
+    }
+    // if the new location overlaps the old one, keep a copy of the data in the journal: the originals will be gone
+    overlap = (dest + bytes > node->pos);
+    if (overlap) {
+      if (!prv_grf_write_at(handler, state->journal_pos + 2 * sizeof(struct grf_repack_journal), filemem, bytes) ||
+          !prv_grf_sync(handler->fd) ||
+          !prv_grf_repack_journal_write(handler, state, i, count, bytes, crc32(0, (const Bytef *)filemem, bytes))) {
+        free(filemem);
+        return false;
+      }
+    } else if (!prv_grf_repack_journal_write(handler, state, i, count, 0, 0)) {
+      free(filemem);
+      return false;
+    }
+    if (!prv_grf_write_at(handler, dest, filemem, bytes) || !prv_grf_sync(handler->fd)) {
+      free(filemem);
+      return false;
+    }
+    free(filemem);
+    // the journalled data will be overwritten by the next batch, so mark this one as completed
+    if (overlap && !prv_grf_repack_journal_write(handler, state, i + count, 0, 0, 0)) return false;
+    for (cur = node; cur != end; cur = cur->next) {
+      cur->pos = dest;
+      dest += cur->len_aligned;
+      if (repack_type >= GRF_REPACK_DECRYPT) {
+        // clear encryption flags...
+        cur->cycle = -1;
+        cur->flags = cur->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
+      }
+    }
+    i += count;
+    node = end;
+  }
+  return true;
+}
+
+// Apply the journal of an interrupted grf_repack() to the freshly loaded (still in table order) files list. Returns the
+// number of entries now at their final place, or -1 if the journal could not be used.
+static int64_t prv_grf_repack_replay(struct grf_handler *handler, uint8_t repack_type, struct prv_grf_repack_state *state) {
+  struct grf_repack_journal j;
+  struct grf_node *node = handler->first_node;
+  uint64_t dest = 0, first = 0;
+  uint32_t i;
+  void *filemem = NULL;
+  if (!prv_grf_repack_journal_read(handler, state->journal_pos, &j)) return -1; /* no journal: previous libgrf version */
+  state->seq = j.seq;
+  if ((j.count > 0) && (j.data_len > 0)) {
+    filemem = malloc(j.data_len);
+    if (filemem == NULL) return -1;
+    GRF_STAT_ADD(handler->stats, allocs, 1);
+    if (!prv_grf_read_at(handler, state->journal_pos + 2 * sizeof(struct grf_repack_journal), filemem, j.data_len) ||
+        (crc32(0, (const Bytef *)filemem, j.data_len) != j.data_crc)) {
+      free(filemem);
+      return -1;
+    }
+  }
+  for (i = 0; (node != NULL) && (i < j.done + j.count); i++, node = node->next) {
+    if (i == j.done) first = dest;
+    if ((i >= j.done) && (filemem == NULL)) break; /* pending batch didn't touch anything yet, files are still in place */
+    node->pos = dest;
+    dest += node->len_aligned;
+    if (repack_type >= GRF_REPACK_DECRYPT) {
+      node->cycle = -1;
+      node->flags = node->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
+    }
+  }
+  if (i < j.done) {
+    free(filemem);
+    return -1; /* journal doesn't match the table */
+  }
+  if (filemem == NULL) return j.done;
+  if (handler->write_mode) {
+    // redo the pending batch
+    bool ok = prv_grf_write_at(handler, first, filemem, j.data_len) && prv_grf_sync(handler->fd) &&
+              prv_grf_repack_journal_write(handler, state, j.done + j.count, 0, 0, 0);
+    free(filemem);
+    return ok ? (int64_t)j.done + j.count : -1;
+  }
+  // read-only: we can't move anything, so read the pending batch from the journal
+  free(filemem);
+  for (node = handler->first_node, i = 0; (node != NULL) && (i < j.done + j.count); i++, node = node->next)
+    if (i >= j.done) node->pos += state->journal_pos + 2 * sizeof(struct grf_repack_journal) - first;
+  return j.done + j.count;
+}
+
 GRFEXPORT bool grf_repack(grf_handle handler, uint8_t repack_type) {
+  struct prv_grf_repack_state state;
   struct grf_node *node = handler->first_node;
-  struct grf_node *prenode;
-  uint32_t i        = 0;
-  uint32_t save_pos = 0;
+  uint32_t version;
+  bool res;
   if (!handler->write_mode) return false; /* opened in read-only mode -> repack fails */
-  if (node == NULL) return true;          // nothing to do on an empty file
+  if (handler->transaction > 0) return false; /* the archive on disk must stay as it is until grf_commit() */
+  if (node == NULL) return true;              // nothing to do on an empty file
   switch (repack_type) {
     case GRF_REPACK_FAST:
       break;
@@ -473,137 +1217,312 @@ GRFEXPORT bool grf_repack(grf_handle handler, uint8_t repack_type) {
     default:
       return false; /* bad parameter */
   }
-  while (node->next != NULL) node = node->next;
-  if (handler->table_offset >= (node->pos + node->len_aligned)) {
-    save_pos = handler->table_offset + handler->table_size;
-  } else {
-    save_pos = node->pos + node->len_aligned;
-  }
-  node = handler->first_node;
-  // ok, let's go!
-  // Save header with version "0xCACA", but keep initial version. If we save again, it means it worked!
-  i                = handler->version;
-  handler->version = (0xCACA | repack_type << 24);  // save repack_type as well~
-  grf_save(handler);
-  handler->need_save = true;
-  handler->version   = i;
-  // First operation: enumerate files, and find a gap
-  i = 0;
-  // first node will never get moved, so create a "pre-first" node that'll be the one who won't get to be moved
-  prenode       = calloc(1, sizeof(struct grf_node));
-  prenode->next = node;
-  node          = prenode;
+  // empty files are dropped by prv_grf_load(), get rid of them now so the journal counts the same entries
   while (node != NULL) {
     struct grf_node *next = node->next;
-    i++;
-    if (next == NULL) break;                          /* can't remove void at end */
-    if (node->pos + node->len_aligned < next->pos) {  // found a gap !
-      // save position of current file at end of GRF, in case of problem while repacking~
-      void *filemem;
-      int p = 0;
-      lseek(handler->fd, save_pos + GRF_HEADER_SIZE, SEEK_SET);
-      write(handler->fd, (void *)(&next->pos), 4);
-      if (handler->callback != NULL)
-        if (!handler->callback(handler->callback_etc, handler, i, handler->filecount, next->filename)) break;
-      filemem = calloc(1, next->len_aligned + 1024);  // 1024 is needed in case of decryption
-      lseek(handler->fd, next->pos + GRF_HEADER_SIZE, SEEK_SET);
-      while (p < next->len_aligned) p += read(handler->fd, filemem + p, next->len_aligned - p);
-      // ok, we got the data :)
-      if (repack_type >= GRF_REPACK_DECRYPT) {
-        // we have at least to decrypt the file, if encrypted.
-        if (next->cycle >= 0) decode_des_etc((unsigned char *)filemem, next->len_aligned, (next->cycle) == 0, next->cycle);
-        // clear encryption flags...
-        next->cycle = -1;
-        next->flags = next->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
-      }
-      if (repack_type >= GRF_REPACK_RECOMPRESS) {
-        // NOT SUPPORTED ! (to be implemented on next release - which will be something like 0.1.22)
-        //				void *filenew = malloc(next->size);
-        //				count = zlib_buffer_inflate(filenew, next->size, filemem, next->len);
-      }
-      // write the file to its new localtion !
-      p         = 0;
-      next->pos = node->pos + node->len_aligned;
-      lseek(handler->fd, next->pos + GRF_HEADER_SIZE, SEEK_SET);
-      while (p < next->len_aligned) p += write(handler->fd, filemem + p, next->len_aligned - p);
-    } else {
-      bool need_write = false;
-      void *filemem;
-      int p;
-      // no need to move file, but...
-      if (repack_type >= GRF_REPACK_DECRYPT) {
-        if (next->cycle >= 0) {
-          if (handler->callback != NULL) handler->callback(handler->callback_etc, handler, i, handler->filecount, next->filename);
-          filemem = calloc(1, next->len_aligned + 1024);  // 1024 is needed for decryption
-          p       = 0;
-          lseek(handler->fd, next->pos + GRF_HEADER_SIZE, SEEK_SET);
-          while (p < next->len_aligned) p += read(handler->fd, filemem + p, next->len_aligned - p);
-          decode_des_etc((unsigned char *)filemem, next->len_aligned, (next->cycle) == 0, next->cycle);
-          need_write  = true;
-          next->cycle = -1;
-          next->flags = next->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
-        }
-      }
-      if (need_write) {
-        p = 0;
-        lseek(handler->fd, node->pos + node->len_aligned + GRF_HEADER_SIZE, SEEK_SET);
-        while (p < next->len_aligned) p += write(handler->fd, filemem + p, next->len_aligned - p);
-      }
-    }
+    if (node->size == 0) grf_file_delete(node);
     node = next;
   }
-  free(prenode);
-  grf_save(handler);
+  if (handler->first_node == NULL) return prv_grf_save(handler);
+  handler->filecount = handler->fast_table->count;
+  // ok, let's go!
+  // Save the files table at the end of the archive (where no file will be moved) followed by the journal, then the
+  // header with version "0xCACA". If we save again, it means it worked!
+  if (!prv_grf_write_table(handler, PRV_GRF_TABLE_EOF)) return false;
+  memset(&state, 0, sizeof(state));
+  state.journal_pos = handler->table_offset + handler->table_size;
+  if (!prv_grf_repack_journal_write(handler, &state, 0, 0, 0, 0)) return false;
+  version            = handler->version;
+  handler->version   = (0xCACA | repack_type << 24 | ((version == GRF_FILE_LARGE_VERSION) ? GRF_REPACK_LARGE : 0));  // save repack_type as well~
+  res                = prv_grf_write_header(handler) && prv_grf_sync(handler->fd);
+  handler->version   = version;
+  handler->need_save = true;
+  if (!res) return false;
+  if (!prv_grf_repack_run(handler, repack_type, &state, 0)) {
+    // error or canceled: the journal is still valid, don't overwrite it, the archive will be fixed next time it gets
+    // opened
+    handler->need_save = false;
+    prv_grf_progress_done(handler);
+    return false;
+  }
+  prv_grf_save(handler);
   prv_grf_recount_wasted_space(handler);
+  prv_grf_progress_done(handler);
   return true;
 }
 
-static inline size_t prv_grf_strnlen(const char *str, const size_t maxlen) {
-  for (size_t i = 0; i < maxlen; i++)
-    if (*(str + i) == 0) return i;
-  return maxlen;
+// compare two filenames the way the index does (case insensitive, '/' and '\\' are the same)
+static int prv_grf_name_cmp(const char *a, const char *b) {
+  for (;; a++, b++) {
+    unsigned char x = *a, y = *b;
+    if ((x >= 'A') && (x <= 'Z')) x += 32;
+    if ((y >= 'A') && (y <= 'Z')) y += 32;
+    if (x == '/') x = '\\';
+    if (y == '/') y = '\\';
+    if ((x != y) || (x == 0)) return x - y;
+  }
 }
 
-GRFEXPORT void grf_create_tree(grf_handle handler) {
-  struct grf_node *cur_node;
-  uint32_t i = 0, j = 100;
-  if (handler->root != NULL) return;
-  // the idea is simple : get to each file and scan them~
-  // First, create the root node...
-  handler->root = (struct grf_treenode *)calloc(1, sizeof(struct grf_treenode));
-  memset(handler->root, 0, sizeof(struct grf_treenode));
-  handler->root->is_dir = true;  // root is a directory, that's common knowledge
-  handler->root->name   = NULL;  // root does not have a name
-  handler->root->subdir = hash_create_table(GRF_TREE_HASH_SIZE, prv_grf_tree_table_free_node);
-  // now, list all files in the archive...
-  cur_node = handler->first_node;
-  while (cur_node != NULL) {
-    // ... and register 'em
-    prv_grf_reg_tree_node(handler->root, cur_node);
-    cur_node = cur_node->next;
-    i++;
-    if (--j <= 0) {
-      j = 100;
-      if (handler->callback != NULL) {
-        handler->callback(handler->callback_etc, handler, i, handler->filecount, cur_node->filename);
-      }
+static int prv_grf_node_name_cmp(const void *a, const void *b) {
+  return prv_grf_name_cmp((*(struct grf_node **)a)->filename, (*(struct grf_node **)b)->filename);
+}
+
+static int prv_grf_node_pos_cmp(const void *a, const void *b) {
+  uint64_t x = (*(struct grf_node **)a)->pos, y = (*(struct grf_node **)b)->pos;
+  return (x > y) - (x < y);
+}
+
+GRFEXPORT bool grf_repack_layout(grf_handle handler, uint8_t repack_type, uint8_t layout, const uint32_t *ids, uint32_t count) {
+  struct grf_node **order, *node;
+  uint32_t n = 0, i, k;
+  uint64_t dest;
+  bool *seen, interrupted;
+  if (!handler->write_mode) return false; /* opened in read-only mode -> repack fails */
+  if (handler->transaction > 0) return false; /* the archive on disk must stay as it is until grf_commit() */
+  if ((repack_type != GRF_REPACK_FAST) && (repack_type != GRF_REPACK_DECRYPT)) return false;
+  if ((layout != GRF_LAYOUT_DIRECTORY) && (layout != GRF_LAYOUT_TRACE)) return false;
+  if (handler->first_node == NULL) return true;  // nothing to do on an empty file
+  if (ids == NULL) {
+    ids   = handler->trace;
+    count = handler->trace_count;
+  }
+  if (layout == GRF_LAYOUT_DIRECTORY) count = 0;
+  handler->filecount = handler->fast_table->count; /* files added since the last save are in the list too */
+  order              = calloc(handler->filecount + count + 1, sizeof(struct grf_node *));
+  if (order == NULL) return false;
+  // 1. resolve the trace while the IDs are still valid
+  for (i = 0; i < count; i++)
+    if ((ids[i] < handler->id_count) && (handler->node_table[ids[i]] != NULL)) order[n++] = handler->node_table[ids[i]];
+  // 2. keep the first access of each file, then everything else by directory
+  grf_update_id_list(handler);
+  seen = calloc(handler->id_count + 1, sizeof(bool));
+  if (seen == NULL) {
+    free(order);
+    return false;
+  }
+  k = n;
+  n = 0;
+  for (i = 0; i < k; i++) {
+    if (seen[order[i]->id]) continue;
+    seen[order[i]->id] = true;
+    order[n++]         = order[i];
+  }
+  k = n;
+  for (node = handler->first_node; (node != NULL) && (n < handler->filecount + count); node = node->next)
+    if (!seen[node->id]) order[n++] = node;
+  free(seen);
+  qsort(order + k, n - k, sizeof(struct grf_node *), prv_grf_node_name_cmp);
+  // 3. files already in the right order at the beginning of the archive can stay where they are
+  for (k = 0, node = handler->first_node; (k < n) && (order[k] == node); k++) node = node->next;
+  // 4. copy the other ones, in order, after everything currently in the archive (the files table on disk still
+  // points to the original copies, so nothing is lost if we get interrupted)
+  for (dest = 0, node = handler->first_node; node != NULL; node = node->next) dest = MAX(dest, node->pos + node->len_aligned);
+  dest = MAX(dest, handler->table_offset + handler->table_size);
+  prv_grf_progress_begin(handler, n);
+  for (i = k; i < n; i++) {
+    void *filemem;
+    node = order[i];
+    if (!prv_grf_progress(handler, i, node->filename)) break;
+    filemem = malloc(node->len_aligned + 1024);  // 1024 is needed in case of decryption
+    GRF_STAT_ADD(handler->stats, allocs, 1);
+    if ((filemem == NULL) || !prv_grf_read_at(handler, node->pos, filemem, node->len_aligned)) {
+      free(filemem);
+      break;
+    }
+    if ((repack_type >= GRF_REPACK_DECRYPT) && (node->cycle >= 0))
+      prv_grf_decode(handler, filemem, node->len_aligned, node->cycle);
+    if (!prv_grf_write_at(handler, dest, filemem, node->len_aligned)) {
+      free(filemem);
+      break;
+    }
+    free(filemem);
+    if (repack_type >= GRF_REPACK_DECRYPT) {
+      // clear encryption flags...
+      node->cycle = -1;
+      node->flags = node->flags & ~(GRF_FLAG_MIXCRYPT | GRF_FLAG_DES);
     }
+    node->pos = dest;
+    dest += node->len_aligned;
   }
-  if (handler->callback != NULL) {
-    handler->callback(handler->callback_etc, handler, handler->filecount, handler->filecount, NULL);
+  interrupted = (i < n);
+  if (interrupted) {
+    // files copied so far are fine where they are, just keep the list in storage order
+    qsort(order, n, sizeof(struct grf_node *), prv_grf_node_pos_cmp);
   }
+  // 5. relink the list in the new storage order, save, and let grf_repack() move everything back at the beginning
+  for (i = 0; i < n; i++) {
+    order[i]->prev = (i > 0) ? order[i - 1] : NULL;
+    order[i]->next = (i + 1 < n) ? order[i + 1] : NULL;
+  }
+  handler->first_node = order[0];
+  handler->last_node  = order[n - 1];
+  free(order);
+  handler->trace_count = 0; /* applied */
+  handler->need_save   = true;
+  if (!prv_grf_save(handler) || !prv_grf_sync(handler->fd)) return false;
+  if (interrupted) return false;
+  return grf_repack(handler, repack_type);
 }
 
-GRFEXPORT grf_treenode grf_tree_get_root(grf_handle handler) { return handler->root; }
+// find room for len bytes in [start, end), [t0, t1) being reserved
+static bool prv_grf_gap_fit(uint64_t start, uint64_t end, uint32_t len, uint64_t t0, uint64_t t1, uint64_t *pos) {
+  if (end <= start) return false;
+  if ((t1 > start) && (t0 < end)) {
+    if ((t0 > start) && (t0 - start >= len)) {
+      *pos = start;
+      return true;
+    }
+    if ((t1 < end) && (end - t1 >= len)) {
+      *pos = t1;
+      return true;
+    }
+    return false;
+  }
+  if (end - start < len) return false;
+  *pos = start;
+  return true;
+}
 
-GRFEXPORT grf_treenode *grf_tree_list_node(grf_treenode node) {
+GRFEXPORT uint32_t grf_defrag_step(grf_handle handler, uint32_t max_bytes) {
+  struct grf_node *resume = NULL; /* the hole search starts after this file, NULL for the beginning */
+  uint32_t moved          = 0;
+  uint64_t t0, t1;
+  if (!handler->write_mode) return 0;
+  // holes must only be free space for the table on disk: don't run inside a transaction, save pending changes first
+  if (handler->transaction > 0) return 0;
+  if (handler->need_save && !prv_grf_save(handler)) return 0;
+  t0 = handler->table_offset;
+  t1 = handler->table_offset + handler->table_size;
+  while (1) {
+    struct grf_node *last = handler->last_node, *cur, *prev = resume;
+    uint64_t dest = 0;
+    bool found    = false;
+    void *filemem;
+    if (last == NULL) break;
+    if ((moved > 0) && (moved + last->len_aligned > max_bytes)) break; /* the first file is moved even if larger */
+    // first hole in front of the last file, keeping the files table currently on disk untouched. Holes before the
+    // previous one were too small for the previous file, they are skipped until the next call.
+    for (cur = (resume == NULL) ? handler->first_node : resume->next; cur != NULL; prev = cur, cur = cur->next) {
+      uint64_t start = (prev == NULL) ? 0 : prev->pos + prev->len_aligned;
+      if (prv_grf_gap_fit(start, cur->pos, last->len_aligned, t0, t1, &dest)) {
+        found = true;
+        break;
+      }
+      if (cur == last) break;
+    }
+    if (!found) break; /* can't do better without a full grf_repack() */
+    // copy the file: the original stays valid until the new table is written
+    filemem = malloc(last->len_aligned);
+    if (filemem == NULL) break;
+    GRF_STAT_ADD(handler->stats, allocs, 1);
+    if (!prv_grf_read_at(handler, last->pos, filemem, last->len_aligned) ||
+        !prv_grf_write_at(handler, dest, filemem, last->len_aligned)) {
+      free(filemem);
+      break;
+    }
+    free(filemem);
+    moved += last->len_aligned;
+    resume = last;
+    if (cur == last) { /* hole right in front of it, no need to relink */
+      last->pos = dest;
+      continue;
+    }
+    last->pos = dest;
+    prv_grf_list_unlink(handler, last);
+    prv_grf_list_insert(handler, prev, last);
+  }
+  if (moved == 0) return 0;
+  // write the new table next to the last file, then the header, and only then drop the end of the archive
+  handler->filecount = handler->fast_table->count;
+  if (!prv_grf_sync(handler->fd) || !prv_grf_write_table(handler, PRV_GRF_TABLE_SAFE) || !prv_grf_write_header(handler) ||
+      !prv_grf_sync(handler->fd))
+    return 0;
+  ftruncate(handler->fd, handler->table_offset + handler->table_size + GRF_HEADER_SIZE);
+  prv_grf_recount_wasted_space(handler);
+  return moved;
+}
+
+static inline size_t prv_grf_strnlen(const char *str, const size_t maxlen) {
+  for (size_t i = 0; i < maxlen; i++)
+    if (*(str + i) == 0) return i;
+  return maxlen;
+}
+
+GRFEXPORT void grf_create_tree(grf_handle handler) {
+  struct grf_node *cur_node;
+  uint32_t i = 0;
+  uint64_t t0;
+  bool sorted;
+  if (handler->root != NULL) return;
+  t0 = GRF_STAT_START(handler->stats);
+  // the idea is simple : get to each file and scan them~
+  // First, create the root node...
+  handler->tree_lazy = false;
+  handler->root      = prv_grf_tree_new(handler, NULL, NULL, 0, true);  // root is a directory, that's common knowledge
+  if (handler->root == NULL) return;
+  handler->root->grf = handler;
+  // now, list all files in the archive, by name if we can so each one lands after the last entry of its directory
+  sorted   = prv_grf_sorted_build(handler);
+  cur_node = sorted ? ((handler->sorted_count > 0) ? handler->sorted[0] : NULL) : handler->first_node;
+  prv_grf_progress_begin(handler, handler->filecount);
+  while (cur_node != NULL) {
+    // ... and register 'em
+    prv_grf_reg_tree_node(handler, cur_node);
+    i++;
+    prv_grf_progress(handler, i, cur_node->filename); /* the tree can't be left half built */
+    if (sorted)
+      cur_node = (i < handler->sorted_count) ? handler->sorted[i] : NULL;
+    else
+      cur_node = cur_node->next;
+  }
+  GRF_STAT_END(handler->stats, GRF_STAT_TREE, t0);
+  prv_grf_progress_done(handler);
+}
+
+GRFEXPORT void grf_create_tree_lazy(grf_handle handler) {
+  if (handler->root != NULL) return;
+  handler->tree_lazy = true;
+  handler->root      = prv_grf_tree_new(handler, NULL, NULL, 0, true);
+  if (handler->root != NULL) handler->root->grf = handler;
+}
+
+GRFEXPORT grf_treenode grf_tree_get_root(grf_handle handler) {
+  if (handler->root != NULL) prv_grf_tree_load(handler, handler->root);
+  return handler->root;
+}
+
+/* make sure the entries of a directory exist */
+static void prv_grf_tree_need(struct grf_treenode *node) {
+  struct grf_treenode *root = node;
+  if (node->loaded) return;
+  while (root->parent != NULL) root = root->parent;
+  prv_grf_tree_load(root->grf, node);
+}
+
+GRFEXPORT grf_treenode *grf_tree_list_node(grf_treenode node) {
+  grf_treenode *list;
+  if (!node->is_dir) return NULL;
+  prv_grf_tree_need(node);
+  list = malloc(sizeof(grf_treenode) * (node->child_count + 1));
+  if (list == NULL) return NULL;
+  if (node->child_count > 0) memcpy(list, node->child, sizeof(grf_treenode) * node->child_count);
+  list[node->child_count] = NULL;
+  return list;
+}
+
+GRFEXPORT grf_treenode grf_tree_iterate(grf_treenode node, grf_cursor *cursor) {
   if (!node->is_dir) return NULL;
-  return (grf_treenode *)hash_foreach_val(node->subdir);
+  prv_grf_tree_need(node);
+  if (cursor->pos >= node->child_count) return NULL;
+  return node->child[cursor->pos++];
 }
 
 GRFEXPORT bool grf_tree_is_dir(grf_treenode node) { return node->is_dir; }
 
-GRFEXPORT uint32_t grf_tree_dir_count_files(grf_treenode node) { return node->subdir->count; }
+GRFEXPORT uint32_t grf_tree_dir_count_files(grf_treenode node) {
+  if (node->is_dir) prv_grf_tree_need(node);
+  return node->child_count;
+}
 
 GRFEXPORT grf_node grf_tree_get_file(grf_treenode node) { return node->ptr; }
 
@@ -611,79 +1530,570 @@ GRFEXPORT const char *grf_tree_get_name(grf_treenode node) { return node->name;
 
 GRFEXPORT grf_treenode grf_tree_get_parent(grf_treenode node) { return node->parent; }
 
-GRFEXPORT grf_treenode grf_file_get_tree(grf_node handler) { return handler->tree_parent; }
+GRFEXPORT grf_treenode grf_file_get_tree(grf_node handler) {
+  if ((handler->tree_parent == NULL) && (handler->parent->root != NULL)) prv_grf_tree_reveal(handler->parent, handler);
+  return handler->tree_parent;
+}
 
 GRFEXPORT void grf_update_id_list(grf_handle handler) {
-  struct grf_node *cur;
-  int i = 0;
-  if (handler->node_table != NULL) free(handler->node_table);
-  handler->node_table = calloc(handler->filecount + 1, sizeof(void *));
-  cur                 = handler->first_node;
-  while (cur != NULL) {
-    handler->node_table[i] = cur;
-    cur->id                = i++;
-    cur                    = cur->next;
-  }
-}
-
-//  quickSort
-//
-//  This public-domain C implementation by Darel R. Finley.
-//  Edited by MagicalTux for libgrf
-//  http://alienryderflex.com/quicksort/
-//
-//  * Returns true if sort was successful, or false if the nested
-//    pivots went too deep, in which case your array will have
-//    been re-ordered, but probably not sorted correctly.
-//
-//  * This function assumes it is called with valid parameters.
-//
-//  * Example calls:
-//    quickSort(&myArray[0],5); // sorts elements 0, 1, 2, 3, and 4
-//    quickSort(&myArray[3],5); // sorts elements 3, 4, 5, 6, and 7
-
-#define PRV_GRF_QUICKSORT_MAX_LEVELS 1000
-static bool prv_grf_quicksort(struct grf_handler *handler, uint32_t elements) {
-  uint32_t beg[PRV_GRF_QUICKSORT_MAX_LEVELS], end[PRV_GRF_QUICKSORT_MAX_LEVELS];
-  int i = 0, L, R;
-  struct grf_node *piv;
-  struct grf_node **arr;
-
-  arr = (struct grf_node **)hash_foreach_val(handler->fast_table);
-
-  beg[0] = 0;
-  end[0] = elements;
-  while (i >= 0) {
-    L = beg[i];
-    R = end[i] - 1;
-    if (L < R) {
-      piv = arr[L];
-      if (i == PRV_GRF_QUICKSORT_MAX_LEVELS - 1) return NULL;
-      while (L < R) {
-        while (arr[R]->pos >= piv->pos && L < R) R--;
-        if (L < R) arr[L++] = arr[R];
-        while (arr[L]->pos <= piv->pos && L < R) L++;
-        if (L < R) arr[R--] = arr[L];
+  // IDs are kept up to date on each change, only number the files if it was never done
+  if (handler->node_table == NULL) prv_grf_id_renumber(handler);
+}
+
+/* LSD radix sort of order[] (indices) by pos[index], with one pass per byte of
+ * pos that isn't the same for every entry, so the cost stays linear whatever
+ * the table looks like.
+ */
+static bool prv_grf_radix_by_pos(uint32_t *order, const uint64_t *pos, uint32_t n) {
+  uint32_t count[256], *buf, *src = order, *dst;
+  if (n < 2) return true;
+  buf = malloc(sizeof(uint32_t) * n);
+  if (buf == NULL) return false;
+  dst = buf;
+  for (int shift = 0; shift < 64; shift += 8) {
+    uint32_t sum = 0, *swap;
+    memset(count, 0, sizeof(count));
+    for (uint32_t i = 0; i < n; i++) count[(pos[src[i]] >> shift) & 0xff]++;
+    if (count[(pos[src[0]] >> shift) & 0xff] == n) continue; /* same byte everywhere */
+    for (int i = 0; i < 256; i++) {
+      uint32_t c = count[i];
+      count[i]   = sum;
+      sum += c;
+    }
+    for (uint32_t i = 0; i < n; i++) dst[count[(pos[src[i]] >> shift) & 0xff]++] = src[i];
+    swap = src;
+    src  = dst;
+    dst  = swap;
+  }
+  if (src != order) memcpy(order, src, sizeof(uint32_t) * n);
+  free(buf);
+  return true;
+}
+
+/* sort the files list by position. The list comes in table order, which most
+ * tools write already sorted: that case is detected in one pass.
+ */
+static bool prv_grf_sort_by_pos(struct grf_handler *handler) {
+  uint32_t n = 0, *order = NULL;
+  uint64_t *pos = NULL;
+  struct grf_node **arr, *cur;
+  bool sorted = true;
+  for (cur = handler->first_node; cur != NULL; cur = cur->next) n++;
+  arr = malloc(sizeof(struct grf_node *) * (n + 1));
+  if (arr == NULL) return false;
+  n = 0;
+  for (cur = handler->first_node; cur != NULL; cur = cur->next) {
+    if ((n > 0) && (arr[n - 1]->pos > cur->pos)) sorted = false;
+    arr[n++] = cur;
+  }
+  if (!sorted) {
+    bool ok;
+    order = malloc(sizeof(uint32_t) * n);
+    pos   = malloc(sizeof(uint64_t) * n);
+    ok    = (order != NULL) && (pos != NULL);
+    if (ok) {
+      for (uint32_t i = 0; i < n; i++) {
+        order[i] = i;
+        pos[i]   = arr[i]->pos;
       }
-      arr[L]     = piv;
-      beg[i + 1] = L + 1;
-      end[i + 1] = end[i];
-      end[i++]   = L;
-    } else {
-      i--;
+      ok = prv_grf_radix_by_pos(order, pos, n);
+    }
+    if (pos != NULL) free(pos);
+    if (!ok) {
+      if (order != NULL) free(order);
+      free(arr);
+      return false;
     }
   }
   // restore order~
-  piv = NULL;
-  for (unsigned int i = 0; arr[i] != NULL; i++) {
-    arr[i]->prev               = piv;
-    if (piv != NULL) piv->next = arr[i];
-    piv                        = arr[i];
-  }
-  piv->next           = NULL;
-  handler->first_node = arr[0];
+  handler->first_node = handler->last_node = NULL;
+  for (uint32_t i = 0; i < n; i++) {
+    cur       = arr[(order != NULL) ? order[i] : i];
+    cur->prev = handler->last_node;
+    cur->next = NULL;
+    if (cur->prev != NULL)
+      cur->prev->next = cur;
+    else
+      handler->first_node = cur;
+    handler->last_node = cur;
+  }
+  if (order != NULL) free(order);
   free(arr);
-  grf_update_id_list(handler);
+  return prv_grf_id_renumber(handler);
+}
+
+static inline const char *prv_grf_compact_name(struct grf_compact *c, uint32_t i) {
+  return c->lazy ? c->table + c->off[i] : c->names + c->name[i];
+}
+
+/* index of filename in the grf_load_compact() store, UINT32_MAX if missing */
+static uint32_t prv_grf_compact_find(struct grf_compact *c, const char *filename) {
+  if (c->slots == NULL) return UINT32_MAX;
+  for (uint32_t s = prv_grf_name_hash(filename) & c->slot_mask;; s = (s + 1) & c->slot_mask) {
+    uint32_t i = c->slots[s];
+    if (i == 0) return UINT32_MAX;
+    if (prv_grf_name_cmp(prv_grf_compact_name(c, i - 1), filename) == 0) return i - 1;
+  }
+}
+
+static void prv_grf_compact_slot_add(struct grf_compact *c, const char *name, uint32_t i) {
+  uint32_t s;
+  for (s = prv_grf_name_hash(name) & c->slot_mask; c->slots[s] != 0; s = (s + 1) & c->slot_mask)
+    ;
+  c->slots[s] = i + 1;
+}
+
+/* handle of entry i, created the first time it is asked for */
+static struct grf_node *prv_grf_compact_node(struct grf_handler *handler, uint32_t i) {
+  struct grf_compact *c = handler->compact;
+  struct grf_node *node;
+  if (i >= c->count) return NULL;
+  if (c->nodes[i] != NULL) return c->nodes[i];
+  node = calloc(1, sizeof(struct grf_node));
+  if (node == NULL) return NULL;
+  GRF_STAT_ADD(handler->stats, allocs, 1);
+  node->parent   = handler;
+  node->filename = (char *)prv_grf_compact_name(c, i); /* not a copy, the handle can't be renamed anyway */
+  node->id       = i;
+  if (c->lazy) {
+    struct grf_table_entry_data64 te;
+    prv_grf_table_entry_get(node->filename + strlen(node->filename) + 1, &te, c->large);
+    node->flags       = te.flags;
+    node->size        = te.size;
+    node->len         = te.len;
+    node->len_aligned = te.len_aligned;
+    node->pos         = te.pos;
+  } else {
+    node->flags       = c->flags[i];
+    node->size        = c->size[i];
+    node->len         = c->len[i];
+    node->len_aligned = c->len_aligned[i];
+    node->pos         = c->pos[i];
+  }
+  node->cycle       = prv_grf_entry_cycle(node->flags, node->len);
+  c->nodes[i]       = node;
+  return node;
+}
+
+static bool prv_grf_compact_all(struct grf_handler *handler) {
+  for (uint32_t i = 0; i < handler->compact->count; i++)
+    if (prv_grf_compact_node(handler, i) == NULL) return false;
+  return true;
+}
+
+static void prv_grf_compact_free(struct grf_handler *handler) {
+  struct grf_compact *c = handler->compact;
+  if (c == NULL) return;
+  if (c->nodes != NULL) {
+    for (uint32_t i = 0; i < c->count; i++)
+      if (c->nodes[i] != NULL) free(c->nodes[i]);
+    free(c->nodes);
+  }
+  if (c->pos != NULL) free(c->pos);
+  if (c->len != NULL) free(c->len);
+  if (c->len_aligned != NULL) free(c->len_aligned);
+  if (c->size != NULL) free(c->size);
+  if (c->name != NULL) free(c->name);
+  if (c->flags != NULL) free(c->flags);
+  if (c->names != NULL) free(c->names);
+  if (c->slots != NULL) free(c->slots);
+  if (c->table != NULL) free(c->table);
+  if (c->off != NULL) free(c->off);
+  free(c);
+  handler->compact = NULL;
+}
+
+/* fill the grf_load_compact() store from the inflated files table, with the
+ * same rules as prv_grf_load(): directories and empty files are skipped, files
+ * overlapping the previous one (by position) or named like another are dropped
+ */
+static bool prv_grf_compact_fill(struct grf_handler *handler, const char *table, uint32_t table_len, bool large, uint64_t *wasted_space) {
+  struct grf_compact *c = handler->compact;
+  size_t te_len         = large ? sizeof(struct grf_table_entry_data64) : sizeof(struct grf_table_entry_data);
+  uint32_t n = 0, records = 0, off = 0, names_len = 0, slots = 2, *at, *order;
+  uint64_t *pos, prev = 0;
+  bool ok = true, sorted = true;
+  at  = malloc(sizeof(uint32_t) * (handler->filecount + 1)); /* where each file is in the table */
+  pos = malloc(sizeof(uint64_t) * (handler->filecount + 1));
+  if ((at == NULL) || (pos == NULL)) ok = false;
+  // first pass: find the files, and their position to sort them
+  while (ok && (off < table_len)) {
+    struct grf_table_entry_data64 te;
+    size_t fn_len = prv_grf_strnlen(table + off, table_len - off);
+    if ((fn_len + 1 + te_len > table_len - off) || (records++ == handler->filecount)) {
+      ok = false;
+      break;
+    }
+    prv_grf_table_entry_get(table + off + fn_len + 1, &te, large);
+    if ((te.flags & GRF_FLAG_FILE) && (te.size != 0)) {
+      if ((n > 0) && (pos[n - 1] > te.pos)) sorted = false;
+      at[n]    = off;
+      pos[n++] = te.pos;
+      names_len += fn_len + 1;
+    }
+    if (!prv_grf_progress(handler, records, table + off)) ok = false;
+    off += fn_len + 1 + te_len;
+  }
+  if (records != handler->filecount) ok = false;
+  while (slots < n * 2) slots *= 2;
+  order = ok ? malloc(sizeof(uint32_t) * (n + 1)) : NULL;
+  if (order == NULL) ok = false;
+  for (uint32_t i = 0; ok && (i < n); i++) order[i] = i;
+  if (ok && !sorted) ok = prv_grf_radix_by_pos(order, pos, n);
+  if (pos != NULL) free(pos);
+  if (ok) {
+    c->pos         = malloc(sizeof(uint64_t) * (n + 1));
+    c->len         = malloc(sizeof(uint32_t) * (n + 1));
+    c->len_aligned = malloc(sizeof(uint32_t) * (n + 1));
+    c->size        = malloc(sizeof(uint32_t) * (n + 1));
+    c->name        = malloc(sizeof(uint32_t) * (n + 1));
+    c->flags       = malloc(n + 1);
+    c->names       = malloc(names_len + 1);
+    c->slots       = calloc(slots, sizeof(uint32_t));
+    c->nodes       = calloc(n + 1, sizeof(struct grf_node *));
+    c->slot_mask   = slots - 1;
+    ok = (c->pos != NULL) && (c->len != NULL) && (c->len_aligned != NULL) && (c->size != NULL) && (c->name != NULL) && (c->flags != NULL) &&
+         (c->names != NULL) && (c->slots != NULL) && (c->nodes != NULL);
+  }
+  // second pass, in position order
+  names_len = 0;
+  for (uint32_t k = 0; ok && (k < n); k++) {
+    const char *name = table + at[order[k]];
+    size_t fn_len    = strlen(name);
+    struct grf_table_entry_data64 te;
+    uint32_t i = c->count;
+    prv_grf_table_entry_get(name + fn_len + 1, &te, large);
+    if ((prev > te.pos + te.len_aligned) || (prv_grf_compact_find(c, name) != UINT32_MAX)) continue;
+    c->pos[i]         = te.pos;
+    c->len[i]         = te.len;
+    c->len_aligned[i] = te.len_aligned;
+    c->size[i]        = te.size;
+    c->flags[i]       = te.flags;
+    c->name[i]        = names_len;
+    memcpy(c->names + names_len, name, fn_len + 1);
+    names_len += fn_len + 1;
+    prv_grf_compact_slot_add(c, name, c->count++);
+    prev = te.pos + te.len_aligned;
+    *wasted_space -= te.len_aligned;
+  }
+  if (at != NULL) free(at);
+  if (order != NULL) free(order);
+  handler->filecount = c->count;
+  handler->id_count  = c->count;
+  return ok;
+}
+
+/* grf_load_lazy(): keep the inflated files table (which then belongs to the
+ * store), and only remember where each file is. Directories, empty files and
+ * duplicate names are skipped, nothing else is checked.
+ */
+static bool prv_grf_compact_index(struct grf_handler *handler, char *table, uint32_t table_len, bool large, uint64_t *wasted_space) {
+  struct grf_compact *c = handler->compact;
+  size_t te_len         = large ? sizeof(struct grf_table_entry_data64) : sizeof(struct grf_table_entry_data);
+  uint32_t records = 0, off = 0, slots = 2;
+  c->table  = table;
+  c->large  = large;
+  while (slots < handler->filecount * 2) slots *= 2;
+  c->off       = malloc(sizeof(uint32_t) * (handler->filecount + 1));
+  c->slots     = calloc(slots, sizeof(uint32_t));
+  c->nodes     = calloc(handler->filecount + 1, sizeof(struct grf_node *));
+  c->slot_mask = slots - 1;
+  if ((c->off == NULL) || (c->slots == NULL) || (c->nodes == NULL)) return false;
+  while (off < table_len) {
+    struct grf_table_entry_data64 te;
+    size_t fn_len = prv_grf_strnlen(table + off, table_len - off);
+    if ((fn_len + 1 + te_len > table_len - off) || (records++ == handler->filecount)) return false;
+    prv_grf_table_entry_get(table + off + fn_len + 1, &te, large);
+    if ((te.flags & GRF_FLAG_FILE) && (te.size != 0) && (prv_grf_compact_find(c, table + off) == UINT32_MAX)) {
+      c->off[c->count] = off;
+      prv_grf_compact_slot_add(c, table + off, c->count++);
+      *wasted_space -= te.len_aligned;
+    }
+    if (!prv_grf_progress(handler, records, table + off)) return false;
+    off += fn_len + 1 + te_len;
+  }
+  if (records != handler->filecount) return false;
+  handler->filecount = c->count;
+  handler->id_count  = c->count;
+  return true;
+}
+
+/* the file records found in one chunk of the files table */
+struct prv_grf_load_batch {
+  struct grf_handler *handler;
+  const char *buf;
+  bool large;
+  uint32_t count, alloc;
+  uint32_t *recs; /* offset of each file record in buf */
+  struct grf_node **nodes;
+  list_element **elems; /* their fast_table entries, NULL for a duplicate name */
+  unsigned long *buckets;
+};
+
+struct prv_grf_load_job {
+  struct prv_grf_load_batch *batch;
+  uint32_t from, to;                    /* records turned into nodes by this job */
+  unsigned long bucket_from, bucket_to; /* then fast_table buckets filled by it */
+  uint32_t added;
+  bool ok;
+};
+
+/* build the nodes (and their hash entries) of records from..to */
+static void *prv_grf_load_build(void *arg) {
+  struct prv_grf_load_job *job     = arg;
+  struct prv_grf_load_batch *batch = job->batch;
+  for (uint32_t i = job->from; i < job->to; i++) {
+    const char *name = batch->buf + batch->recs[i];
+    size_t fn_len    = strlen(name);
+    struct grf_table_entry_data64 tmpentry;
+    struct grf_node *entry = calloc(1, sizeof(struct grf_node));
+    if ((entry == NULL) || ((entry->filename = malloc(fn_len + 1)) == NULL)) {
+      if (entry != NULL) free(entry);
+      job->ok = false;
+      return NULL;
+    }
+    memcpy(entry->filename, name, fn_len + 1);
+    prv_grf_table_entry_get(name + fn_len + 1, &tmpentry, batch->large);
+    entry->flags       = tmpentry.flags;
+    entry->size        = tmpentry.size;
+    entry->len         = tmpentry.len;
+    entry->len_aligned = tmpentry.len_aligned;
+    entry->pos         = tmpentry.pos;
+    entry->parent      = batch->handler;
+    entry->cycle       = prv_grf_entry_cycle(entry->flags, entry->len);
+    batch->nodes[i]    = entry;
+    batch->elems[i]    = hash_prepare_element(batch->handler->fast_table, entry->filename, entry, &batch->buckets[i]);
+    if (batch->elems[i] == NULL) {
+      job->ok = false;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* insert the hash entries falling in buckets bucket_from..bucket_to, in records order */
+static void *prv_grf_load_insert(void *arg) {
+  struct prv_grf_load_job *job     = arg;
+  struct prv_grf_load_batch *batch = job->batch;
+  for (uint32_t i = 0; i < batch->count; i++) {
+    list_element *elem = batch->elems[i];
+    if ((batch->buckets[i] < job->bucket_from) || (batch->buckets[i] >= job->bucket_to)) continue;
+    if (hash_insert_element(batch->handler->fast_table, elem, batch->buckets[i]) == 0) {
+      job->added++;
+      continue;
+    }
+    // duplicate name, the first one wins (and the other one's data becomes wasted space)
+    free(elem->string);
+    free(elem);
+    free(batch->nodes[i]->filename);
+    free(batch->nodes[i]);
+    batch->elems[i] = NULL;
+    batch->nodes[i] = NULL;
+  }
+  return NULL;
+}
+
+/* run fn on each job, on one thread per job (the calling one included) when possible */
+static void prv_grf_load_run(void *(*fn)(void *), struct prv_grf_load_job *jobs, int count) {
+  int started = 1;
+#ifdef GRF_HAVE_PTHREAD
+  pthread_t th[GRF_LOAD_THREADS_MAX];
+  for (; started < count; started++)
+    if (pthread_create(&th[started], NULL, fn, &jobs[started]) != 0) break;
+#endif
+  fn(&jobs[0]);
+#ifdef GRF_HAVE_PTHREAD
+  for (int i = 1; i < started; i++) pthread_join(th[i], NULL);
+#endif
+  for (int i = started; i < count; i++) fn(&jobs[i]); /* couldn't start those */
+}
+
+/* turn the records of batch into nodes and fast_table entries, split among threads */
+static bool prv_grf_load_batch(struct prv_grf_load_batch *batch, int threads) {
+  struct prv_grf_load_job jobs[GRF_LOAD_THREADS_MAX];
+  unsigned long buckets = batch->handler->fast_table->size;
+  bool ok               = true;
+  if ((uint32_t)threads > batch->count / 1024 + 1) threads = batch->count / 1024 + 1; /* not worth it for small batches */
+  memset(batch->nodes, 0, sizeof(struct grf_node *) * batch->count);
+  memset(batch->elems, 0, sizeof(list_element *) * batch->count);
+  for (int i = 0; i < threads; i++) {
+    jobs[i].batch       = batch;
+    jobs[i].from        = (uint64_t)batch->count * i / threads;
+    jobs[i].to          = (uint64_t)batch->count * (i + 1) / threads;
+    jobs[i].bucket_from = (uint64_t)buckets * i / threads;
+    jobs[i].bucket_to   = (uint64_t)buckets * (i + 1) / threads;
+    jobs[i].added       = 0;
+    jobs[i].ok          = true;
+  }
+  prv_grf_load_run(prv_grf_load_build, jobs, threads);
+  for (int i = 0; i < threads; i++) ok = ok && jobs[i].ok;
+  if (!ok) {
+    for (uint32_t i = 0; i < batch->count; i++) {
+      if (batch->elems[i] != NULL) {
+        free(batch->elems[i]->string);
+        free(batch->elems[i]);
+      }
+      if (batch->nodes[i] != NULL) {
+        free(batch->nodes[i]->filename);
+        free(batch->nodes[i]);
+      }
+    }
+    return false;
+  }
+  prv_grf_load_run(prv_grf_load_insert, jobs, threads);
+  for (int i = 0; i < threads; i++) batch->handler->fast_table->count += jobs[i].added;
+  return true;
+}
+
+static bool prv_grf_load_batch_grow(struct prv_grf_load_batch *batch) {
+  uint32_t alloc = MAX(1024, batch->alloc * 2);
+  void *ptr;
+  if ((ptr = realloc(batch->recs, sizeof(uint32_t) * alloc)) == NULL) return false;
+  batch->recs = ptr;
+  if ((ptr = realloc(batch->nodes, sizeof(struct grf_node *) * alloc)) == NULL) return false;
+  batch->nodes = ptr;
+  if ((ptr = realloc(batch->elems, sizeof(list_element *) * alloc)) == NULL) return false;
+  batch->elems = ptr;
+  if ((ptr = realloc(batch->buckets, sizeof(unsigned long) * alloc)) == NULL) return false;
+  batch->buckets = ptr;
+  batch->alloc   = alloc;
+  return true;
+}
+
+/* threads used to load a table of filecount entries */
+static int prv_grf_load_threads(uint32_t filecount) {
+  int threads = 1;
+#ifdef GRF_HAVE_PTHREAD
+  if (filecount >= GRF_LOAD_THREADS_MIN_FILES) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > GRF_LOAD_THREADS_MAX) threads = GRF_LOAD_THREADS_MAX;
+  if (threads < 1) threads = 1;
+#endif
+  return threads;
+}
+
+/* parse the 0x200 (or 0x300) files table into nodes appended after *last. The
+ * table is inflated by chunks straight from the file, so it is never held whole
+ * in memory. The file records of each chunk are found first, then turned into
+ * nodes and hash entries on several threads for big tables (see
+ * prv_grf_load_batch()), and finally linked in table order.
+ */
+static bool prv_grf_load_table(struct grf_handler *handler, const uint32_t *posinfo, bool large, uint64_t *wasted_space, struct grf_node **last, int *result) {
+  size_t te_len = large ? sizeof(struct grf_table_entry_data64) : sizeof(struct grf_table_entry_data);
+  int threads   = prv_grf_load_threads(handler->filecount);
+  uint32_t size = (threads > 1) ? GRF_TABLE_CHUNK * 32 : GRF_TABLE_CHUNK, have = 0, done = 0;
+  struct zlib_stream *stream = zlib_stream_open(handler->fd, posinfo[0], NULL, handler->stats);
+  struct prv_grf_load_batch batch;
+  char *buf = malloc(size), byte;
+  bool ok   = (stream != NULL) && (buf != NULL);
+  int n;
+  // about one bucket per file, without trusting filecount more than the table size
+  uint32_t buckets = MIN(handler->filecount, posinfo[1] / (te_len + 1));
+  if (handler->fast_table->size < buckets) hash_resize(handler->fast_table, buckets);
+  memset(&batch, 0, sizeof(batch));
+  batch.handler = handler;
+  batch.large   = large;
+  while (ok) {
+    uint64_t t0 = GRF_STAT_START(handler->stats);
+    uint32_t p  = 0;
+    // complete records
+    batch.count = 0;
+    while (ok) {
+      struct grf_table_entry_data64 tmpentry;
+      size_t fn_len = prv_grf_strnlen(buf + p, have - p);
+      if (fn_len + 1 + te_len > have - p) break;
+      prv_grf_table_entry_get(buf + p + fn_len + 1, &tmpentry, large);
+      (*result)--;
+      // do not register "directory" entries and empty(bogus) files
+      if ((tmpentry.flags & GRF_FLAG_FILE) && (tmpentry.size != 0)) {
+        if ((batch.count == batch.alloc) && !prv_grf_load_batch_grow(&batch)) {
+          ok = false;
+          break;
+        }
+        batch.recs[batch.count++] = p;
+      }
+      p += fn_len + 1 + te_len;
+    }
+    batch.buf = buf;
+    if (ok && (batch.count > 0)) ok = prv_grf_load_batch(&batch, threads);
+    for (uint32_t i = 0; ok && (i < batch.count); i++) {
+      struct grf_node *entry = batch.nodes[i];
+      if (entry == NULL) continue; /* duplicate */
+      *wasted_space -= entry->len_aligned;
+      if (*last == NULL) {
+        handler->first_node = entry;
+      } else {
+        (*last)->next = entry;
+        entry->prev   = *last;
+      }
+      *last = entry;
+    }
+    GRF_STAT_ADD(handler->stats, allocs, batch.count);
+    GRF_STAT_END(handler->stats, GRF_STAT_TABLE_PARSE, t0);
+    // once per chunk
+    if (ok && (batch.count > 0) && !prv_grf_progress(handler, handler->filecount - *result, (*last)->filename)) ok = false;
+    if (!ok) break;
+    memmove(buf, buf + p, have - p);
+    have -= p;
+    if (done == posinfo[1]) break;
+    if (have == size) {  // a single record doesn't fit
+      char *nbuf = realloc(buf, size * 2);
+      if (nbuf == NULL) {
+        ok = false;
+        break;
+      }
+      buf = nbuf;
+      size *= 2;
+    }
+    n = zlib_stream_read(stream, buf + have, ((size - have) < (posinfo[1] - done)) ? (size - have) : (posinfo[1] - done));
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    have += n;
+    done += n;
+  }
+  // the whole table must have been used, and be exactly that long
+  ok = ok && (have == 0) && (zlib_stream_read(stream, &byte, 1) == 0);
+  if (buf != NULL) free(buf);
+  if (batch.recs != NULL) free(batch.recs);
+  if (batch.nodes != NULL) free(batch.nodes);
+  if (batch.elems != NULL) free(batch.elems);
+  if (batch.buckets != NULL) free(batch.buckets);
+  zlib_stream_close(stream);
+  return ok;
+}
+
+/* check a header, and get what it says. head->version loses the repack type
+ * of an interrupted repack (0xCACA), table_offset is counted after the header.
+ */
+static bool prv_grf_header_parse(struct grf_header *head, bool *large, uint8_t *repack_type, uint64_t *table_offset, uint32_t *filecount) {
+  if (strncmp(head->header_magic, GRF_HEADER_MAGIC, sizeof(head->header_magic)) != 0) return false;  // bad magic !
+  for (int i = 1; i <= (int)sizeof(head->header_key); i++)
+    if ((head->header_key[i - 1] != i) && (head->header_key[i - 1] != 0)) return false;
+  *large       = prv_grf_version_large(head->version);
+  *repack_type = 0;
+  if ((head->version & 0xFFFF) == 0xCACA) {  // grf_repack() also stores the repack type in the upper byte
+    *repack_type  = head->version >> 24;
+    head->version = 0xCACA;
+  }
+  switch (head->version) {
+    case 0x102:
+    case 0x103:
+    case 0x200:
+    case 0x300:
+    case 0xCACA:
+      break;
+    default:
+      return false; /* unknown version */
+  }
+
+  if (*large) {  // the seed holds the upper part of the offset
+    *table_offset = head->offset | (uint64_t)head->seed << 32;
+    *filecount    = head->filecount - 7;
+  } else {
+    *table_offset = head->offset;
+    *filecount    = head->filecount - head->seed - 7;
+  }
   return true;
 }
 
@@ -691,34 +2101,25 @@ static bool prv_grf_load(struct grf_handler *handler) {
   struct grf_header head;
   struct stat grfstat;
   uint32_t posinfo[2];
-  uint32_t wasted_space = 0;
-  uint32_t brokenpos;
+  uint64_t wasted_space = 0;
+  uint8_t repack_type   = 0;
+  struct prv_grf_repack_state repack;
+  int64_t repack_done   = 0;
   int dlen, result;
   void *table, *table_comp, *pos, *pos_max;
   struct grf_node *entry, *last;
-  int hcall = 100;
+  uint64_t t0;
+  bool large;
 
   // load header...
   handler->need_save = false;
   lseek(handler->fd, 0, SEEK_SET);
   result = read(handler->fd, (void *)&head, sizeof(struct grf_header));
   if (result != sizeof(struct grf_header)) return false;
+  GRF_STAT_ADD(handler->stats, bytes_read, sizeof(struct grf_header));
 
-  if (strncmp(head.header_magic, GRF_HEADER_MAGIC, sizeof(head.header_magic)) != 0) return false;  // bad magic !
-  for (int i = 1; i <= sizeof(head.header_key); i++)
-    if ((head.header_key[i - 1] != i) && (head.header_key[i - 1] != 0)) return false;
-  switch (head.version) {
-    case 0x102:
-    case 0x103:
-    case 0x200:
-    case 0xCACA:
-      break;
-    default:
-      return false; /* unknown version */
-  }
-
-  handler->table_offset = head.offset;
-  handler->filecount    = head.filecount - head.seed - 7;
+  if (!prv_grf_header_parse(&head, &large, &repack_type, &handler->table_offset, &handler->filecount)) return false;
+  prv_grf_progress_begin(handler, handler->filecount);
   // version was set from grf_new()
   //	handler->version = GRF_FILE_OUTPUT_VERISON; /* do not store version as we'll save to this version anyway, unless
   // we're repacking */
@@ -727,6 +2128,8 @@ static bool prv_grf_load(struct grf_handler *handler) {
     while (last->next != NULL) last = last->next;  // seek to end of list
   }
 
+  // grf_load_compact() only knows the 0x200 tables, others get regular nodes
+  if ((head.version != 0x200) && (head.version != 0x300)) prv_grf_compact_free(handler);
   if (handler->filecount == 0) return true;  // do not even bother reading file table, it's empty
 
   switch (head.version) {
@@ -740,10 +2143,14 @@ static bool prv_grf_load(struct grf_handler *handler) {
       lseek(handler->fd, handler->table_offset + GRF_HEADER_SIZE, SEEK_SET);
       dlen  = grfstat.st_size - (handler->table_offset + GRF_HEADER_SIZE);
       table = malloc(dlen);
+      t0    = GRF_STAT_START(handler->stats);
       if (read(handler->fd, (void *)table, dlen) != dlen) {
         free(table);
         return false;
       }
+      GRF_STAT_END(handler->stats, GRF_STAT_TABLE_READ, t0);
+      GRF_STAT_ADD(handler->stats, bytes_read, dlen);
+      t0 = GRF_STAT_START(handler->stats);
       result       = handler->filecount;
       wasted_space = handler->table_offset;
       pos          = table;
@@ -761,6 +2168,7 @@ static bool prv_grf_load(struct grf_handler *handler) {
         }
         entry           = calloc(1, sizeof(struct grf_node));
         entry->filename = calloc(1, fn_len + 1);
+        GRF_STAT_ADD(handler->stats, allocs, 1);
         memcpy(entry->filename, pos, fn_len);  // fn_len + 1 is already 0x00
         decode_filename((unsigned char *)entry->filename, fn_len);
         pos += fn_len;
@@ -823,33 +2231,17 @@ static bool prv_grf_load(struct grf_handler *handler) {
           last        = entry;
         }
         hash_add_element(handler->fast_table, entry->filename, entry);
-        if (--hcall <= 0) {
-          hcall = 100;
-          if (handler->callback != NULL) {
-            if (!handler->callback(handler->callback_etc, handler, handler->filecount - result, handler->filecount, entry->filename))
-              return false;
-          }
-        }
+        if (!prv_grf_progress(handler, handler->filecount - result, entry->filename)) return false;
       }
       free(table);
+      GRF_STAT_END(handler->stats, GRF_STAT_TABLE_PARSE, t0);
       break;
-    case 0xCACA:  // broken-by-repack
-      // ATTEMPT TO REPAIR FILE
-      // We'll find in the file, after the files table, 4 bytes containing the original position
-      // of the last moved file.
-      // We'll try to restore this file with 4 attempt, and consider that all previous files
-      // were successfully moved.
-      // Attempt 1: Read the file in its original place, try to unpack it.
-      // Attempt 2: Read the file as if it were successfully moved. Try to unpack it.
-      // Attempt 3: Read 50% of the file in the new position, read 50% in the old position. Try to unpack it.
-      // Attempt 4: Read whole file from new position. Read 1024 bytes from old position, try to unpack it.
-      //            Read 1024 bytes before, from the old position, try again to unpack. Continue until the
-      //            whole file has been read from the old position, or until unpack success.
-      // If all attempts failed, we just return false. If we successfully found the original file, write the
-      // info in the GRF table.
-      // TODO: Add an option to just drop the file (if all attempts failed). Also add a way to know *which* file
-      // failed.
-      return false;  // TODO TODO TODO TODO XXX FIXME TODO XXX FIXME
+    case 0xCACA:  // broken-by-repack, the table is a 0x200 (or 0x300) one followed by the repack journal
+      // finishing the repack rewrites the archive, which can't be done inside a transaction
+      if (handler->transaction > 0) return false;
+      /* fall through */
+    case 0x200:   // new GRF files
+    case 0x300:   // same, with 64 bits positions
       if (fstat(handler->fd, (struct stat *)&grfstat) != 0) return false;
       if ((handler->table_offset + GRF_HEADER_SIZE) > grfstat.st_size) return false;
 
@@ -858,186 +2250,67 @@ static bool prv_grf_load(struct grf_handler *handler) {
       // posinfo[0] = comp size
       // posinfo[1] = decomp size
 
-      if ((handler->table_offset + GRF_HEADER_SIZE + (sizeof(uint32_t) * 2) + posinfo[0] + sizeof(uint32_t)) > grfstat.st_size)
-        return false;
-      table_comp = malloc(posinfo[0]);
-      table      = malloc(posinfo[1]);
-      if (read(handler->fd, table_comp, posinfo[0]) != posinfo[0]) {
-        free(table);
-        free(table_comp);
-        return false;
-      }
-      if (read(handler->fd, (void *)&brokenpos, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        free(table);
-        free(table_comp);
-        return false;
-      }
-      if (zlib_buffer_inflate(table, posinfo[1], table_comp, posinfo[0]) != posinfo[1]) {
-        free(table);
-        free(table_comp);
-        return false;
-      }
-
-      free(table_comp);
-
-      pos          = table;
-      pos_max      = table + posinfo[1];
+      if ((handler->table_offset + GRF_HEADER_SIZE + 8 + posinfo[0]) > grfstat.st_size) return false;
       result       = handler->filecount;
       wasted_space = grfstat.st_size - GRF_HEADER_SIZE - 8 - posinfo[0];  // in theory, all this space should be used for files
-      while (pos < pos_max) {
-        size_t av_len = pos_max - pos;
-        int fn_len    = prv_grf_strnlen((char *)pos, av_len);
-        struct grf_table_entry_data tmpentry;
-        result--;
-        if (fn_len + sizeof(struct grf_table_entry_data) > av_len) {
+      if (handler->compact != NULL) {
+        // the compact store works on the whole table
+        bool ok;
+        table_comp = malloc(posinfo[0]);
+        table      = malloc(posinfo[1]);
+        t0         = GRF_STAT_START(handler->stats);
+        if (read(handler->fd, table_comp, posinfo[0]) != posinfo[0]) {
           free(table);
+          free(table_comp);
           return false;
         }
-        entry           = calloc(1, sizeof(struct grf_node));
-        entry->filename = calloc(1, fn_len + 1);
-        memcpy(entry->filename, pos, fn_len);  // fn_len + 1 is already 0x00
-        pos += fn_len + 1;
-        memcpy((void *)&tmpentry, pos, sizeof(struct grf_table_entry_data));
-        pos += sizeof(struct grf_table_entry_data);
-        if (((tmpentry.flags & GRF_FLAG_FILE) == 0) || (tmpentry.size == 0)) {
-          // do not register "directory" entries and empty(bogus) files
-          free(entry->filename);
-          free(entry);
-          continue;
-        }
-        entry->flags       = tmpentry.flags;
-        entry->size        = tmpentry.size;
-        entry->len         = tmpentry.len;
-        entry->len_aligned = tmpentry.len_aligned;
-        entry->pos         = tmpentry.pos;
-        entry->parent      = handler;
-        entry->cycle       = -1;
-        if (entry->flags & GRF_FLAG_MIXCRYPT) {
-          entry->cycle = 1;
-          for (int i = 10; entry->len >= i; i = i * 10) entry->cycle++;
-        }
-        if (entry->flags & GRF_FLAG_DES) {
-          entry->cycle = 0;
-        }
-        wasted_space -= tmpentry.len_aligned;
-
-        if (last == NULL) {
-          last                = entry;
-          handler->first_node = entry;
-        } else {
-          last->next  = entry;
-          entry->prev = last;
-          last        = entry;
-        }
-        hash_add_element(handler->fast_table, entry->filename, entry);
-        if (--hcall <= 0) {
-          hcall = 100;
-          if (handler->callback != NULL) {
-            if (!handler->callback(handler->callback_etc, handler, handler->filecount - result, handler->filecount, entry->filename))
-              return false;
-          }
-        }
-      }
-      free(table);
-      break;
-    case 0x200:  // new GRF files
-      if (fstat(handler->fd, (struct stat *)&grfstat) != 0) return false;
-      if ((handler->table_offset + GRF_HEADER_SIZE) > grfstat.st_size) return false;
-
-      lseek(handler->fd, handler->table_offset + GRF_HEADER_SIZE, SEEK_SET);
-      if (read(handler->fd, (void *)&posinfo, sizeof(posinfo)) != sizeof(posinfo)) return false;
-      // posinfo[0] = comp size
-      // posinfo[1] = decomp size
-
-      if ((handler->table_offset + GRF_HEADER_SIZE + 8 + posinfo[0]) > grfstat.st_size) return false;
-      table_comp = malloc(posinfo[0]);
-      table      = malloc(posinfo[1]);
-      if (read(handler->fd, table_comp, posinfo[0]) != posinfo[0]) {
-        free(table);
-        free(table_comp);
-        return false;
-      }
-      if (zlib_buffer_inflate(table, posinfo[1], table_comp, posinfo[0]) != posinfo[1]) {
-        free(table);
-        free(table_comp);
-        return false;
-      }
-
-      free(table_comp);
-
-      pos          = table;
-      pos_max      = table + posinfo[1];
-      result       = handler->filecount;
-      wasted_space = grfstat.st_size - GRF_HEADER_SIZE - 8 - posinfo[0];  // in theory, all this space should be used for files
-      while (pos < pos_max) {
-        size_t av_len = pos_max - pos;
-        int fn_len    = prv_grf_strnlen((char *)pos, av_len);
-        struct grf_table_entry_data tmpentry;
-        result--;
-        if (fn_len + sizeof(struct grf_table_entry_data) > av_len) {
+        GRF_STAT_END(handler->stats, GRF_STAT_TABLE_READ, t0);
+        GRF_STAT_ADD(handler->stats, bytes_read, posinfo[0]);
+        t0 = GRF_STAT_START(handler->stats);
+        if (zlib_buffer_inflate(table, posinfo[1], table_comp, posinfo[0]) != posinfo[1]) {
           free(table);
+          free(table_comp);
           return false;
         }
-        entry           = calloc(1, sizeof(struct grf_node));
-        entry->filename = calloc(1, fn_len + 1);
-        memcpy(entry->filename, pos, fn_len);  // fn_len + 1 is already 0x00
-        pos += fn_len + 1;
-        memcpy((void *)&tmpentry, pos, sizeof(struct grf_table_entry_data));
-        pos += sizeof(struct grf_table_entry_data);
-        if (((tmpentry.flags & GRF_FLAG_FILE) == 0) || (tmpentry.size == 0)) {
-          // do not register "directory" entries and empty(bogus) files
-          free(entry->filename);
-          free(entry);
-          continue;
-        }
-        entry->flags       = tmpentry.flags;
-        entry->size        = tmpentry.size;
-        entry->len         = tmpentry.len;
-        entry->len_aligned = tmpentry.len_aligned;
-        entry->pos         = tmpentry.pos;
-        entry->parent      = handler;
-        entry->cycle       = -1;
-        if (entry->flags & GRF_FLAG_MIXCRYPT) {
-          entry->cycle = 1;
-          for (int i = 10; entry->len >= i; i = i * 10) entry->cycle++;
-        }
-        if (entry->flags & GRF_FLAG_DES) {
-          entry->cycle = 0;
-        }
-        wasted_space -= tmpentry.len_aligned;
-
-        if (last == NULL) {
-          last                = entry;
-          handler->first_node = entry;
+        GRF_STAT_END(handler->stats, GRF_STAT_TABLE_INFLATE, t0);
+        free(table_comp);
+        t0 = GRF_STAT_START(handler->stats);
+        if (handler->compact->lazy) {
+          ok = prv_grf_compact_index(handler, table, posinfo[1], large, &wasted_space);
         } else {
-          last->next  = entry;
-          entry->prev = last;
-          last        = entry;
-        }
-        hash_add_element(handler->fast_table, entry->filename, entry);
-        if (--hcall <= 0) {
-          hcall = 100;
-          if (handler->callback != NULL) {
-            if (!handler->callback(handler->callback_etc, handler, handler->filecount - result, handler->filecount, entry->filename))
-              return false;
-          }
+          ok = prv_grf_compact_fill(handler, table, posinfo[1], large, &wasted_space);
+          free(table);
         }
+        if (!ok) return false;
+        GRF_STAT_END(handler->stats, GRF_STAT_TABLE_PARSE, t0);
+        handler->wasted_space = wasted_space;
+        prv_grf_progress_done(handler);
+        return true;
+      }
+      if (!prv_grf_load_table(handler, posinfo, large, &wasted_space, &last, &result)) return false;
+      if (head.version == 0xCACA) {
+        // put back the files moved by the interrupted repack where they belong
+        repack.journal_pos = handler->table_offset + 8 + posinfo[0];
+        repack_done        = prv_grf_repack_replay(handler, repack_type, &repack);
+        if (repack_done < 0) return false;
       }
-      free(table);
       break;
     default:
       return false;
   }
   if (result != 0) return false;
+  handler->last_node    = last;
   handler->wasted_space = wasted_space;
-  // sort entries using quicksort
+  // sort entries by position
   handler->filecount = handler->fast_table->count;
   entry              = handler->first_node;
   if (entry == NULL) return true;  // no files?
-  if (!prv_grf_quicksort(handler, handler->filecount)) return false;
+  t0 = GRF_STAT_START(handler->stats);
+  if (!prv_grf_sort_by_pos(handler)) return false;
+  GRF_STAT_END(handler->stats, GRF_STAT_SORT, t0);
   // overlap check
   struct grf_node *x = handler->first_node;
-  uint32_t prev      = 0;
+  uint64_t prev      = 0;
   while (x != NULL) {
     if (prev > x->pos + x->len_aligned) {
       struct grf_node *x2;
@@ -1058,18 +2331,28 @@ static bool prv_grf_load(struct grf_handler *handler) {
     prev = x->pos + x->len_aligned;
     x    = x->next;
   }
-  // call the callback, if any~
-  if (handler->callback != NULL) {
-    handler->callback(handler->callback_etc, handler, handler->filecount, handler->filecount, NULL);
+  // resume the interrupted repack from its last checkpoint
+  if ((head.version == 0xCACA) && handler->write_mode) {
+    if (!prv_grf_repack_run(handler, repack_type, &repack, repack_done)) return false;
+    if (!prv_grf_save(handler)) return false;
+    prv_grf_recount_wasted_space(handler);
   }
+  prv_grf_bloom_build(handler);
+  prv_grf_ext_build(handler);
+  // call the callback, if any~
+  prv_grf_progress_done(handler);
 
   return true;
 }
 
 GRFEXPORT grf_handle grf_load_from_new(grf_handle handler) {
+  uint64_t tt = GRF_TRACE_START();
+  bool ok;
   if (handler == NULL) return NULL;
 
-  if (prv_grf_load((struct grf_handler *)handler) == false) {
+  ok = prv_grf_load((struct grf_handler *)handler);
+  GRF_TRACE(load, handler, handler->filecount, handler->version, ok, GRF_TRACE_ELAPSED(tt));
+  if (ok == false) {
     grf_free(handler);
     return NULL;
   }
@@ -1084,31 +2367,156 @@ GRFEXPORT grf_handle grf_load(const char *filename, bool writemode) {
   return grf_load_from_new(handler);
 }
 
+static grf_handle prv_grf_load_compact(const char *filename, bool lazy) {
+  grf_handle handler = grf_new(filename, false);
+  if (handler == NULL) return NULL;
+  handler->compact = calloc(1, sizeof(struct grf_compact));
+  if (handler->compact == NULL) {
+    grf_free(handler);
+    return NULL;
+  }
+  handler->compact->lazy = lazy;
+  return grf_load_from_new(handler);
+}
+
+GRFEXPORT grf_handle grf_load_compact(const char *filename) { return prv_grf_load_compact(filename, false); }
+
+GRFEXPORT grf_handle grf_load_lazy(const char *filename) { return prv_grf_load_compact(filename, true); }
+
+/* GRF_PROBE_TABLE: go through the files table without keeping anything */
+static bool prv_grf_probe_table(int fd, const uint32_t *posinfo, bool large, grf_probe_info *info) {
+  size_t te_len = large ? sizeof(struct grf_table_entry_data64) : sizeof(struct grf_table_entry_data);
+  uint32_t size = GRF_TABLE_CHUNK, have = 0, done = 0, records = 0;
+  uint64_t used = 0;
+  struct zlib_stream *stream;
+  char *buf = malloc(size), byte;
+  bool ok;
+  info->table_crc = crc32(0, NULL, 0);
+  stream          = zlib_stream_open(fd, posinfo[0], &info->table_crc, NULL);
+  ok              = (stream != NULL) && (buf != NULL);
+  while (ok) {
+    uint32_t p = 0;
+    int n;
+    for (;;) {
+      struct grf_table_entry_data64 te;
+      size_t fn_len = prv_grf_strnlen(buf + p, have - p);
+      if (fn_len + 1 + te_len > have - p) break;
+      prv_grf_table_entry_get(buf + p + fn_len + 1, &te, large);
+      if ((te.flags & GRF_FLAG_FILE) && (te.size != 0)) {
+        info->files++;
+        used += te.len_aligned;
+      }
+      records++;
+      p += fn_len + 1 + te_len;
+    }
+    memmove(buf, buf + p, have - p);
+    have -= p;
+    if (done == posinfo[1]) break;
+    if (have == size) {  // a single record doesn't fit
+      char *nbuf = realloc(buf, size * 2);
+      if (nbuf == NULL) {
+        ok = false;
+        break;
+      }
+      buf = nbuf;
+      size *= 2;
+    }
+    n = zlib_stream_read(stream, buf + have, MIN(size - have, posinfo[1] - done));
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    have += n;
+    done += n;
+  }
+  ok = ok && (have == 0) && (zlib_stream_read(stream, &byte, 1) == 0) && (records == info->filecount);
+  if (buf != NULL) free(buf);
+  zlib_stream_close(stream);
+  if (ok) info->wasted_space = info->file_size - GRF_HEADER_SIZE - 8 - posinfo[0] - used;
+  return ok;
+}
+
+/* GRF_PROBE_TABLE on an old (0x1xx) table: only its checksum */
+static bool prv_grf_probe_crc(int fd, uint64_t len, grf_probe_info *info) {
+  char *buf = malloc(GRF_TABLE_CHUNK);
+  if (buf == NULL) return false;
+  info->table_crc = crc32(0, NULL, 0);
+  while (len > 0) {
+    int n = read(fd, buf, MIN(len, GRF_TABLE_CHUNK));
+    if (n <= 0) break;
+    info->table_crc = crc32(info->table_crc, (unsigned char *)buf, n);
+    len -= n;
+  }
+  free(buf);
+  return len == 0;
+}
+
+GRFEXPORT bool grf_probe_fd(int fd, grf_probe_info *info, int flags) {
+  struct grf_header head;
+  struct stat grfstat;
+  uint32_t posinfo[2];
+  uint8_t repack_type;
+  bool large;
+  memset(info, 0, sizeof(grf_probe_info));
+  lseek(fd, 0, SEEK_SET);
+  if (read(fd, (void *)&head, sizeof(struct grf_header)) != sizeof(struct grf_header)) return false;
+  if (!prv_grf_header_parse(&head, &large, &repack_type, &info->table_offset, &info->filecount)) return false;
+  if (fstat(fd, &grfstat) != 0) return false;
+  info->version   = head.version;
+  info->file_size = grfstat.st_size;
+  info->table_offset += GRF_HEADER_SIZE;
+  if (info->table_offset > info->file_size) return false;
+  lseek(fd, info->table_offset, SEEK_SET);
+  if ((head.version == 0x102) || (head.version == 0x103)) {
+    // the table isn't compressed, and lasts until the end of the file
+    info->table_size = info->table_real_size = info->file_size - info->table_offset;
+    return ((flags & GRF_PROBE_TABLE) == 0) || prv_grf_probe_crc(fd, info->table_size, info);
+  }
+  if (info->filecount == 0) return true; /* grf_load() wouldn't read the table either */
+  if (read(fd, (void *)&posinfo, sizeof(posinfo)) != sizeof(posinfo)) return false;
+  if (info->table_offset + 8 + posinfo[0] > info->file_size) return false;
+  info->table_size      = posinfo[0];
+  info->table_real_size = posinfo[1];
+  if (flags & GRF_PROBE_TABLE) return prv_grf_probe_table(fd, posinfo, large, info);
+  return true;
+}
+
+GRFEXPORT bool grf_probe(const char *filename, grf_probe_info *info, int flags) {
+  int fd = open(filename, O_RDONLY | OPEN_OPTIONS);
+  bool res;
+  if (fd < 0) return false;
+  res = grf_probe_fd(fd, info, flags);
+  close(fd);
+  return res;
+}
+
 GRFEXPORT bool grf_file_rename(grf_node handler, const char *newname) {
   void *rep;
   if (!handler->parent->write_mode) return false;
-  handler->parent->need_save = true;
-  rep                        = grf_get_file(handler->parent, newname);
+  rep = grf_get_file(handler->parent, newname);
+  if (rep == handler) rep = NULL; /* only the case changes */
   if (rep != NULL) grf_file_delete(rep);
   if (hash_remove_element(handler->parent->fast_table, handler->filename) != 0) return false;
-  if (handler->tree_parent != NULL) hash_del_element(handler->tree_parent->parent->subdir, handler->tree_parent->name);
+  prv_grf_bloom_del(handler->parent);
+  handler->parent->need_save = true;
+  prv_grf_unreg_tree_node(handler);
+  prv_grf_name_changed(handler->parent, handler->filename);
   free(handler->filename);
   handler->filename = strdup(newname);
   hash_add_element(handler->parent->fast_table, handler->filename, handler);
-  if (handler->parent->root != NULL) prv_grf_reg_tree_node(handler->parent->root, handler);
+  if (handler->parent->root != NULL) prv_grf_reg_tree_node(handler->parent, handler);
+  prv_grf_bloom_add(handler->parent, handler->filename);
+  prv_grf_name_changed(handler->parent, handler->filename);
   return true;
 }
 
 GRFEXPORT bool grf_file_delete(grf_node handler) {
   struct grf_handler *parent = handler->parent;
   uint32_t len_aligned       = handler->len_aligned;
-  struct grf_node *next      = handler->next;
   if (!parent->write_mode) return false;
+  prv_grf_unreg_tree_node(handler);
+  if (prv_grf_del_node(parent, handler) != 0) return false;
   parent->need_save = true;
-  if (handler->tree_parent != NULL)
-    hash_del_element(handler->tree_parent->parent->subdir, handler->tree_parent->name);  // will free memory automatically
-  if (hash_del_element(handler->parent->fast_table, handler->filename) != 0) return false;
-  if (parent->first_node == handler) parent->first_node = next;
   parent->wasted_space += len_aligned; /* wasted_space accounting */
   parent->filecount--;
   return true;
@@ -1116,9 +2524,46 @@ GRFEXPORT bool grf_file_delete(grf_node handler) {
 
 GRFEXPORT uint32_t grf_filecount(grf_handle handler) { return handler->filecount; }
 
-GRFEXPORT uint32_t grf_wasted_space(grf_handle handler) { return handler->wasted_space; }
+GRFEXPORT uint32_t grf_wasted_space(grf_handle handler) {
+  return (handler->wasted_space > UINT32_MAX) ? UINT32_MAX : handler->wasted_space;
+}
+
+GRFEXPORT uint64_t grf_wasted_space64(grf_handle handler) { return handler->wasted_space; }
 
-GRFEXPORT grf_node grf_get_file(grf_handle handler, const char *filename) { return hash_lookup(handler->fast_table, filename); }
+GRFEXPORT grf_node grf_get_file(grf_handle handler, const char *filename) {
+  struct grf_node *node;
+  if (handler->compact != NULL) {
+    node = prv_grf_compact_node(handler, prv_grf_compact_find(handler->compact, filename));
+  } else if (!grf_file_may_exist(handler, filename)) {
+    GRF_STAT_ADD(handler->stats, bloom_rejects, 1);
+    node = NULL;
+  } else {
+    node = hash_lookup(handler->fast_table, filename);
+  }
+  GRF_STAT_ADD(handler->stats, lookups, 1);
+  if (node != NULL) GRF_STAT_ADD(handler->stats, lookup_hits, 1);
+  return node;
+}
+
+GRFEXPORT bool grf_file_may_exist(grf_handle handler, const char *filename) {
+  uint64_t h;
+  uint32_t h1, h2;
+  if (handler->compact != NULL) return prv_grf_compact_find(handler->compact, filename) != UINT32_MAX;
+  if (handler->bloom == NULL) return true;
+  h  = prv_grf_name_hash(filename);
+  h1 = h;
+  h2 = (h >> 32) | 1;
+  for (int i = 0; i < GRF_BLOOM_HASHES; i++, h1 += h2) {
+    uint32_t b = h1 & (handler->bloom_bits - 1);
+    if ((handler->bloom[b >> 6] & (1ULL << (b & 63))) == 0) return false;
+  }
+  return true;
+}
+
+GRFEXPORT void grf_set_bloom(grf_handle handler, bool enable) {
+  handler->bloom_enabled = enable;
+  prv_grf_bloom_build(handler);
+}
 
 GRFEXPORT const char *grf_file_get_filename(grf_node handler) { return handler->filename; }
 
@@ -1132,7 +2577,9 @@ GRFEXPORT const char *grf_file_get_basename(grf_node handler) {
 
 GRFEXPORT uint32_t grf_file_get_size(grf_node handler) { return handler->size; }
 
-GRFEXPORT uint32_t grf_file_get_storage_pos(grf_node handler) { return handler->pos; }
+GRFEXPORT uint32_t grf_file_get_storage_pos(grf_node handler) { return (handler->pos > UINT32_MAX) ? UINT32_MAX : handler->pos; }
+
+GRFEXPORT uint64_t grf_file_get_storage_pos64(grf_node handler) { return handler->pos; }
 
 GRFEXPORT uint32_t grf_file_get_storage_flags(grf_node handler) { return handler->flags; }
 
@@ -1140,29 +2587,64 @@ GRFEXPORT uint32_t grf_file_get_storage_size(grf_node handler) { return handler-
 
 GRFEXPORT uint32_t grf_file_get_id(grf_node node) { return node->id; }
 
-GRFEXPORT grf_node grf_get_file_by_id(grf_handle handler, uint32_t id) { return handler->node_table[id]; }
+GRFEXPORT grf_node grf_get_file_by_id(grf_handle handler, uint32_t id) {
+  if (handler->compact != NULL) return prv_grf_compact_node(handler, id);
+  if (id >= handler->id_count) return NULL;
+  return handler->node_table[id];
+}
+
+GRFEXPORT uint32_t grf_get_id_list_size(grf_handle handler) { return handler->id_count; }
+
+GRFEXPORT grf_node *grf_get_file_id_list(grf_handle handler) {
+  if (handler->compact != NULL) return prv_grf_compact_all(handler) ? handler->compact->nodes : NULL;
+  return handler->node_table;
+}
+
+GRFEXPORT void grf_trace_start(grf_handle handler) {
+  handler->trace_count   = 0;
+  handler->trace_enabled = true;
+}
+
+GRFEXPORT void grf_trace_stop(grf_handle handler) { handler->trace_enabled = false; }
+
+GRFEXPORT const uint32_t *grf_trace_get(grf_handle handler, uint32_t *count) {
+  *count = handler->trace_count;
+  return handler->trace;
+}
 
-GRFEXPORT grf_node *grf_get_file_id_list(grf_handle handler) { return handler->node_table; }
+static void prv_grf_trace_record(struct grf_handler *handler, uint32_t id) {
+  if ((handler->trace_count > 0) && (handler->trace[handler->trace_count - 1] == id)) return; /* same file again */
+  if (handler->trace_count >= handler->trace_alloc) {
+    uint32_t *t = realloc(handler->trace, sizeof(uint32_t) * (handler->trace_alloc + 512));
+    if (t == NULL) return;
+    handler->trace = t;
+    handler->trace_alloc += 512;
+  }
+  handler->trace[handler->trace_count++] = id;
+}
 
 GRFEXPORT uint32_t grf_file_get_contents(grf_node fhandler, void *target) {
   void *comp;
   struct grf_handler *handler;
   uint32_t count;
+  uint64_t t0, tt = GRF_TRACE_START();
   handler = fhandler->parent;
   if ((fhandler->flags & GRF_FLAG_FILE) == 0) return 0;  // not a file
+  if (handler->trace_enabled) prv_grf_trace_record(handler, fhandler->id);
   comp = calloc(1, fhandler->len_aligned + 1024);        // seems that we need to allocate 1024 more bytes to decrypt file safely
-  lseek(handler->fd, fhandler->pos + GRF_HEADER_SIZE, SEEK_SET);
-  count = read(handler->fd, (char *)comp, fhandler->len_aligned);
-  if (count != fhandler->len_aligned) {
+  GRF_STAT_ADD(handler->stats, allocs, 1);
+  if (!prv_grf_read_at(handler, fhandler->pos, comp, fhandler->len_aligned)) {
     free(comp);
     return 0;
   }
   // decrypt (if required)
-  // static void decode_des_etc(unsigned char *buf, int len, int type, int cycle)
-  if (fhandler->cycle >= 0) decode_des_etc((unsigned char *)comp, fhandler->len_aligned, (fhandler->cycle) == 0, fhandler->cycle);
+  if (fhandler->cycle >= 0) prv_grf_decode(handler, comp, fhandler->len_aligned, fhandler->cycle);
   // decompress to target...
+  t0    = GRF_STAT_START(handler->stats);
   count = zlib_buffer_inflate(target, fhandler->size, comp, fhandler->len);
+  GRF_STAT_END(handler->stats, GRF_STAT_INFLATE, t0);
   free(comp);
+  GRF_TRACE(get_contents, handler, fhandler->id, fhandler->len, count, GRF_TRACE_ELAPSED(tt));
   return count;
 }
 
@@ -1271,60 +2753,61 @@ GRFEXPORT grf_node grf_file_add(grf_handle handler, const char *filename, void *
   void *ptr_comp;
   struct grf_node *prev, *ptr_file;
   uint32_t comp_size, comp_size_aligned;
+  uint64_t t0, pos, tt = GRF_TRACE_START();
   if (handler->write_mode == false) return NULL;  // no write access
   // STEPS
   // 1. Compress file, to have its size
   ptr_comp = malloc(size + 100);
   if (ptr_comp == NULL) return NULL; /* out of memory? */
+  GRF_STAT_ADD(handler->stats, allocs, 1);
+  t0                = GRF_STAT_START(handler->stats);
   comp_size         = zlib_buffer_deflate(ptr_comp, size + 100, ptr, size, handler->compression_level);
+  GRF_STAT_END(handler->stats, GRF_STAT_DEFLATE, t0);
   comp_size_aligned = comp_size + (4 - ((comp_size - 1) % 4)) - 1;
   ptr_comp          = realloc(ptr_comp, comp_size_aligned);
   if (ptr_comp == NULL) return NULL; /* out of memory? */
   // 2. Check if a file already exists with the same name.
   ptr_file = hash_lookup(handler->fast_table, filename);
   // 3. Find a place to add the file, and add it
-  prev = prv_grf_find_free_space(handler, comp_size_aligned, ptr_file);
+  prev = prv_grf_find_free_space(handler, comp_size_aligned, ptr_file, &pos);
   // 4. Rebuild index, replace file if needed, etc...
   if (ptr_file != NULL) {
     // YAY! Everything made (almost) easy, but count file as replaced
     free(ptr_file->filename);
     handler->wasted_space += ptr_file->len_aligned;
-    if (ptr_file->next != NULL) ptr_file->next->prev = ptr_file->prev;
-    if (ptr_file->prev != NULL) ptr_file->prev->next = ptr_file->next;
-    ptr_file->filename                               = strdup(filename);
+    prv_grf_list_unlink(handler, ptr_file);
+    ptr_file->filename = strdup(filename);
   } else {
     // Regular add file~ (argh)
     ptr_file           = calloc(1, sizeof(struct grf_node));
+    GRF_STAT_ADD(handler->stats, allocs, 1);
     ptr_file->filename = strdup(filename);
     ptr_file->parent   = handler;
+    if (!prv_grf_id_assign(handler, ptr_file)) {
+      free(ptr_file->filename);
+      free(ptr_file);
+      free(ptr_comp);
+      return NULL;
+    }
     hash_add_element(handler->fast_table, ptr_file->filename, ptr_file);
-    if (handler->root != NULL) prv_grf_reg_tree_node(handler->root, ptr_file);
+    if (handler->root != NULL) prv_grf_reg_tree_node(handler, ptr_file);
   }
   // filename: replace '/' with '\\'
   for (int i                                                        = 0; *(ptr_file->filename + i) != 0; i++)
     if (*(ptr_file->filename + i) == '/') *(ptr_file->filename + i) = '\\';
-  if (prev == NULL) {
-    ptr_file->pos       = 0;
-    ptr_file->next      = handler->first_node;  // just in case, supposed to be null
-    ptr_file->prev      = NULL;
-    handler->first_node = ptr_file;
-  } else {
-    // insert entry in the chained list
-    ptr_file->pos                                    = prev->pos + prev->len_aligned;
-    ptr_file->next                                   = prev->next;
-    ptr_file->prev                                   = prev;
-    if (ptr_file->next != NULL) ptr_file->next->prev = ptr_file;
-    prev->next                                       = ptr_file;
-  }
+  // insert entry in the chained list
+  ptr_file->pos = pos;
+  prv_grf_list_insert(handler, prev, ptr_file);
   ptr_file->size        = size;
   ptr_file->len         = comp_size;
   ptr_file->len_aligned = comp_size_aligned;
   ptr_file->flags       = GRF_FLAG_FILE;
+  ptr_file->cycle       = -1; /* not encrypted */
   // 5. Copy memory to file, and free() it
-  lseek(handler->fd, ptr_file->pos + GRF_HEADER_SIZE, SEEK_SET);
-  if (write(handler->fd, ptr_comp, ptr_file->len_aligned) != ptr_file->len_aligned) {
+  if (!prv_grf_write_at(handler, ptr_file->pos, ptr_comp, ptr_file->len_aligned)) {
     free(ptr_comp);
-    hash_del_element(handler->fast_table, ptr_file->filename);
+    prv_grf_unreg_tree_node(ptr_file);
+    prv_grf_del_node(handler, ptr_file);
     return NULL;
   }
   free(ptr_comp);
@@ -1333,6 +2816,9 @@ GRFEXPORT grf_node grf_file_add(grf_handle handler, const char *filename, void *
     handler->wasted_space -= ptr_file->len_aligned;
   }
   handler->need_save = true;
+  prv_grf_bloom_add(handler, ptr_file->filename);
+  prv_grf_name_changed(handler, ptr_file->filename);
+  GRF_TRACE(file_add, handler, ptr_file->id, ptr_file->size, ptr_file->len, GRF_TRACE_ELAPSED(tt));
   return ptr_file;
 }
 
@@ -1362,16 +2848,283 @@ GRFEXPORT grf_node grf_file_add_path(grf_handle handler, const char *filename, c
   return res;
 }
 
-GRFEXPORT grf_node *grf_get_file_list(grf_handle handler) { return (grf_node *)hash_foreach_val(handler->fast_table); }
+GRFEXPORT grf_node *grf_get_file_list(grf_handle handler) {
+  struct grf_node **list;
+  if (handler->compact == NULL) return (grf_node *)hash_foreach_val(handler->fast_table);
+  if ((handler->compact->count == 0) || !prv_grf_compact_all(handler)) return NULL;
+  list = malloc(sizeof(struct grf_node *) * (handler->compact->count + 1));
+  if (list == NULL) return NULL;
+  memcpy(list, handler->compact->nodes, sizeof(struct grf_node *) * (handler->compact->count + 1));
+  return list;
+}
+
+GRFEXPORT grf_node grf_file_iterate(grf_handle handler, grf_cursor *cursor) {
+  list_element *cur;
+  if (handler->compact != NULL) return (cursor->pos < handler->compact->count) ? prv_grf_compact_node(handler, cursor->pos++) : NULL;
+  cur = hash_next(handler->fast_table, &cursor->pos, cursor->ptr);
+  cursor->ptr = cur;
+  return (cur == NULL) ? NULL : cur->pointer;
+}
+
+// compare filename with the len first chars of prefix, 0 if filename starts with them
+static int prv_grf_name_prefix_cmp(const char *filename, const char *prefix, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char x = filename[i], y = prefix[i];
+    if ((x >= 'A') && (x <= 'Z')) x += 32;
+    if ((y >= 'A') && (y <= 'Z')) y += 32;
+    if (x == '/') x = '\\';
+    if (y == '/') y = '\\';
+    if (x != y) return x - y;
+  }
+  return 0;
+}
+
+/* (re)build the name-sorted index if needed */
+static bool prv_grf_sorted_build(struct grf_handler *handler) {
+  struct grf_node **sorted;
+  uint32_t n = 0;
+  if (handler->sorted_valid) return true;
+  sorted = realloc(handler->sorted, sizeof(struct grf_node *) * (handler->fast_table->count + 1));
+  if (sorted == NULL) return false;
+  handler->sorted = sorted;
+  for (struct grf_node *node = handler->first_node; (node != NULL) && (n < handler->fast_table->count); node = node->next)
+    sorted[n++] = node;
+  qsort(sorted, n, sizeof(struct grf_node *), prv_grf_node_name_cmp);
+  handler->sorted_count = n;
+  handler->sorted_valid = true;
+  return true;
+}
+
+/* first position in the index whose name isn't below name */
+static uint32_t prv_grf_sorted_lower(struct grf_handler *handler, const char *name) {
+  uint32_t lo = 0, hi = handler->sorted_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (prv_grf_name_cmp(handler->sorted[mid]->filename, name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* first position of the names starting with prefix (len chars) */
+static uint32_t prv_grf_sorted_prefix_start(struct grf_handler *handler, const char *prefix, size_t len) {
+  uint32_t lo = 0, hi = handler->sorted_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (prv_grf_name_prefix_cmp(handler->sorted[mid]->filename, prefix, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-GRFEXPORT grf_node grf_get_file_first(grf_handle handler) { return handler->first_node; }
+/* first position after the names starting with prefix (len chars) */
+static uint32_t prv_grf_sorted_prefix_end(struct grf_handler *handler, const char *prefix, size_t len) {
+  uint32_t lo = 0, hi = handler->sorted_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (prv_grf_name_prefix_cmp(handler->sorted[mid]->filename, prefix, len) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-GRFEXPORT grf_node grf_get_file_next(grf_node handler) { return handler->next; }
+/* extension of filename, without the dot ("" if none) */
+static const char *prv_grf_ext_of(const char *filename) {
+  const char *ext = "";
+  for (const char *p = filename; *p != 0; p++) {
+    if (*p == '.') ext = p + 1;
+    if ((*p == '/') || (*p == '\\')) ext = "";
+  }
+  return ext;
+}
 
-GRFEXPORT grf_node grf_get_file_prev(grf_node handler) { return handler->prev; }
+static int prv_grf_ext_cmp(const char *a, const char *b) {
+  for (;; a++, b++) {
+    unsigned char x = *a, y = *b;
+    if ((x >= 'A') && (x <= 'Z')) x += 32;
+    if ((y >= 'A') && (y <= 'Z')) y += 32;
+    if ((x != y) || (x == 0)) return x - y;
+  }
+}
+
+/* position of ext in handler->exts, or where it should be inserted */
+static uint32_t prv_grf_ext_find(struct grf_handler *handler, const char *ext, bool *found) {
+  uint32_t lo = 0, hi = handler->ext_count;
+  *found = false;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int c        = prv_grf_ext_cmp(handler->exts[mid].name, ext);
+    if (c == 0) {
+      *found = true;
+      return mid;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void prv_grf_ext_clear(struct grf_handler *handler) {
+  for (uint32_t i = 0; i < handler->ext_count; i++) free(handler->exts[i].name);
+  if (handler->exts != NULL) free(handler->exts);
+  if (handler->ext_nodes != NULL) free(handler->ext_nodes);
+  handler->exts      = NULL;
+  handler->ext_nodes = NULL;
+  handler->ext_count = 0;
+}
+
+/* (re)build the extension index: one entry per extension, and all nodes grouped by extension */
+static bool prv_grf_ext_build(struct grf_handler *handler) {
+  uint32_t count = handler->fast_table->count, n = 0, alloc = 0, first = 0, *fill;
+  bool found;
+  if (handler->ext_valid) return true;
+  prv_grf_ext_clear(handler);
+  handler->ext_nodes = malloc(sizeof(struct grf_node *) * (count + 1));
+  if (handler->ext_nodes == NULL) return false;
+  // 1. count the files (and sizes) of each extension
+  for (struct grf_node *node = handler->first_node; (node != NULL) && (n < count); node = node->next, n++) {
+    const char *ext = prv_grf_ext_of(node->filename);
+    uint32_t pos    = prv_grf_ext_find(handler, ext, &found);
+    if (!found) {
+      char *name;
+      if (handler->ext_count == alloc) {
+        struct grf_ext *exts;
+        alloc = (alloc == 0) ? 32 : alloc * 2;
+        exts  = realloc(handler->exts, sizeof(struct grf_ext) * alloc);
+        if (exts == NULL) goto fail;
+        handler->exts = exts;
+      }
+      name = strdup(ext);
+      if (name == NULL) goto fail;
+      for (char *p = name; *p != 0; p++)
+        if ((*p >= 'A') && (*p <= 'Z')) *p += 32;
+      memmove(handler->exts + pos + 1, handler->exts + pos, sizeof(struct grf_ext) * (handler->ext_count - pos));
+      memset(handler->exts + pos, 0, sizeof(struct grf_ext));
+      handler->exts[pos].name = name;
+      handler->ext_count++;
+    }
+    handler->exts[pos].count++;
+    handler->exts[pos].size += node->size;
+    handler->exts[pos].len += node->len;
+  }
+  // 2. place the nodes
+  fill = calloc(handler->ext_count + 1, sizeof(uint32_t));
+  if (fill == NULL) goto fail;
+  for (uint32_t i = 0; i < handler->ext_count; i++) {
+    handler->exts[i].first = first;
+    first += handler->exts[i].count;
+  }
+  n = 0;
+  for (struct grf_node *node = handler->first_node; (node != NULL) && (n < count); node = node->next, n++) {
+    uint32_t pos                                         = prv_grf_ext_find(handler, prv_grf_ext_of(node->filename), &found);
+    handler->ext_nodes[handler->exts[pos].first + fill[pos]++] = node;
+  }
+  free(fill);
+  handler->ext_valid = true;
+  return true;
+fail:
+  prv_grf_ext_clear(handler);
+  return false;
+}
+
+GRFEXPORT uint32_t grf_ext_count(grf_handle handler) {
+  if (!prv_grf_ext_build(handler)) return 0;
+  return handler->ext_count;
+}
+
+GRFEXPORT const char *grf_ext_get_name(grf_handle handler, uint32_t i) {
+  if (!prv_grf_ext_build(handler) || (i >= handler->ext_count)) return NULL;
+  return handler->exts[i].name;
+}
+
+GRFEXPORT uint32_t grf_ext_get_filecount(grf_handle handler, uint32_t i) {
+  if (!prv_grf_ext_build(handler) || (i >= handler->ext_count)) return 0;
+  return handler->exts[i].count;
+}
+
+GRFEXPORT uint64_t grf_ext_get_size(grf_handle handler, uint32_t i) {
+  if (!prv_grf_ext_build(handler) || (i >= handler->ext_count)) return 0;
+  return handler->exts[i].size;
+}
+
+GRFEXPORT uint64_t grf_ext_get_compressed_size(grf_handle handler, uint32_t i) {
+  if (!prv_grf_ext_build(handler) || (i >= handler->ext_count)) return 0;
+  return handler->exts[i].len;
+}
+
+GRFEXPORT grf_node *grf_ext_get_files(grf_handle handler, const char *ext, uint32_t *count) {
+  uint32_t pos;
+  bool found;
+  *count = 0;
+  if (!prv_grf_ext_build(handler)) return NULL;
+  if (*ext == '.') ext++;
+  pos = prv_grf_ext_find(handler, ext, &found);
+  if (!found) return NULL;
+  *count = handler->exts[pos].count;
+  return handler->ext_nodes + handler->exts[pos].first;
+}
+
+GRFEXPORT uint32_t grf_sorted_count(grf_handle handler) {
+  if (!prv_grf_sorted_build(handler)) return 0;
+  return handler->sorted_count;
+}
+
+GRFEXPORT grf_node grf_sorted_get(grf_handle handler, uint32_t i) {
+  if (!prv_grf_sorted_build(handler)) return NULL;
+  if (i >= handler->sorted_count) return NULL;
+  return handler->sorted[i];
+}
+
+GRFEXPORT uint32_t grf_sorted_lower_bound(grf_handle handler, const char *name) {
+  if (!prv_grf_sorted_build(handler)) return 0;
+  return prv_grf_sorted_lower(handler, name);
+}
+
+GRFEXPORT uint32_t grf_sorted_prefix(grf_handle handler, const char *prefix, uint32_t *first) {
+  uint32_t start;
+  size_t len = strlen(prefix);
+  if (first != NULL) *first = 0;
+  if (!prv_grf_sorted_build(handler)) return 0;
+  start = prv_grf_sorted_prefix_start(handler, prefix, len);
+  if (first != NULL) *first = start;
+  return prv_grf_sorted_prefix_end(handler, prefix, len) - start;
+}
+
+GRFEXPORT uint32_t grf_sorted_count_range(grf_handle handler, const char *from, const char *to) {
+  uint32_t a, b;
+  if (!prv_grf_sorted_build(handler)) return 0;
+  a = (from == NULL) ? 0 : prv_grf_sorted_lower(handler, from);
+  b = (to == NULL) ? handler->sorted_count : prv_grf_sorted_lower(handler, to);
+  return (b > a) ? b - a : 0;
+}
+
+GRFEXPORT grf_node grf_get_file_first(grf_handle handler) {
+  if (handler->compact != NULL) return prv_grf_compact_node(handler, 0);
+  return handler->first_node;
+}
+
+GRFEXPORT grf_node grf_get_file_next(grf_node handler) {
+  if (handler->parent->compact != NULL) return prv_grf_compact_node(handler->parent, handler->id + 1);
+  return handler->next;
+}
+
+GRFEXPORT grf_node grf_get_file_prev(grf_node handler) {
+  if (handler->parent->compact != NULL) return (handler->id == 0) ? NULL : prv_grf_compact_node(handler->parent, handler->id - 1);
+  return handler->prev;
+}
 
 GRFEXPORT void grf_set_compression_level(grf_handle handler, int level) { handler->compression_level = level; }
 
+GRFEXPORT void grf_set_sync_policy(grf_handle handler, uint8_t policy) { handler->sync_policy = policy; }
+
 //\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//\\//
 
 static bool prv_grf_write_header(struct grf_handler *handler) {
@@ -1385,93 +3138,121 @@ static bool prv_grf_write_header(struct grf_handler *handler) {
   file_header.offset    = handler->table_offset;
   file_header.filecount = handler->filecount + 7;
   file_header.version   = handler->version;
+  if (prv_grf_version_large(handler->version)) file_header.seed = handler->table_offset >> 32;
 
   lseek(handler->fd, 0, SEEK_SET);
   result = write(handler->fd, (void *)&file_header, sizeof(struct grf_header));
   if (result != sizeof(struct grf_header)) return false;
+  GRF_STAT_ADD(handler->stats, bytes_written, sizeof(struct grf_header));
   handler->need_save = false;
   return true;
 }
 
-static bool prv_grf_write_table(struct grf_handler *handler) {
-  // Step 1 : generate a proper table
-  // We need to determine the final size of the table. It's :
-  // Len of Filename + 1 + sizeof(struct grf_table_entry_data)
-  uint32_t table_size   = 0;
-  struct grf_node *node = handler->first_node;
-  void *table, *pos;
-  struct grf_node *prev;
-
-  while (node != NULL) {
-    table_size += strlen(node->filename) + 1 + sizeof(struct grf_table_entry_data);
-    node = node->next;
-  }
-
-  if (table_size == 0) {
-    table            = (void *)malloc(1);
-    *(char *)(table) = 0;
-  } else {
-    table = (void *)malloc(table_size);
-    pos   = table;
-    node  = handler->first_node;
-    while (node != NULL) {
-      struct grf_table_entry_data te;
-      int j = strlen(node->filename);
-      memcpy(pos, node->filename, j);
-      pos += j;
-      *(char *)(pos) = 0;
-      pos++;
-      te.len         = node->len;
-      te.len_aligned = node->len_aligned;
-      te.size        = node->size;
-      te.pos         = node->pos;
-      te.flags       = node->flags;
-      memcpy(pos, (void *)&te, sizeof(struct grf_table_entry_data));
-      pos += sizeof(struct grf_table_entry_data);
-      node = node->next;
+/* deflate len bytes of table, writing the compressed data at handler->table_offset + 8 each time out is full */
+static bool prv_grf_table_deflate(struct grf_handler *handler, z_stream *stream, void *data, size_t len, int flush,
+                                  unsigned char *out, uint32_t *written) {
+  int err;
+  stream->next_in  = data;
+  stream->avail_in = len;
+  do {
+    err = deflate(stream, flush);
+    if ((err != Z_OK) && (err != Z_STREAM_END) && (err != Z_BUF_ERROR)) return false;
+    if ((stream->avail_out == 0) || (err == Z_STREAM_END)) {
+      uint32_t l = PRV_GRF_TABLE_CHUNK - stream->avail_out;
+      if (!prv_grf_write_at(handler, handler->table_offset + 8 + *written, out, l)) return false;
+      *written += l;
+      stream->next_out  = out;
+      stream->avail_out = PRV_GRF_TABLE_CHUNK;
     }
-  }
+  } while ((stream->avail_in > 0) || ((flush == Z_FINISH) && (err != Z_STREAM_END)));
+  return true;
+}
 
-  pos                    = malloc(table_size + 100);
-  *(uint32_t *)(pos + 4) = table_size; /* initial size */
+static bool prv_grf_write_table(struct grf_handler *handler, int where) {
+  // The table is generated and compressed on the fly, and written by chunks at its final place, so we have
+  // to choose this place first. As files are sorted, the end of the last one is the end of the data.
+  uint64_t old_offset = handler->table_offset, end;
+  uint32_t old_size   = handler->table_size;
+  uint32_t posinfo[2] = {0, 0}; /* compressed size, initial size */
+  uint32_t in_len     = 0;
+  struct grf_node *node;
+  unsigned char *in, *out;
+  z_stream stream;
+  bool ok = true, large;
 
-  // Compress the table using zlib
-  table_size = zlib_buffer_deflate(pos + 8, table_size + 100 - 8, table, table_size, handler->compression_level);
-  free(table);
-  if (table_size == 0) {
-    free(pos);
-    return false;
-  }
+  end = (handler->last_node == NULL) ? 0 : handler->last_node->pos + handler->last_node->len_aligned;
 
-  *(uint32_t *)(pos) = table_size; /* compressed size */
-  table_size += 8;
-  handler->table_size = table_size;
   /* compute new position for the table */
-  prev = prv_grf_find_free_space(handler, table_size, NULL);
-  if (prev == NULL) {  // no files
-    handler->table_offset = 0;
+  if (where == PRV_GRF_TABLE_EOF) {  // append the table, keeping everything already in the archive
+    struct stat s;
+    if (fstat(handler->fd, &s) != 0) return false;
+    handler->table_offset = MAX(s.st_size, GRF_HEADER_SIZE) - GRF_HEADER_SIZE;
+  } else if (where == PRV_GRF_TABLE_SAFE) {  // the header still points to the old table, keep it intact
+    handler->table_offset = MAX(end, old_offset + old_size);
   } else {
-    handler->table_offset = prev->pos + prev->len_aligned;
+    handler->table_offset = end;
+  }
+  // files are all stored before the table: if it fits in 32 bits, so do they
+  large            = (handler->table_offset > UINT32_MAX);
+  handler->version = large ? GRF_FILE_LARGE_VERSION : GRF_FILE_OUTPUT_VERISON;
+
+  in  = malloc(PRV_GRF_TABLE_CHUNK);
+  out = malloc(PRV_GRF_TABLE_CHUNK);
+  memset(&stream, 0, sizeof(stream));
+  if ((in == NULL) || (out == NULL) || (deflateInit(&stream, handler->compression_level) != Z_OK)) {
+    free(in);
+    free(out);
+    handler->table_offset = old_offset;
+    return false;
+  }
+  stream.next_out  = out;
+  stream.avail_out = PRV_GRF_TABLE_CHUNK;
+
+  // Step 1 : feed each entry (filename + 0x00 + struct grf_table_entry_data[64]) to zlib
+  for (node = handler->first_node; (node != NULL) && ok; node = node->next) {
+    struct grf_table_entry_data64 te;
+    size_t j      = strlen(node->filename) + 1;
+    size_t te_len = prv_grf_table_entry_put(&te, node, large);
+    posinfo[1] += j + te_len;
+    if (in_len + j + te_len > PRV_GRF_TABLE_CHUNK) {
+      ok     = prv_grf_table_deflate(handler, &stream, in, in_len, Z_NO_FLUSH, out, &posinfo[0]);
+      in_len = 0;
+    }
+    if (j + te_len > PRV_GRF_TABLE_CHUNK) { /* insanely long filename */
+      ok = ok && prv_grf_table_deflate(handler, &stream, node->filename, j, Z_NO_FLUSH, out, &posinfo[0]) &&
+           prv_grf_table_deflate(handler, &stream, &te, te_len, Z_NO_FLUSH, out, &posinfo[0]);
+      continue;
+    }
+    memcpy(in + in_len, node->filename, j);
+    memcpy(in + in_len + j, &te, te_len);
+    in_len += j + te_len;
   }
-  lseek(handler->fd, handler->table_offset + GRF_HEADER_SIZE, SEEK_SET);
-  if (write(handler->fd, (char *)pos, table_size) != table_size) {
-    free(pos);
+  ok = ok && prv_grf_table_deflate(handler, &stream, in, in_len, Z_FINISH, out, &posinfo[0]);
+  deflateEnd(&stream);
+  free(in);
+
+  // Step 2 : sizes go in front of the compressed table
+  ok = ok && prv_grf_write_at(handler, handler->table_offset, posinfo, sizeof(posinfo));
+  if (!ok) {
+    free(out);
+    handler->table_offset = old_offset;
     return false;
   }
-  free(pos);
-  if (prev == NULL) {  // no file found in archive -> truncate at end of table
-    ftruncate(handler->fd, handler->table_offset + GRF_HEADER_SIZE + table_size);
-  } else if (prev->next == NULL) {  // file was EOF -> truncate at end of table
-    ftruncate(handler->fd, handler->table_offset + GRF_HEADER_SIZE + table_size);
-  } else {  // some files are after us, truncate at end of last file
-    uint32_t pos = 0;
-    node         = handler->first_node;
-    while (node != NULL) {                         // TODO: Optimize this (as we know that files are sorted, optimization is possible)
-      uint32_t p = node->pos + node->len_aligned;  // position of EOF
-      pos        = MAX(pos, p);
-      node       = node->next;
+  handler->table_size = posinfo[0] + 8;
+
+  if ((where == PRV_GRF_TABLE_SAFE) && (handler->table_offset > end) && (end + handler->table_size <= old_offset)) {
+    // the new table fits in front of the old one: move it there, so the end of the archive can be dropped
+    for (uint32_t i = 0; (i < handler->table_size) && ok; i += PRV_GRF_TABLE_CHUNK) {
+      uint32_t l = (handler->table_size - i < PRV_GRF_TABLE_CHUNK) ? handler->table_size - i : PRV_GRF_TABLE_CHUNK;
+      ok         = prv_grf_read_at(handler, handler->table_offset + i, out, l) && prv_grf_write_at(handler, end + i, out, l);
     }
-    ftruncate(handler->fd, pos + GRF_HEADER_SIZE);
+    if (ok) handler->table_offset = end;
+  }
+  free(out);
+  if (!ok) return false;
+
+  if (where == PRV_GRF_TABLE_TAIL) {  // the table is after the last file, drop anything after it
+    ftruncate(handler->fd, handler->table_offset + GRF_HEADER_SIZE + handler->table_size);
   }
   return true;
 }
@@ -1479,24 +3260,67 @@ static bool prv_grf_write_table(struct grf_handler *handler) {
 GRFEXPORT void grf_free(grf_handle handler) {
   if (handler == NULL) return;
 
+  if (handler->vfs != NULL) grf_vfs_unmount(handler->vfs, handler);
+  handler->transaction = 0; /* commit anything pending */
   if (handler->need_save) grf_save(handler);
   close(handler->fd);
-  hash_free_table(handler->fast_table);
-  if (handler->root != NULL) prv_grf_tree_table_free_node(handler->root);
   if (handler->node_table != NULL) free(handler->node_table);
+  if (handler->id_free != NULL) free(handler->id_free);
+  handler->node_table = NULL; /* nodes below don't need to give their ID back */
+  hash_free_table(handler->fast_table);
+  if (handler->root != NULL) prv_grf_tree_free(handler, handler->root);
+  if (handler->trace != NULL) free(handler->trace);
+  if (handler->bloom != NULL) free(handler->bloom);
+  if (handler->sorted != NULL) free(handler->sorted);
+  if (handler->names != NULL) free(handler->names);
+  if (handler->names_off != NULL) free(handler->names_off);
+  if (handler->names_node != NULL) free(handler->names_node);
+  prv_grf_ext_clear(handler);
+  prv_grf_compact_free(handler);
+  if (handler->stats != NULL) free(handler->stats);
   free(handler);
 }
 
-GRFEXPORT bool grf_save(grf_handle handler) {
-  if (handler == NULL) return false;
-
+static bool prv_grf_save(struct grf_handler *handler) {
+  bool sync   = (handler->sync_policy == GRF_SYNC_SAVE);
+  uint64_t t0 = GRF_STAT_START(handler->stats);
   handler->filecount = handler->fast_table->count;
-  if (prv_grf_write_table(handler) != true) {
+  // the data of the new files has to be there before a table referring to it
+  if (sync && !prv_grf_sync(handler->fd)) return false;
+  if (prv_grf_write_table(handler, PRV_GRF_TABLE_TAIL) != true) {
     return false;
   }
   if (prv_grf_write_header(handler) != true) {
     return false;
   }
+  if (sync && !prv_grf_sync(handler->fd)) return false;
+  GRF_STAT_END(handler->stats, GRF_STAT_TABLE_SAVE, t0);
+
+  return true;
+}
+
+GRFEXPORT bool grf_save(grf_handle handler) {
+  uint64_t tt = GRF_TRACE_START();
+  bool ok;
+  if (handler == NULL) return false;
+  if (handler->transaction > 0) return true; /* grf_commit() will do it */
+  if (!handler->need_save) return true;      /* nothing changed since last save */
+
+  ok = prv_grf_save(handler);
+  GRF_TRACE(save, handler, handler->filecount, ok, GRF_TRACE_ELAPSED(tt));
+  return ok;
+}
+
+GRFEXPORT bool grf_begin(grf_handle handler) {
+  if ((handler == NULL) || (!handler->write_mode)) return false;
+  handler->transaction++;
+  return true;
+}
 
+GRFEXPORT bool grf_commit(grf_handle handler) {
+  if ((handler == NULL) || (handler->transaction == 0)) return false;
+  if (--handler->transaction > 0) return true;
+  if (!grf_save(handler)) return false;
+  prv_grf_recount_wasted_space(handler); /* the old table is now a hole */
   return true;
 }
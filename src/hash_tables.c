@@ -129,6 +129,58 @@ int hash_add_element(hash_table *table, char *string, void *pointer) {
   table->table[hashval] = new_element;
   table->count += 1;
 
+  /* keep chains short, lookups would become linear otherwise */
+  if (table->count > table->size * 4) hash_resize(table, table->size * 4);
+
+  return 0;
+}
+
+list_element *hash_prepare_element(hash_table *table, const char *string, void *pointer, unsigned long *bucket) {
+  /* first half of hash_add_element(), touching nothing in the table so it can
+   * run on several threads at once: the element to give to hash_insert_element() */
+  list_element *new_element;
+
+  if ((new_element = malloc(sizeof(list_element))) == NULL) return NULL;
+  if ((new_element->string = strduptolower(string)) == NULL) {
+    free(new_element);
+    return NULL;
+  }
+  new_element->pointer = pointer;
+  new_element->next    = NULL;
+  *bucket              = hash_calc(new_element->string, table->size);
+  return new_element;
+}
+
+int hash_insert_element(hash_table *table, list_element *new_element, unsigned long bucket) {
+  /* second half: only this bucket is touched and table->count is left to the
+   * caller, so threads may insert in different buckets at the same time */
+  list_element *current_element;
+
+  for (current_element = table->table[bucket]; current_element != NULL; current_element = current_element->next)
+    if (strcmp(current_element->string, new_element->string) == 0) return 2; /* already present in hash table */
+
+  new_element->next    = table->table[bucket];
+  table->table[bucket] = new_element;
+  return 0;
+}
+
+int hash_resize(hash_table *table, unsigned long size) {
+  list_element **buckets, *cur, *next;
+  unsigned long i;
+
+  if (size < 1) return 1;
+  if ((buckets = calloc(size, sizeof(list_element *))) == NULL) return 1;
+  for (i = 0; i < table->size; i++) {
+    for (cur = table->table[i]; cur != NULL; cur = next) {
+      unsigned long hashval = hash_calc(cur->string, size);
+      next                  = cur->next;
+      cur->next             = buckets[hashval];
+      buckets[hashval]      = cur;
+    }
+  }
+  free(table->table);
+  table->table = buckets;
+  table->size  = size;
   return 0;
 }
 
@@ -221,65 +273,43 @@ void hash_free_table(hash_table *table) {
   free(table);
 }
 
+list_element *hash_next(hash_table *table, unsigned long *bucket, list_element *cur) {
+  /* allocation free iteration: start with cur = NULL and *bucket = 0, and pass
+   * back the returned element until NULL is returned */
+  if (cur != NULL) {
+    if (cur->next != NULL) return cur->next;
+    (*bucket)++;
+  }
+  for (; *bucket < table->size; (*bucket)++)
+    if (table->table[*bucket] != NULL) return table->table[*bucket];
+  return NULL;
+}
+
 list_element **hash_foreach(hash_table *table) {
   /* will return an array of pointers with every entry of the hash table list */
-  list_element **result, *cur;
-  int num_entries = 0, num_alloc = 0, i;
-  result = NULL;
+  list_element **result, *cur = NULL;
+  unsigned long bucket = 0, i = 0;
 
-  if (table == NULL) return NULL;
+  if ((table == NULL) || (table->count == 0)) return NULL;
 
-  for (i = 0; i < table->size; i++) {
-    cur = table->table[i];
-    while (cur != NULL) {
-      num_entries++;
-      if (num_entries > num_alloc) {
-        num_alloc += 512;
-        if (result == NULL) {
-          result = calloc(num_alloc, sizeof(void *));
-        } else {
-          result = realloc(result, sizeof(void *) * num_alloc);
-        }
-      }
-      result[num_entries - 1] = cur;
-      cur                     = cur->next;
-    }
-  }
-  if (result != NULL) {
-    result              = realloc(result, sizeof(void *) * (num_entries + 1));
-    result[num_entries] = NULL;
-  }
+  result = malloc(sizeof(void *) * (table->count + 1));
+  if (result == NULL) return NULL;
+  while ((i < table->count) && ((cur = hash_next(table, &bucket, cur)) != NULL)) result[i++] = cur;
+  result[i] = NULL;
   return result;
 }
 
 void **hash_foreach_val(hash_table *table) {
   /* will return an array of pointers with every pointer in the list */
   void **result;
-  list_element *cur;
-  int num_entries = 0, num_alloc = 0, i;
-  result = NULL;
+  list_element *cur    = NULL;
+  unsigned long bucket = 0, i = 0;
 
-  if (table == NULL) return NULL;
+  if ((table == NULL) || (table->count == 0)) return NULL;
 
-  for (i = 0; i < table->size; i++) {
-    cur = table->table[i];
-    while (cur != NULL) {
-      num_entries++;
-      if (num_entries > num_alloc) {
-        num_alloc += 512;
-        if (result == NULL) {
-          result = calloc(num_alloc, sizeof(void *));
-        } else {
-          result = realloc(result, sizeof(void *) * num_alloc);
-        }
-      }
-      result[num_entries - 1] = cur->pointer;
-      cur                     = cur->next;
-    }
-  }
-  if (result != NULL) {
-    result              = realloc(result, sizeof(void *) * (num_entries + 1));
-    result[num_entries] = NULL;
-  }
+  result = malloc(sizeof(void *) * (table->count + 1));
+  if (result == NULL) return NULL;
+  while ((i < table->count) && ((cur = hash_next(table, &bucket, cur)) != NULL)) result[i++] = cur->pointer;
+  result[i] = NULL;
   return result;
 }
@@ -0,0 +1,251 @@
+/* search.c : compiled filename search
+ *
+ * A pattern is compiled once into literal chunks (the parts between '*'), then
+ * matched against a contiguous copy of the filenames, already lower cased and
+ * using '\\' as separator, so the scan itself never allocates nor converts.
+ */
+
+#include <grf.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef GRF_HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define GRF_SEARCH_SLICE 4096 /* don't start a thread for less names than that */
+
+static unsigned char search_fold(unsigned char c) {
+  if ((c >= 'A') && (c <= 'Z')) return c + 32;
+  if (c == '/') return '\\';
+  return c;
+}
+
+/* match chunk at name, returns the end of the matched part or NULL */
+static const char *search_chunk_at(const struct grf_search_chunk *chunk, const char *name) {
+  for (size_t i = 0; i < chunk->len; i++) {
+    if (*name == 0) return NULL;
+    if (chunk->wild && (chunk->str[i] == '?')) {
+      // a double-byte (EUC-KR) character counts as one
+      if (((unsigned char)*name >= 0x81) && (name[1] != 0)) name++;
+      name++;
+      continue;
+    }
+    if (*name++ != chunk->str[i]) return NULL;
+  }
+  return name;
+}
+
+/* leftmost occurrence of chunk in name, *end set to the end of the match */
+static const char *search_chunk_find(const struct grf_search_chunk *chunk, const char *name, const char **end) {
+  if (!chunk->wild) {
+    name = strstr(name, chunk->str);
+    if (name != NULL) *end = name + chunk->len;
+    return name;
+  }
+  for (; *name != 0; name++) {
+    *end = search_chunk_at(chunk, name);
+    if (*end != NULL) return name;
+  }
+  return NULL;
+}
+
+static bool search_match(const struct grf_search *search, const char *name) {
+  const char *end = name + strlen(name);
+  uint32_t first = 0, last = search->chunk_count;
+  if (search->anchor_start) {
+    if (last == 0) return *name == 0;
+    name = search_chunk_at(&search->chunks[0], name);
+    if (name == NULL) return false;
+    first = 1;
+  }
+  if (search->anchor_end && (last > first)) last--;
+  for (uint32_t i = first; i < last; i++) {
+    if (search_chunk_find(&search->chunks[i], name, &name) == NULL) return false;
+  }
+  if (!search->anchor_end) return true;
+  if (last == search->chunk_count) return name == end; /* everything matched from the start */
+  // last chunk must end the name, try it at each remaining position
+  if (!search->chunks[last].wild) {
+    size_t len = search->chunks[last].len;
+    return ((size_t)(end - name) >= len) && (memcmp(end - len, search->chunks[last].str, len) == 0);
+  }
+  for (; name < end; name++)
+    if (search_chunk_at(&search->chunks[last], name) == end) return true;
+  return false;
+}
+
+GRFEXPORT grf_search grf_search_compile(const char *pattern, int flags) {
+  struct grf_search *search = calloc(1, sizeof(struct grf_search));
+  size_t len                = strlen(pattern);
+  char *p;
+  if (search == NULL) return NULL;
+  search->flags = flags;
+  // one chunk per '*' at most, plus the string copy
+  search->chunks = malloc(sizeof(struct grf_search_chunk) * (len + 1));
+  search->str    = malloc(len + 1);
+  if ((search->chunks == NULL) || (search->str == NULL)) {
+    grf_search_free(search);
+    return NULL;
+  }
+  for (size_t i = 0; i <= len; i++) search->str[i] = search_fold(pattern[i]);
+  if (flags & GRF_SEARCH_SUBSTRING) {
+    search->chunks[0].str  = search->str;
+    search->chunks[0].len  = len;
+    search->chunks[0].wild = false;
+    search->chunk_count    = 1;
+    return search;
+  }
+  search->anchor_start = (len == 0) || (pattern[0] != '*');
+  search->anchor_end   = (len == 0) || (pattern[len - 1] != '*');
+  p                    = search->str;
+  while (*p != 0) {
+    char *star = strchr(p, '*');
+    if (star != NULL) *star = 0;
+    if (*p != 0) {
+      struct grf_search_chunk *chunk = &search->chunks[search->chunk_count++];
+      chunk->str                     = p;
+      chunk->len                     = strlen(p);
+      chunk->wild                    = (strchr(p, '?') != NULL);
+    }
+    if (star == NULL) break;
+    p = star + 1;
+  }
+  return search;
+}
+
+GRFEXPORT bool grf_search_match(grf_search search, const char *filename) {
+  char buf[256], *name = buf;
+  size_t len = strlen(filename);
+  bool res;
+  if (len >= sizeof(buf)) {
+    name = malloc(len + 1);
+    if (name == NULL) return false;
+  }
+  for (size_t i = 0; i <= len; i++) name[i] = search_fold(filename[i]);
+  res = search_match(search, name);
+  if (!res && (search->flags & GRF_SEARCH_BASENAME)) {
+    char *base = strrchr(name, '\\');
+    if (base != NULL) res = search_match(search, base + 1);
+  }
+  if (name != buf) free(name);
+  return res;
+}
+
+GRFEXPORT void grf_search_free(grf_search search) {
+  if (search == NULL) return;
+  if (search->chunks != NULL) free(search->chunks);
+  if (search->str != NULL) free(search->str);
+  free(search);
+}
+
+/* (re)build the normalized names buffer, in files list order */
+static bool search_build_names(struct grf_handler *handler) {
+  uint32_t count = handler->fast_table->count, n = 0;
+  size_t total   = 0;
+  char *names;
+  if (handler->names_valid) return true;
+  for (struct grf_node *node = handler->first_node; node != NULL; node = node->next) total += strlen(node->filename) + 1;
+  if (handler->names != NULL) free(handler->names);
+  if (handler->names_off != NULL) free(handler->names_off);
+  if (handler->names_node != NULL) free(handler->names_node);
+  handler->names      = malloc(total + 1);
+  handler->names_off  = malloc(sizeof(uint32_t) * (count + 1));
+  handler->names_node = malloc(sizeof(struct grf_node *) * (count + 1));
+  if ((handler->names == NULL) || (handler->names_off == NULL) || (handler->names_node == NULL)) return false;
+  names = handler->names;
+  for (struct grf_node *node = handler->first_node; (node != NULL) && (n < count); node = node->next) {
+    handler->names_off[n]    = names - handler->names;
+    handler->names_node[n++] = node;
+    for (const char *p = node->filename; *p != 0; p++) *names++ = search_fold(*p);
+    *names++ = 0;
+  }
+  handler->names_count = n;
+  handler->names_valid = true;
+  return true;
+}
+
+struct search_job {
+  struct grf_handler *handler;
+  struct grf_search *search;
+  uint32_t from, to;
+  uint32_t *ids, count, alloc;
+};
+
+static void *search_job_run(void *arg) {
+  struct search_job *job    = arg;
+  struct grf_handler *grf   = job->handler;
+  struct grf_search *search = job->search;
+  for (uint32_t i = job->from; i < job->to; i++) {
+    const char *name = grf->names + grf->names_off[i];
+    bool res         = search_match(search, name);
+    if (!res && (search->flags & GRF_SEARCH_BASENAME)) {
+      const char *base = strrchr(name, '\\');
+      if (base != NULL) res = search_match(search, base + 1);
+    }
+    if (!res) continue;
+    if (job->count == job->alloc) {
+      uint32_t alloc = (job->alloc == 0) ? 256 : job->alloc * 2;
+      uint32_t *ids  = realloc(job->ids, sizeof(uint32_t) * alloc);
+      if (ids == NULL) break;
+      job->ids   = ids;
+      job->alloc = alloc;
+    }
+    job->ids[job->count++] = grf->names_node[i]->id;
+  }
+  return NULL;
+}
+
+GRFEXPORT uint32_t grf_search_run(grf_handle handler, grf_search search, int threads, uint32_t **ids) {
+  struct search_job *jobs;
+  uint32_t count = 0, max_threads;
+  *ids = NULL;
+  if (!search_build_names(handler)) return 0;
+  max_threads = handler->names_count / GRF_SEARCH_SLICE + 1;
+#ifdef GRF_HAVE_PTHREAD
+  if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0) threads = 1;
+#else
+  threads = 1;
+#endif
+  if ((uint32_t)threads > max_threads) threads = max_threads;
+  jobs = calloc(threads, sizeof(struct search_job));
+  if (jobs == NULL) return 0;
+  for (int i = 0; i < threads; i++) {
+    jobs[i].handler = handler;
+    jobs[i].search  = search;
+    jobs[i].from    = (uint64_t)handler->names_count * i / threads;
+    jobs[i].to      = (uint64_t)handler->names_count * (i + 1) / threads;
+  }
+#ifdef GRF_HAVE_PTHREAD
+  if (threads > 1) {
+    pthread_t *th = malloc(sizeof(pthread_t) * threads);
+    int started   = 0;
+    if (th != NULL) {
+      // the calling thread takes the first slice
+      for (started = 1; started < threads; started++)
+        if (pthread_create(&th[started], NULL, search_job_run, &jobs[started]) != 0) break;
+    }
+    search_job_run(&jobs[0]);
+    for (int i = 1; i < started; i++) pthread_join(th[i], NULL);
+    for (int i = (started > 0) ? started : 1; i < threads; i++) search_job_run(&jobs[i]); /* couldn't start those */
+    if (th != NULL) free(th);
+  } else
+#endif
+    search_job_run(&jobs[0]);
+  for (int i = 0; i < threads; i++) count += jobs[i].count;
+  *ids = malloc(sizeof(uint32_t) * (count + 1));
+  if (*ids != NULL) {
+    count = 0;
+    for (int i = 0; i < threads; i++) {
+      if (jobs[i].count > 0) memcpy(*ids + count, jobs[i].ids, sizeof(uint32_t) * jobs[i].count);
+      count += jobs[i].count;
+    }
+  } else {
+    count = 0;
+  }
+  for (int i = 0; i < threads; i++)
+    if (jobs[i].ids != NULL) free(jobs[i].ids);
+  free(jobs);
+  return count;
+}
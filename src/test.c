@@ -1,15 +1,25 @@
 #define GRF_NO_EXPORT
 #include <grf.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifndef __WIN32
+#include <sys/wait.h>
+#else
+#define mkdir(path, mode) mkdir(path)
+#endif
 
 #ifndef __WIN32
 struct timeval tv;
 
-inline void timer_start() { gettimeofday((struct timeval *)&tv, NULL); }
+static inline void timer_start() { gettimeofday((struct timeval *)&tv, NULL); }
 
 void timer_end(const char *reason) {
   struct timeval tv2;
@@ -24,6 +34,60 @@ void timer_end(const char *reason) {
 #define timer_end(x)
 #endif
 
+/* the tests below build their own archives (in the current directory) and exit on the first failure */
+#define TEST_CHECK(x)                                                        \
+  do {                                                                       \
+    if (!(x)) {                                                              \
+      printf(" - %s(): FAILED at line %d: %s\n", __func__, __LINE__, #x); \
+      exit(10);                                                              \
+    }                                                                        \
+  } while (0)
+
+/* contents of the i-th test file, random nibbles so that it doesn't compress much */
+static void test_data(void *buf, uint32_t size, uint32_t i) {
+  uint32_t x = 0x9E3779B9 * (i + 1);
+  for (uint32_t p = 0; p < size; p++) {
+    x                         = x * 1103515245 + 12345;
+    ((unsigned char *)buf)[p] = (x >> 16) & 0x0f;
+  }
+}
+
+static void test_name(char *buf, uint32_t i) { sprintf(buf, "data\\test\\dir%u\\file%u.bin", i % 7, i); }
+
+/* new archive with files 0 to count-1, of size bytes each */
+static grf_handle test_make(const char *fn, uint32_t count, uint32_t size) {
+  grf_handle handler;
+  void *buf = malloc(size);
+  char name[64];
+  unlink(fn);
+  handler = grf_new(fn, true);
+  TEST_CHECK((handler != NULL) && (buf != NULL));
+  grf_set_compression_level(handler, 1);
+  for (uint32_t i = 0; i < count; i++) {
+    test_name(name, i);
+    test_data(buf, size, i);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  free(buf);
+  TEST_CHECK(grf_save(handler));
+  return handler;
+}
+
+/* checks file i (of size bytes) has the right contents */
+static bool test_file_ok(grf_handle handler, uint32_t i, uint32_t size) {
+  char name[64];
+  void *a = malloc(size), *b = malloc(size);
+  grf_node node;
+  bool ok;
+  test_name(name, i);
+  node = grf_get_file(handler, name);
+  test_data(a, size, i);
+  ok = (node != NULL) && (grf_file_get_size(node) == size) && (grf_file_get_contents(node, b) == size) && (memcmp(a, b, size) == 0);
+  free(a);
+  free(b);
+  return ok;
+}
+
 void test_grf_version() {
   uint32_t version = grf_version();
   uint8_t major, minor, revision;
@@ -47,6 +111,10 @@ void test_new_handler() {
     exit(2);
   }
 
+  if (access("grf/Alpha.grf", R_OK) != 0) {
+    puts(" - test_new_handler(): grf/ test files not found, skipped");
+    return;
+  }
   handler = grf_new("test.grf", true);
   grf_set_compression_level(handler, 9);
   printf(" - test_new_handler(): New handler at %p.\n", handler);
@@ -128,6 +196,1240 @@ void test_new_handler() {
   grf_free(handler);
 }
 
+static bool test_cancel_cb(void *etc, grf_handle handler, int pos, int max, const char *filename) {
+  (void)handler;
+  (void)pos;
+  (void)max;
+  if (filename == NULL) return true;
+  return --*(int *)etc > 0;
+}
+
+/* grf_repack() stopped after its first batch: it must fail, and the journal must let the next load resume it */
+void test_repack_cancel() {
+  const uint32_t count = 48, size = 1024 * 1024; /* about 3 batches of GRF_REPACK_BATCH_SIZE */
+  grf_handle handler = test_make("test_repack.grf", count, size);
+  int calls          = 2;
+  char name[64];
+  test_name(name, 0);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  TEST_CHECK(grf_save(handler));
+  grf_set_callback(handler, test_cancel_cb, &calls);
+  grf_set_progress_interval(handler, 0);
+  TEST_CHECK(grf_repack(handler, GRF_REPACK_FAST) == false);
+  grf_free(handler);
+  // read-only: files of the pending batch are read from where they are now
+  handler = grf_load("test_repack.grf", false);
+  TEST_CHECK(handler != NULL);
+  TEST_CHECK(grf_filecount(handler) == count - 1);
+  for (uint32_t i = 1; i < count; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  // inside a transaction: the repack can't be finished, the load fails
+  handler = grf_new("test_repack.grf", true);
+  TEST_CHECK((handler != NULL) && grf_begin(handler));
+  TEST_CHECK(grf_load_from_new(handler) == NULL);
+  // read/write: the repack is finished
+  handler = grf_load("test_repack.grf", true);
+  TEST_CHECK(handler != NULL);
+  TEST_CHECK(handler->version == GRF_FILE_OUTPUT_VERISON);
+  TEST_CHECK(grf_wasted_space(handler) == 0);
+  for (uint32_t i = 1; i < count; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  unlink("test_repack.grf");
+  puts(" - test_repack_cancel(): OK");
+}
+
+#ifndef __WIN32
+static bool test_crash_cb(void *etc, grf_handle handler, int pos, int max, const char *filename) {
+  if (!test_cancel_cb(etc, handler, pos, max, filename)) _exit(0); /* the process dies in the middle of the repack */
+  return true;
+}
+
+/* the process dies during grf_repack(): the next read/write load resumes it */
+void test_repack_crash() {
+  const uint32_t count = 48, size = 1024 * 1024;
+  grf_handle handler = test_make("test_crash.grf", count, size);
+  char name[64];
+  int status;
+  pid_t pid;
+  for (uint32_t i = 0; i < count; i += 5) {
+    test_name(name, i);
+    TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  }
+  TEST_CHECK(grf_save(handler));
+  grf_free(handler);
+  fflush(stdout);
+  pid = fork();
+  TEST_CHECK(pid >= 0);
+  if (pid == 0) {
+    int calls = 3;
+    handler   = grf_load("test_crash.grf", true);
+    if (handler == NULL) _exit(1);
+    grf_set_callback(handler, test_crash_cb, &calls);
+    grf_set_progress_interval(handler, 0);
+    grf_repack(handler, GRF_REPACK_FAST);
+    _exit(2); /* should have died before */
+  }
+  TEST_CHECK((waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  handler = grf_load("test_crash.grf", true);
+  TEST_CHECK(handler != NULL);
+  TEST_CHECK(handler->version == GRF_FILE_OUTPUT_VERISON);
+  TEST_CHECK(grf_wasted_space(handler) == 0);
+  for (uint32_t i = 0; i < count; i++)
+    if (i % 5 != 0) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  unlink("test_crash.grf");
+  puts(" - test_repack_crash(): OK");
+}
+#else
+void test_repack_crash() {}
+#endif
+
+/* grf_repack_layout(): traced files first, in access order, even if files were deleted and added since */
+void test_repack_layout() {
+  const uint32_t count = 20, size = 4096;
+  const uint32_t trace[] = {9, 3, 7, 1};
+  grf_handle handler = test_make("test_layout.grf", count, size);
+  char name[64], *buf = malloc(size);
+  grf_node node;
+  grf_trace_start(handler);
+  for (uint32_t i = 0; i < 4; i++) TEST_CHECK(test_file_ok(handler, trace[i], size));
+  grf_trace_stop(handler);
+  // the ID of file 3 must not go to the new file while the trace holds it
+  test_name(name, 3);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  test_data(buf, size, 100);
+  TEST_CHECK(grf_file_add(handler, "data\\new.bin", buf, size) != NULL);
+  TEST_CHECK(grf_repack_layout(handler, GRF_REPACK_FAST, GRF_LAYOUT_TRACE, NULL, 0));
+  node = grf_get_file_first(handler);
+  for (uint32_t i = 0; i < 4; i++) {
+    if (trace[i] == 3) continue;
+    test_name(name, trace[i]);
+    TEST_CHECK((node != NULL) && (strcmp(grf_file_get_filename(node), name) == 0));
+    node = grf_get_file_next(node);
+  }
+  TEST_CHECK(grf_wasted_space(handler) == 0);
+  // directory layout: storage order is name order
+  TEST_CHECK(grf_repack_layout(handler, GRF_REPACK_FAST, GRF_LAYOUT_DIRECTORY, NULL, 0));
+  for (node = grf_get_file_first(handler); grf_get_file_next(node) != NULL; node = grf_get_file_next(node))
+    TEST_CHECK(strcmp(grf_file_get_filename(node), grf_file_get_filename(grf_get_file_next(node))) < 0);
+  // more files added than the last save counted
+  for (uint32_t i = count; i < 3 * count; i++) {
+    test_name(name, i);
+    test_data(buf, size, i);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  TEST_CHECK(grf_repack_layout(handler, GRF_REPACK_FAST, GRF_LAYOUT_DIRECTORY, NULL, 0));
+  grf_free(handler);
+  handler = grf_load("test_layout.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == 3 * count));
+  for (uint32_t i = 0; i < 3 * count; i++)
+    if (i != 3) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  free(buf);
+  unlink("test_layout.grf");
+  puts(" - test_repack_layout(): OK");
+}
+
+/* checks the archive on disk has the files 0 to count-1 that aren't gone (all of them if gone is NULL) */
+static void test_archive_ok(const char *fn, uint32_t count, uint32_t size, const bool *gone) {
+  grf_handle handler = grf_load(fn, false);
+  uint32_t n         = 0;
+  TEST_CHECK(handler != NULL);
+  for (uint32_t i = 0; i < count; i++) {
+    if ((gone != NULL) && gone[i]) continue;
+    TEST_CHECK(test_file_ok(handler, i, size));
+    n++;
+  }
+  TEST_CHECK(grf_filecount(handler) == n);
+  grf_free(handler);
+}
+
+static void test_delete(grf_handle handler, uint32_t i, bool *gone) {
+  char name[64];
+  test_name(name, i);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  gone[i] = true;
+}
+
+/* grf_defrag_step(): the archive on disk stays loadable after each step, unsaved deletes are saved first */
+void test_defrag_step() {
+  const uint32_t count = 40, size = 8192;
+  grf_handle handler = test_make("test_defrag.grf", count, size);
+  bool gone[40]      = {false};
+  uint64_t wasted;
+  uint32_t moved;
+  // holes of two files, so that any file fits
+  for (uint32_t i = 0; i < count; i += 8) {
+    test_delete(handler, i, gone);
+    test_delete(handler, i + 1, gone);
+  }
+  // not saved yet: the holes are still used by the table on disk, the step must save before moving anything. A
+  // budget smaller than one file still moves one file.
+  moved = grf_defrag_step(handler, 1);
+  TEST_CHECK((moved > 0) && (moved < 2 * size));
+  test_archive_ok("test_defrag.grf", count, size, gone);
+  // nothing moves inside a transaction
+  TEST_CHECK(grf_begin(handler));
+  for (uint32_t i = 4; i < count; i += 8) {
+    test_delete(handler, i, gone);
+    test_delete(handler, i + 1, gone);
+  }
+  TEST_CHECK(grf_defrag_step(handler, size) == 0);
+  TEST_CHECK(grf_commit(handler));
+  wasted = grf_wasted_space(handler);
+  TEST_CHECK(wasted > 0);
+  while ((moved = grf_defrag_step(handler, 3 * size)) > 0) test_archive_ok("test_defrag.grf", count, size, gone);
+  TEST_CHECK(grf_wasted_space(handler) < wasted);
+  grf_free(handler);
+  test_archive_ok("test_defrag.grf", count, size, gone);
+  unlink("test_defrag.grf");
+  puts(" - test_defrag_step(): OK");
+}
+
+/* the files table is deflated by chunks: a table much larger than a chunk must load back identical, and the archive
+ * must end with it */
+void test_table_stream() {
+  const uint32_t count = 20000, size = 16;
+  grf_handle handler = test_make("test_table.grf", count, size);
+  struct stat st;
+  TEST_CHECK(handler->table_size > 0);
+  TEST_CHECK((stat("test_table.grf", &st) == 0) &&
+             ((uint64_t)st.st_size == GRF_HEADER_SIZE + handler->table_offset + handler->table_size));
+  grf_free(handler);
+  handler = grf_load("test_table.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == count));
+  for (uint32_t i = 0; i < count; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  unlink("test_table.grf");
+  puts(" - test_table_stream(): OK");
+}
+
+/* inside grf_begin()/grf_commit(), the archive on disk keeps its previous contents until the commit */
+void test_transaction() {
+  const uint32_t count = 30, size = 4096;
+  grf_handle handler = test_make("test_trans.grf", count, size);
+  bool gone[40]      = {false};
+  void *buf          = malloc(size);
+  char name[64];
+  grf_set_sync_policy(handler, GRF_SYNC_SAVE);
+  TEST_CHECK(grf_begin(handler) && grf_begin(handler));
+  for (uint32_t i = 0; i < count; i += 3) test_delete(handler, i, gone);
+  // replace some files with the contents of others, and add new ones
+  for (uint32_t i = 1; i < count; i += 3) {
+    test_name(name, i);
+    test_data(buf, size, i + 1);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  for (uint32_t i = count; i < 40; i++) {
+    test_name(name, i);
+    test_data(buf, size, i);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  TEST_CHECK(grf_save(handler));
+  TEST_CHECK(grf_commit(handler));
+  TEST_CHECK(!grf_repack(handler, GRF_REPACK_FAST));
+  TEST_CHECK(!grf_repack_layout(handler, GRF_REPACK_FAST, GRF_LAYOUT_DIRECTORY, NULL, 0));
+  // still the archive from before grf_begin()
+  memset(gone, 0, sizeof(gone));
+  test_archive_ok("test_trans.grf", count, size, gone);
+  TEST_CHECK(grf_commit(handler));
+  TEST_CHECK(grf_commit(handler) == false);
+  grf_free(handler);
+  handler = grf_load("test_trans.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == 40 - count / 3));
+  for (uint32_t i = 0; i < 40; i++) {
+    if ((i < count) && (i % 3 == 0)) continue;
+    if ((i < count) && (i % 3 == 1)) {
+      // contents of file i + 1 under the name of file i
+      void *b = malloc(size);
+      test_name(name, i);
+      test_data(buf, size, i + 1);
+      TEST_CHECK(grf_get_file(handler, name) != NULL);
+      TEST_CHECK((grf_file_get_contents(grf_get_file(handler, name), b) == size) && (memcmp(b, buf, size) == 0));
+      free(b);
+      continue;
+    }
+    TEST_CHECK(test_file_ok(handler, i, size));
+  }
+  grf_free(handler);
+  free(buf);
+  unlink("test_trans.grf");
+  puts(" - test_transaction(): OK");
+}
+
+/* version found in the header of an archive */
+static uint32_t test_header_version(const char *fn) {
+  struct grf_header head;
+  FILE *f = fopen(fn, "rb");
+  TEST_CHECK((f != NULL) && (fread(&head, sizeof(head), 1, f) == 1));
+  fclose(f);
+  return head.version;
+}
+
+#ifndef __WIN32
+/* a file stored after 4GB makes a 0x300 archive (sparse, so it doesn't take that much space), which goes back to 0x200
+ * once that file is gone */
+void test_large_header() {
+  const uint32_t size = 4096;
+  const uint64_t far  = 5ULL * 1024 * 1024 * 1024;
+  grf_handle handler  = test_make("test_large.grf", 3, size);
+  grf_node node;
+  char name[64];
+  void *buf;
+  test_name(name, 2);
+  node = grf_get_file(handler, name);
+  buf  = malloc(node->len_aligned);
+  // move the last file (by hand) after 4GB
+  if ((pread(handler->fd, buf, node->len_aligned, GRF_HEADER_SIZE + node->pos) != (ssize_t)node->len_aligned) ||
+      (pwrite(handler->fd, buf, node->len_aligned, GRF_HEADER_SIZE + far) != (ssize_t)node->len_aligned)) {
+    puts(" - test_large_header(): can't write after 4GB here, skipped");
+    free(buf);
+    grf_free(handler);
+    unlink("test_large.grf");
+    return;
+  }
+  free(buf);
+  node->pos          = far;
+  handler->need_save = true;
+  TEST_CHECK(grf_save(handler));
+  TEST_CHECK(handler->version == GRF_FILE_LARGE_VERSION);
+  grf_free(handler);
+  TEST_CHECK(test_header_version("test_large.grf") == GRF_FILE_LARGE_VERSION);
+  handler = grf_load("test_large.grf", true);
+  TEST_CHECK((handler != NULL) && (handler->table_offset > far));
+  node = grf_get_file(handler, name);
+  TEST_CHECK((node != NULL) && (grf_file_get_storage_pos64(node) == far) && (grf_file_get_storage_pos(node) == 0xFFFFFFFF));
+  for (uint32_t i = 0; i < 3; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  TEST_CHECK(grf_file_delete(node));
+  TEST_CHECK(grf_save(handler));
+  grf_free(handler);
+  TEST_CHECK(test_header_version("test_large.grf") == GRF_FILE_OUTPUT_VERISON);
+  handler = grf_load("test_large.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == 2));
+  for (uint32_t i = 0; i < 2; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  unlink("test_large.grf");
+  puts(" - test_large_header(): OK");
+}
+#else
+void test_large_header() {}
+#endif
+
+/* contents of the vfs file i (of size bytes) must be test file `data` */
+static bool test_vfs_is(grf_vfs vfs, uint32_t i, uint32_t size, uint32_t data) {
+  char name[64];
+  void *a = malloc(size), *b = malloc(size);
+  grf_vfs_file file;
+  bool ok;
+  test_name(name, i);
+  file = grf_vfs_get_file(vfs, name);
+  test_data(a, size, data);
+  ok = (file != NULL) && (grf_vfs_file_get_size(file) == size) && (grf_vfs_file_get_contents(file, b) == size) &&
+       (memcmp(a, b, size) == 0);
+  free(a);
+  free(b);
+  return ok;
+}
+
+/* add files first to last-1 to handler, file i having the contents of test file i + shift */
+static void test_add_range(grf_handle handler, uint32_t first, uint32_t last, uint32_t size, uint32_t shift) {
+  void *buf = malloc(size);
+  char name[64];
+  for (uint32_t i = first; i < last; i++) {
+    test_name(name, i);
+    test_data(buf, size, i + shift);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  free(buf);
+}
+
+/* grf_vfs: priorities, ties, unmount, changes to a mounted grf, directories */
+void test_vfs() {
+  const uint32_t size = 64;
+  grf_handle a       = test_make("test_vfs_a.grf", 3000, size);
+  grf_handle b       = grf_new("test_vfs_b.grf", true), c = grf_new("test_vfs_c.grf", true);
+  grf_vfs vfs        = grf_vfs_new();
+  void *buf          = malloc(size);
+  char name[64];
+  FILE *f;
+  TEST_CHECK((b != NULL) && (c != NULL) && (vfs != NULL));
+  test_add_range(b, 5, 3010, size, 100000);
+  test_add_range(c, 7, 8, size, 200000);
+  TEST_CHECK(grf_vfs_mount(vfs, a, 1) && grf_vfs_mount(vfs, b, 2));
+  TEST_CHECK(grf_vfs_mount(vfs, b, 2) == false); /* already mounted */
+  TEST_CHECK(grf_vfs_filecount(vfs) == 3010);
+  TEST_CHECK(test_vfs_is(vfs, 2, size, 2) && test_vfs_is(vfs, 7, size, 100007) && test_vfs_is(vfs, 3005, size, 103005));
+  // same priority: the last mounted wins, until unmounted
+  TEST_CHECK(grf_vfs_mount(vfs, c, 2));
+  TEST_CHECK(test_vfs_is(vfs, 7, size, 200007) && test_vfs_is(vfs, 8, size, 100008));
+  TEST_CHECK(grf_vfs_unmount(vfs, c));
+  TEST_CHECK(test_vfs_is(vfs, 7, size, 100007));
+  TEST_CHECK(grf_vfs_unmount(vfs, b));
+  TEST_CHECK(test_vfs_is(vfs, 7, size, 7) && (grf_vfs_filecount(vfs) == 3000));
+  test_name(name, 3005);
+  TEST_CHECK(grf_vfs_get_file(vfs, name) == NULL);
+  // changes to a mounted grf show up at once
+  test_name(name, 3);
+  TEST_CHECK(grf_file_delete(grf_get_file(a, name)));
+  TEST_CHECK(grf_vfs_get_file(vfs, name) == NULL);
+  test_add_range(a, 3, 4, size, 300000);
+  TEST_CHECK(test_vfs_is(vfs, 3, size, 300003));
+  // a directory with the highest priority
+  mkdir("test_vfs", 0755);
+  mkdir("test_vfs/data", 0755);
+  mkdir("test_vfs/data/test", 0755);
+  mkdir("test_vfs/data/test/dir2", 0755);
+  test_data(buf, size, 400002);
+  f = fopen("test_vfs/data/test/dir2/file2.bin", "wb");
+  TEST_CHECK((f != NULL) && (fwrite(buf, size, 1, f) == 1));
+  fclose(f);
+  TEST_CHECK(grf_vfs_mount_dir(vfs, "test_vfs", 3));
+  TEST_CHECK(test_vfs_is(vfs, 2, size, 400002) && test_vfs_is(vfs, 9, size, 9));
+  test_name(name, 2);
+  TEST_CHECK(grf_vfs_file_get_node(grf_vfs_get_file(vfs, name)) == NULL);
+  // grf_free() unmounts
+  grf_free(a);
+  TEST_CHECK((grf_vfs_filecount(vfs) == 1) && test_vfs_is(vfs, 2, size, 400002));
+  grf_vfs_free(vfs);
+  grf_free(b);
+  grf_free(c);
+  free(buf);
+  unlink("test_vfs/data/test/dir2/file2.bin");
+  rmdir("test_vfs/data/test/dir2");
+  rmdir("test_vfs/data/test");
+  rmdir("test_vfs/data");
+  rmdir("test_vfs");
+  unlink("test_vfs_a.grf");
+  unlink("test_vfs_b.grf");
+  unlink("test_vfs_c.grf");
+  puts(" - test_vfs(): OK");
+}
+
+/* name of file i as a user could write it: upper case, '/' separated */
+static void test_name_variant(char *buf, uint32_t i) {
+  test_name(buf, i);
+  for (char *p = buf; *p != 0; p++) {
+    if (*p == '\\') *p = '/';
+    if ((*p >= 'a') && (*p <= 'z')) *p -= 32;
+  }
+}
+
+/* Bloom filter: no false negatives, whatever the spelling, after load, add and rename; few false positives */
+void test_bloom() {
+  const uint32_t count = 5000;
+  grf_handle handler = test_make("test_bloom.grf", count, 16);
+  uint32_t positives = 0;
+  char name[64];
+  grf_free(handler);
+  handler = grf_load("test_bloom.grf", true);
+  TEST_CHECK(handler != NULL);
+  test_add_range(handler, count, count + 100, 16, 0);
+  test_name(name, 0);
+  TEST_CHECK(grf_file_rename(grf_get_file(handler, name), "data\\renamed.bin"));
+  TEST_CHECK(grf_file_may_exist(handler, "DATA/Renamed.BIN") && (grf_get_file(handler, "data/renamed.bin") != NULL));
+  for (uint32_t i = 1; i < count + 100; i++) {
+    test_name(name, i);
+    TEST_CHECK(grf_file_may_exist(handler, name));
+    test_name_variant(name, i);
+    TEST_CHECK(grf_file_may_exist(handler, name) && (grf_get_file(handler, name) != NULL));
+  }
+  for (uint32_t i = count + 100; i < 2 * count + 100; i++) {
+    test_name(name, i);
+    if (grf_file_may_exist(handler, name)) positives++;
+    TEST_CHECK(grf_get_file(handler, name) == NULL);
+  }
+  printf(" - test_bloom(): %u false positives out of %u\n", positives, count);
+  TEST_CHECK(positives < count / 20);
+  // disabled: everything may exist, lookups still work
+  grf_set_bloom(handler, false);
+  test_name(name, 2 * count);
+  TEST_CHECK(grf_file_may_exist(handler, name) && (grf_get_file(handler, name) == NULL));
+  test_name(name, 1);
+  TEST_CHECK(grf_get_file(handler, name) != NULL);
+  grf_free(handler);
+  unlink("test_bloom.grf");
+  puts(" - test_bloom(): OK");
+}
+
+/* the index order: case insensitive, '/' and '\\' being the same */
+static int test_name_cmp(const char *a, const char *b) {
+  for (;; a++, b++) {
+    unsigned char x = *a, y = *b;
+    if ((x >= 'A') && (x <= 'Z')) x += 32;
+    if ((y >= 'A') && (y <= 'Z')) y += 32;
+    if (x == '/') x = '\\';
+    if (y == '/') y = '\\';
+    if ((x != y) || (x == 0)) return x - y;
+  }
+}
+
+/* sorted index: order, prefix and range queries, rebuilt after changes */
+void test_sorted() {
+  const uint32_t count = 700;
+  grf_handle handler = test_make("test_sorted.grf", count, 16);
+  uint32_t first, n;
+  TEST_CHECK(grf_file_add(handler, "DATA\\TEST\\DIR3\\Upper.bin", "0123456789abcdef", 16) != NULL);
+  TEST_CHECK(grf_file_add(handler, "data/test/dir3x.bin", "0123456789abcdef", 16) != NULL);
+  TEST_CHECK(grf_sorted_count(handler) == count + 2);
+  for (uint32_t i = 1; i < count + 2; i++)
+    TEST_CHECK(test_name_cmp(grf_file_get_filename(grf_sorted_get(handler, i - 1)), grf_file_get_filename(grf_sorted_get(handler, i))) < 0);
+  TEST_CHECK(grf_sorted_get(handler, count + 2) == NULL);
+  // everything under data\test\dir3\ (100 files + Upper.bin), but not dir3x.bin
+  n = grf_sorted_prefix(handler, "data/TEST/dir3\\", &first);
+  TEST_CHECK(n == count / 7 + 1);
+  for (uint32_t i = first; i < first + n; i++)
+    TEST_CHECK(test_name_cmp(grf_file_get_filename(grf_sorted_get(handler, i)), "data\\test\\dir3\\") > 0);
+  TEST_CHECK(grf_sorted_lower_bound(handler, "data\\test\\dir3\\") == first);
+  TEST_CHECK(grf_sorted_lower_bound(handler, "zzz") == count + 2);
+  TEST_CHECK(grf_sorted_count_range(handler, "data\\test\\dir3\\", "data\\test\\dir4\\") == n + 1);
+  TEST_CHECK(grf_sorted_count_range(handler, NULL, NULL) == count + 2);
+  TEST_CHECK(grf_sorted_count_range(handler, "data\\test\\dir6\\", NULL) == count / 7);
+  // changes are picked up
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, "data\\test\\dir3\\upper.bin")));
+  TEST_CHECK(grf_sorted_prefix(handler, "data\\test\\dir3\\", NULL) == count / 7);
+  grf_free(handler);
+  unlink("test_sorted.grf");
+  puts(" - test_sorted(): OK");
+}
+
+/* counts the files under dir, checking each directory is sorted and each file's path leads to it */
+static uint32_t test_tree_walk(grf_treenode dir) {
+  grf_treenode *list = grf_tree_list_node(dir);
+  uint32_t n = 0, i;
+  TEST_CHECK(list != NULL);
+  for (i = 0; list[i] != NULL; i++) {
+    if (i > 0) TEST_CHECK(test_name_cmp(grf_tree_get_name(list[i - 1]), grf_tree_get_name(list[i])) < 0);
+    TEST_CHECK(grf_tree_get_parent(list[i]) == dir);
+    if (grf_tree_is_dir(list[i])) {
+      n += test_tree_walk(list[i]);
+    } else {
+      grf_node node = grf_tree_get_file(list[i]);
+      const char *fn = grf_file_get_filename(node), *base = strrchr(fn, '\\');
+      TEST_CHECK((node != NULL) && (grf_file_get_tree(node) == list[i]));
+      TEST_CHECK(strcmp((base == NULL) ? fn : base + 1, grf_tree_get_name(list[i])) == 0);
+      n++;
+    }
+  }
+  TEST_CHECK(grf_tree_dir_count_files(dir) == i);
+  free(list);
+  return n;
+}
+
+/* tree: every file once, directories sorted, kept up to date */
+void test_tree() {
+  const uint32_t count = 700;
+  grf_handle handler = test_make("test_tree.grf", count, 16);
+  char name[64];
+  grf_create_tree(handler);
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count);
+  test_add_range(handler, count, count + 10, 16, 0);
+  TEST_CHECK(grf_file_add(handler, "data\\other\\new.bin", "0123456789abcdef", 16) != NULL);
+  test_name(name, 0);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count + 10);
+  grf_free(handler);
+  unlink("test_tree.grf");
+  puts(" - test_tree(): OK");
+}
+
+/* lazy tree: directories created on demand give the same tree */
+void test_tree_lazy() {
+  const uint32_t count = 700;
+  grf_handle handler = test_make("test_tree_lazy.grf", count, 16);
+  grf_treenode leaf, dir;
+  char name[64];
+  grf_create_tree_lazy(handler);
+  test_name(name, 5);
+  leaf = grf_file_get_tree(grf_get_file(handler, name));
+  TEST_CHECK((leaf != NULL) && (strcmp(grf_tree_get_name(leaf), "file5.bin") == 0));
+  dir = grf_tree_get_parent(leaf);
+  TEST_CHECK(strcmp(grf_tree_get_name(dir), "dir5") == 0);
+  TEST_CHECK(grf_tree_dir_count_files(dir) == count / 7);
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count);
+  test_add_range(handler, count, count + 10, 16, 0);
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count + 10);
+  grf_free(handler); /* saves the added files */
+  /* reloaded: nothing listed yet when files change */
+  handler = grf_load("test_tree_lazy.grf", true);
+  TEST_CHECK(handler != NULL);
+  grf_create_tree_lazy(handler);
+  test_name(name, 0);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  TEST_CHECK(grf_file_add(handler, "data\\other\\new.bin", "0123456789abcdef", 16) != NULL);
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count + 10);
+  grf_free(handler);
+  unlink("test_tree_lazy.grf");
+  puts(" - test_tree_lazy(): OK");
+}
+
+/* grf_search: wildcards, substrings, basenames, and the threaded run */
+void test_search() {
+  static const struct {
+    const char *pattern;
+    int flags;
+    const char *name;
+    bool match;
+  } cases[] = {
+    {"data\\*.bmp", 0, "data\\texture\\a.bmp", true},
+    {"data\\*.bmp", 0, "data\\texture\\a.bmp.txt", false},
+    {"DATA/TEXTURE/?.BMP", 0, "data\\texture\\a.bmp", true},
+    {"data\\texture\\?.bmp", 0, "data\\texture\\ab.bmp", false},
+    {"*a*b*c", 0, "xxaxxbxxbxxc", true},
+    {"*a*b*c", 0, "xxaxxbxxcxxd", false},
+    {"**", 0, "", true},
+    {"a*", 0, "b", false},
+    {"texture", GRF_SEARCH_SUBSTRING, "data\\TEXTURE\\a.bmp", true},
+    {"a/b", GRF_SEARCH_SUBSTRING, "x\\a\\b", true},
+    {"*.bmp", GRF_SEARCH_SUBSTRING, "a.bmp", false},
+    {"a.*", 0, "data\\a.bmp", false},
+    {"a.*", GRF_SEARCH_BASENAME, "data\\a.bmp", true},
+    {"?.bmp", GRF_SEARCH_BASENAME, "data\\b\\ab.bmp", false},
+  };
+  const uint32_t count = 3000;
+  grf_handle handler = test_make("test_search.grf", count, 16);
+  grf_search search;
+  uint32_t *ids, n, i, t, expected = 0;
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    search = grf_search_compile(cases[i].pattern, cases[i].flags);
+    TEST_CHECK(search != NULL);
+    if (grf_search_match(search, cases[i].name) != cases[i].match) {
+      printf(" - test_search(): FAILED: \"%s\" on \"%s\"\n", cases[i].pattern, cases[i].name);
+      exit(10);
+    }
+    grf_search_free(search);
+  }
+  /* run: files 3, 10, 17... and 30-39, 300-399 */
+  search = grf_search_compile("data/test/dir3/file*3*.bin", 0);
+  TEST_CHECK(search != NULL);
+  for (i = 0; i < count; i++) {
+    char name[64];
+    test_name(name, i);
+    if (grf_search_match(search, name)) expected++;
+  }
+  TEST_CHECK(expected > 0);
+  for (t = 1; t <= 4; t += 3) {
+    n = grf_search_run(handler, search, t, &ids);
+    TEST_CHECK(n == expected);
+    for (i = 0; i < n; i++) {
+      const char *fn = grf_file_get_filename(grf_get_file_by_id(handler, ids[i]));
+      TEST_CHECK((fn != NULL) && grf_search_match(search, fn) && (strncmp(fn, "data\\test\\dir3\\", 15) == 0));
+      TEST_CHECK((i == 0) || (ids[i] != ids[i - 1]));
+    }
+    free(ids);
+  }
+  grf_search_free(search);
+  grf_free(handler);
+  unlink("test_search.grf");
+  puts(" - test_search(): OK");
+}
+
+/* looks for an extension by name, checking its numbers against its list of files */
+static uint32_t test_ext_count(grf_handle handler, const char *ext) {
+  uint32_t i, j, count;
+  uint64_t size = 0, storage = 0;
+  grf_node *list = grf_ext_get_files(handler, ext, &count);
+  for (i = 0; i < grf_ext_count(handler); i++) {
+    if (strcmp(grf_ext_get_name(handler, i), (ext[0] == '.') ? ext + 1 : ext) != 0) continue;
+    TEST_CHECK((list != NULL) && (grf_ext_get_filecount(handler, i) == count));
+    for (j = 0; j < count; j++) {
+      size += grf_file_get_size(list[j]);
+      storage += grf_file_get_storage_size(list[j]);
+    }
+    TEST_CHECK(grf_ext_get_size(handler, i) == size);
+    TEST_CHECK((grf_ext_get_compressed_size(handler, i) > 0) && (grf_ext_get_compressed_size(handler, i) <= storage));
+    return count;
+  }
+  TEST_CHECK((list == NULL) || (count == 0));
+  return 0;
+}
+
+/* extension index: sorted, counted, kept up to date */
+void test_ext() {
+  static const char *const names[] = {"data\\a.TXT", "data\\b.txt", "data\\c", "data\\d.Spr", "data\\dir.x\\noext"};
+  const uint32_t count = 100;
+  grf_handle handler = test_make("test_ext.grf", count, 16);
+  uint32_t i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) TEST_CHECK(grf_file_add(handler, names[i], "0123456789abcdef", 16 - i) != NULL);
+  TEST_CHECK(grf_ext_count(handler) == 4);
+  TEST_CHECK(grf_ext_get_name(handler, 4) == NULL);
+  for (i = 1; i < grf_ext_count(handler); i++) TEST_CHECK(strcmp(grf_ext_get_name(handler, i - 1), grf_ext_get_name(handler, i)) < 0);
+  TEST_CHECK(strcmp(grf_ext_get_name(handler, 0), "") == 0);
+  TEST_CHECK(test_ext_count(handler, "") == 2);
+  TEST_CHECK(test_ext_count(handler, "bin") == count);
+  TEST_CHECK(test_ext_count(handler, ".txt") == 2);
+  TEST_CHECK((grf_ext_get_files(handler, ".TXT", &i) != NULL) && (i == 2));
+  TEST_CHECK(test_ext_count(handler, "spr") == 1);
+  TEST_CHECK(test_ext_count(handler, "x") == 0);
+  grf_free(handler);
+  /* reloaded, then changed */
+  handler = grf_load("test_ext.grf", true);
+  TEST_CHECK(handler != NULL);
+  TEST_CHECK(test_ext_count(handler, "txt") == 2);
+  TEST_CHECK(grf_file_rename(grf_get_file(handler, "data\\a.TXT"), "data\\a.spr"));
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, "data\\c")));
+  TEST_CHECK(test_ext_count(handler, "txt") == 1);
+  TEST_CHECK(test_ext_count(handler, "spr") == 2);
+  TEST_CHECK(test_ext_count(handler, "") == 1);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, "data\\dir.x\\noext")));
+  TEST_CHECK(grf_ext_count(handler) == 3);
+  grf_free(handler);
+  unlink("test_ext.grf");
+  puts(" - test_ext(): OK");
+}
+
+/* compares a directory's entries as iterated and as listed, for every directory below */
+static uint32_t test_tree_iterate(grf_treenode dir) {
+  grf_cursor cursor = GRF_CURSOR_INIT;
+  grf_treenode *list = grf_tree_list_node(dir), cur;
+  uint32_t n = 0, i = 0;
+  while ((cur = grf_tree_iterate(dir, &cursor)) != NULL) {
+    TEST_CHECK(cur == list[i++]);
+    n += grf_tree_is_dir(cur) ? test_tree_iterate(cur) : 1;
+  }
+  TEST_CHECK((list[i] == NULL) && (grf_tree_iterate(dir, &cursor) == NULL));
+  free(list);
+  return n;
+}
+
+/* cursors: same entries, same order as the allocated lists */
+void test_iterate() {
+  const uint32_t count = 2000;
+  grf_handle handler = test_make("test_iterate.grf", count, 16);
+  grf_cursor cursor  = GRF_CURSOR_INIT;
+  grf_node *list, node;
+  grf_treenode root;
+  uint32_t i = 0;
+  list = grf_get_file_list(handler);
+  while ((node = grf_file_iterate(handler, &cursor)) != NULL) TEST_CHECK(node == list[i++]);
+  TEST_CHECK((i == count) && (list[i] == NULL) && (grf_file_iterate(handler, &cursor) == NULL));
+  free(list);
+  grf_free(handler);
+  /* lazy tree: iterating lists the directories */
+  handler = grf_load("test_iterate.grf", true);
+  TEST_CHECK(handler != NULL);
+  grf_create_tree_lazy(handler);
+  root = grf_tree_get_root(handler);
+  TEST_CHECK(test_tree_iterate(root) == count);
+  cursor = (grf_cursor)GRF_CURSOR_INIT;
+  TEST_CHECK(grf_tree_iterate(grf_file_get_tree(grf_get_file_first(handler)), &cursor) == NULL); /* a file */
+  grf_free(handler);
+  /* empty */
+  handler = grf_new("test_iterate.grf", true);
+  TEST_CHECK(handler != NULL);
+  cursor = (grf_cursor)GRF_CURSOR_INIT;
+  TEST_CHECK(grf_file_iterate(handler, &cursor) == NULL);
+  grf_free(handler);
+  unlink("test_iterate.grf");
+  puts(" - test_iterate(): OK");
+}
+
+/* file IDs: numbered in storage order when loaded, stable across changes */
+void test_ids() {
+  const uint32_t count = 500;
+  grf_handle handler = test_make("test_ids.grf", count, 16);
+  grf_node node, prev = NULL;
+  uint32_t ids[500], i, id;
+  char name[64];
+  for (i = 0; i < count; i++) {
+    test_name(name, i);
+    node   = grf_get_file(handler, name);
+    ids[i] = grf_file_get_id(node);
+    TEST_CHECK(grf_get_file_by_id(handler, ids[i]) == node);
+  }
+  test_name(name, 7);
+  TEST_CHECK(grf_file_delete(grf_get_file(handler, name)));
+  TEST_CHECK(grf_get_file_by_id(handler, ids[7]) == NULL);
+  test_add_range(handler, count, count + 1, 16, 0);
+  test_name(name, count);
+  TEST_CHECK(grf_file_get_id(grf_get_file(handler, name)) == ids[7]); /* reused */
+  test_add_range(handler, count + 1, count + 2, 16, 0);
+  test_name(name, count + 1);
+  id = grf_file_get_id(grf_get_file(handler, name));
+  TEST_CHECK((id >= count) && (id < grf_get_id_list_size(handler)));
+  for (i = 0; i < count; i++) {
+    if (i == 7) continue;
+    test_name(name, i);
+    TEST_CHECK(grf_file_get_id(grf_get_file(handler, name)) == ids[i]);
+  }
+  grf_free(handler);
+  handler = grf_load("test_ids.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_get_id_list_size(handler) == count + 1));
+  for (i = 0; i <= count; i++) {
+    node = grf_get_file_by_id(handler, i);
+    TEST_CHECK((node != NULL) && (grf_file_get_id(node) == i));
+    TEST_CHECK((prev == NULL) || (grf_file_get_storage_pos64(prev) < grf_file_get_storage_pos64(node)));
+    prev = node;
+  }
+  TEST_CHECK(grf_get_file_by_id(handler, count + 1) == NULL);
+  grf_free(handler);
+  unlink("test_ids.grf");
+  puts(" - test_ids(): OK");
+}
+
+/* a failed write drops the file from the files table and the tree */
+void test_add_fail() {
+  const uint32_t count = 100;
+  grf_handle handler = test_make("test_add_fail.grf", count, 16);
+  grf_handle src     = test_make("test_add_fail2.grf", 1, 16);
+  struct grf_handler *h = handler;
+  bool gone[100]        = {false};
+  char name[64];
+  int fd = open("test_add_fail.grf", O_RDONLY), rw = h->fd;
+  TEST_CHECK(fd >= 0);
+  grf_create_tree(handler);
+  h->fd = fd;
+  test_name(name, count);
+  TEST_CHECK(grf_file_add(handler, name, "0123456789abcdef", 16) == NULL);
+  test_name(name, 5);
+  TEST_CHECK(grf_file_add(handler, name, "0123456789abcdef", 16) == NULL);
+  TEST_CHECK(grf_get_file(handler, name) == NULL);
+  TEST_CHECK(!grf_merge(handler, src, GRF_REPACK_FAST)); /* replaces file 0 */
+  test_name(name, 0);
+  TEST_CHECK(grf_get_file(handler, name) == NULL);
+  gone[0] = gone[5] = true;
+  TEST_CHECK(test_tree_walk(grf_tree_get_root(handler)) == count - 2);
+  h->fd = rw;
+  close(fd);
+  grf_free(src);
+  grf_free(handler);
+  test_archive_ok("test_add_fail.grf", count, 16, gone);
+  unlink("test_add_fail.grf");
+  unlink("test_add_fail2.grf");
+  puts(" - test_add_fail(): OK");
+}
+
+/* table order: files stored in any order are linked by position when loaded */
+void test_table_order() {
+  const uint32_t count = 3000;
+  grf_handle handler = test_make("test_order.grf", count, 16);
+  struct grf_handler *h = handler;
+  struct grf_node **arr = malloc(sizeof(struct grf_node *) * count), *cur;
+  uint32_t i, n = 0, seed = 1;
+  TEST_CHECK(arr != NULL);
+  for (cur = h->first_node; cur != NULL; cur = cur->next) arr[n++] = cur;
+  TEST_CHECK(n == count);
+  /* shuffle the table, the last file staying last as the table is written after it */
+  for (i = count - 2; i > 0; i--) {
+    struct grf_node *swap;
+    uint32_t j = (seed = seed * 1103515245 + 12345) % (i + 1);
+    swap       = arr[i];
+    arr[i]     = arr[j];
+    arr[j]     = swap;
+  }
+  for (i = 0; i < count; i++) {
+    arr[i]->prev = (i > 0) ? arr[i - 1] : NULL;
+    arr[i]->next = (i + 1 < count) ? arr[i + 1] : NULL;
+  }
+  h->first_node = arr[0];
+  h->last_node  = arr[count - 1];
+  h->need_save  = true;
+  TEST_CHECK(grf_save(handler));
+  grf_free(handler);
+  free(arr);
+  handler = grf_load("test_order.grf", false);
+  TEST_CHECK(handler != NULL);
+  for (n = 0, cur = ((struct grf_handler *)handler)->first_node; cur != NULL; cur = cur->next, n++) {
+    TEST_CHECK((cur->next == NULL) || (cur->pos + cur->len_aligned <= cur->next->pos));
+    TEST_CHECK((cur->next == NULL) || (cur->next->prev == cur));
+  }
+  TEST_CHECK((n == count) && (grf_wasted_space(handler) == 0));
+  grf_free(handler);
+  test_archive_ok("test_order.grf", count, 16, NULL);
+  unlink("test_order.grf");
+  puts(" - test_table_order(): OK");
+}
+
+/* checks a compact (or lazy) handle against the regular load of the same archive */
+static void test_compact_ok(grf_handle handler, grf_handle ref, uint32_t count, uint32_t size, const bool *gone, bool storage_order) {
+  grf_cursor cursor = GRF_CURSOR_INIT;
+  grf_node node, prev = NULL, *list;
+  uint32_t i, n = 0;
+  char name[64];
+  TEST_CHECK((handler != NULL) && (ref != NULL));
+  TEST_CHECK(grf_filecount(handler) == grf_filecount(ref));
+  TEST_CHECK(grf_wasted_space64(handler) == grf_wasted_space64(ref));
+  for (i = 0; i < count; i++) {
+    test_name_variant(name, i);
+    node = grf_get_file(handler, name);
+    TEST_CHECK(gone[i] ? (node == NULL) : test_file_ok(handler, i, size));
+    test_name(name, i);
+    TEST_CHECK(node == grf_get_file(handler, name)); /* same node each time */
+    if (node != NULL) TEST_CHECK(grf_get_file_by_id(handler, grf_file_get_id(node)) == node);
+  }
+  test_name(name, count);
+  TEST_CHECK(grf_get_file(handler, name) == NULL);
+  while ((node = grf_file_iterate(handler, &cursor)) != NULL) {
+    TEST_CHECK((grf_file_get_id(node) == n) && (grf_get_file_by_id(handler, n) == node));
+    TEST_CHECK(grf_get_file(ref, grf_file_get_filename(node)) != NULL);
+    if (storage_order && (prev != NULL)) TEST_CHECK(grf_file_get_storage_pos64(prev) < grf_file_get_storage_pos64(node));
+    prev = node;
+    n++;
+  }
+  TEST_CHECK((n == grf_filecount(handler)) && (grf_get_file_by_id(handler, n) == NULL));
+  list = grf_get_file_id_list(handler);
+  for (i = 0; i < n; i++) TEST_CHECK(list[i] == grf_get_file_by_id(handler, i));
+}
+
+/* grf_load_compact(): same files, same contents, IDs in storage order */
+void test_compact() {
+  const uint32_t count = 2000, size = 32;
+  grf_handle handler = test_make("test_compact.grf", count, size), ref;
+  bool gone[2000] = {false};
+  for (uint32_t i = 0; i < count; i += 3) test_delete(handler, i, gone);
+  grf_free(handler);
+  ref     = grf_load("test_compact.grf", false);
+  handler = grf_load_compact("test_compact.grf");
+  test_compact_ok(handler, ref, count, size, gone, true);
+  TEST_CHECK(grf_get_file_first(handler) != NULL);
+  grf_free(handler);
+  grf_free(ref);
+  unlink("test_compact.grf");
+  puts(" - test_compact(): OK");
+}
+
+/* grf_load_lazy(): same as the compact load, whether files are first reached by name or by ID */
+void test_lazy() {
+  const uint32_t count = 2000, size = 32;
+  grf_handle handler = test_make("test_lazy.grf", count, size), ref;
+  grf_cursor cursor  = GRF_CURSOR_INIT;
+  bool gone[2000]    = {false};
+  grf_node node;
+  uint32_t n = 0;
+  for (uint32_t i = 1; i < count; i += 5) test_delete(handler, i, gone);
+  grf_free(handler);
+  ref     = grf_load("test_lazy.grf", false);
+  handler = grf_load_lazy("test_lazy.grf");
+  test_compact_ok(handler, ref, count, size, gone, false);
+  grf_free(handler);
+  handler = grf_load_lazy("test_lazy.grf");
+  TEST_CHECK(handler != NULL);
+  while ((node = grf_file_iterate(handler, &cursor)) != NULL) {
+    TEST_CHECK(grf_get_file(handler, grf_file_get_filename(node)) == node);
+    n++;
+  }
+  TEST_CHECK(n == grf_filecount(ref));
+  test_compact_ok(handler, ref, count, size, gone, false);
+  grf_free(handler);
+  grf_free(ref);
+  unlink("test_lazy.grf");
+  puts(" - test_lazy(): OK");
+}
+
+/* name of long file i: 50 to 249 characters, so that entries end anywhere in the table chunks */
+static void test_long_name(char *buf, uint32_t i) {
+  int n = sprintf(buf, "data\\long\\%u_", i);
+  memset(buf + n, 'a' + i % 26, 50 + (i * 37) % 200 - n);
+  buf[50 + (i * 37) % 200] = 0;
+}
+
+/* loads fn with its header filecount changed by delta, or the byte at pos flipped, then puts the file back as it was */
+static grf_handle test_load_damaged(const char *fn, int delta, long pos) {
+  struct grf_header head;
+  grf_handle handler;
+  FILE *f = fopen(fn, "r+b");
+  int c   = 0;
+  TEST_CHECK((f != NULL) && (fread(&head, sizeof(head), 1, f) == 1));
+  if (pos > 0) TEST_CHECK((fseek(f, pos, SEEK_SET) == 0) && ((c = fgetc(f)) != EOF));
+  for (int step = 0; step < 2; step++) {
+    head.filecount += (step == 0) ? delta : -delta;
+    TEST_CHECK((fseek(f, 0, SEEK_SET) == 0) && (fwrite(&head, sizeof(head), 1, f) == 1));
+    if (pos > 0) TEST_CHECK((fseek(f, pos, SEEK_SET) == 0) && (fputc((step == 0) ? c ^ 0x55 : c, f) != EOF));
+    fflush(f);
+    if (step == 0) handler = grf_load(fn, false);
+  }
+  fclose(f);
+  return handler;
+}
+
+/* files table parsed by chunks: entries across chunk boundaries, damaged tables are refused */
+void test_table_chunks() {
+  const uint32_t count = 3000, size = 16;
+  grf_handle handler = test_make("test_chunks.grf", 100, size);
+  char name[256], *buf = malloc(size);
+  long table, table_end;
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    test_long_name(name, i);
+    test_data(buf, size, i);
+    TEST_CHECK(grf_file_add(handler, name, buf, size) != NULL);
+  }
+  TEST_CHECK(grf_save(handler));
+  TEST_CHECK(handler->table_size > 5100); /* about 500KB once inflated */
+  table     = GRF_HEADER_SIZE + handler->table_offset + 8;
+  table_end = GRF_HEADER_SIZE + handler->table_offset + handler->table_size;
+  grf_free(handler);
+  handler = grf_load("test_chunks.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == count + 100));
+  for (i = 0; i < count; i++) {
+    grf_node node;
+    test_long_name(name, i);
+    test_data(buf, size, i);
+    node = grf_get_file(handler, name);
+    TEST_CHECK((node != NULL) && (grf_file_get_contents(node, name) == size) && (memcmp(name, buf, size) == 0));
+  }
+  for (i = 0; i < 100; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  grf_free(handler);
+  TEST_CHECK(test_load_damaged("test_chunks.grf", 1, 0) == NULL);  /* an entry missing */
+  TEST_CHECK(test_load_damaged("test_chunks.grf", -2, 0) == NULL); /* an entry too many */
+  TEST_CHECK(test_load_damaged("test_chunks.grf", 0, table + 1) == NULL);     /* bad zlib header */
+  TEST_CHECK(test_load_damaged("test_chunks.grf", 0, table_end - 2) == NULL); /* bad checksum */
+  handler = grf_load("test_chunks.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == count + 100));
+  grf_free(handler);
+  free(buf);
+  unlink("test_chunks.grf");
+  puts(" - test_table_chunks(): OK");
+}
+
+/* big tables are loaded on several threads: same result as one thread, duplicate names are dropped */
+void test_load_threads() {
+  const uint32_t count = GRF_LOAD_THREADS_MIN_FILES + 5000, size = 4;
+  grf_handle handler = grf_new("test_threads.grf", true);
+  struct grf_node *dup;
+  uint64_t wasted;
+  uint32_t i;
+  char name[64];
+  TEST_CHECK(handler != NULL);
+  TEST_CHECK(grf_begin(handler)); /* appends without looking for holes */
+  test_add_range(handler, 0, count, size, 0);
+  TEST_CHECK(grf_commit(handler));
+  /* file count - 1 takes the name of file 3 */
+  test_name(name, count - 1);
+  dup = grf_get_file(handler, name);
+  test_name(name, 3);
+  TEST_CHECK(strlen(dup->filename) >= strlen(name));
+  strcpy(dup->filename, name);
+  handler->need_save = true;
+  TEST_CHECK(grf_save(handler));
+  wasted = grf_wasted_space64(handler) + dup->len_aligned;
+  grf_free(handler);
+  handler = grf_load("test_threads.grf", false);
+  TEST_CHECK((handler != NULL) && (grf_filecount(handler) == count - 1));
+  TEST_CHECK(grf_wasted_space64(handler) == wasted);
+  for (i = 0; i < count - 1; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  for (dup = handler->first_node, i = 0; dup != NULL; dup = dup->next, i++)
+    TEST_CHECK((dup->next == NULL) || (dup->pos + dup->len_aligned <= dup->next->pos));
+  TEST_CHECK(i == count - 1);
+  grf_free(handler);
+  unlink("test_threads.grf");
+  puts(" - test_load_threads(): OK");
+}
+
+/* grf_probe(): what the header and table say, without loading */
+void test_probe() {
+  const uint32_t count = 1000, size = 64;
+  grf_handle handler = test_make("test_probe.grf", count, size), ref;
+  bool gone[1000]    = {false};
+  grf_probe_info info, info_fd;
+  struct stat st;
+  unsigned char *table;
+  FILE *f;
+  int fd;
+  for (uint32_t i = 0; i < count; i += 4) test_delete(handler, i, gone);
+  grf_free(handler);
+  ref = grf_load("test_probe.grf", false);
+  TEST_CHECK((ref != NULL) && (stat("test_probe.grf", &st) == 0));
+  TEST_CHECK(grf_probe("test_probe.grf", &info, 0));
+  TEST_CHECK((info.version == 0x200) && (info.filecount == grf_filecount(ref)) && (info.file_size == (uint64_t)st.st_size));
+  TEST_CHECK(info.table_offset + 8 + info.table_size == info.file_size);
+  TEST_CHECK((info.table_real_size > info.table_size) && (info.table_crc == 0) && (info.files == 0));
+  TEST_CHECK(grf_probe("test_probe.grf", &info, GRF_PROBE_TABLE));
+  TEST_CHECK((info.files == grf_filecount(ref)) && (info.wasted_space == grf_wasted_space64(ref)));
+  table = malloc(info.table_size);
+  f     = fopen("test_probe.grf", "rb");
+  TEST_CHECK((table != NULL) && (f != NULL) && (fseek(f, info.table_offset + 8, SEEK_SET) == 0));
+  TEST_CHECK(fread(table, info.table_size, 1, f) == 1);
+  TEST_CHECK(info.table_crc == crc32(0, table, info.table_size));
+  fclose(f);
+  free(table);
+  fd = open("test_probe.grf", O_RDONLY);
+  TEST_CHECK((fd >= 0) && grf_probe_fd(fd, &info_fd, GRF_PROBE_TABLE));
+  TEST_CHECK(memcmp(&info, &info_fd, sizeof(info)) == 0);
+  close(fd);
+  grf_free(ref);
+  /* a damaged table is only seen when it is read */
+  f = fopen("test_probe.grf", "r+b");
+  TEST_CHECK((f != NULL) && (fseek(f, info.file_size - 2, SEEK_SET) == 0) && (fputc(0, f) != EOF) && (fputc(0, f) != EOF));
+  fclose(f);
+  TEST_CHECK(grf_probe("test_probe.grf", &info, 0) && !grf_probe("test_probe.grf", &info, GRF_PROBE_TABLE));
+  /* not a GRF */
+  f = fopen("test_probe.grf", "r+b");
+  TEST_CHECK((f != NULL) && (fputc('X', f) != EOF));
+  fclose(f);
+  TEST_CHECK(!grf_probe("test_probe.grf", &info, 0) && !grf_probe("test_probe_missing.grf", &info, 0));
+  unlink("test_probe.grf");
+  puts(" - test_probe(): OK");
+}
+
+struct test_progress {
+  uint32_t calls, last, max, end, cancel_at; /* end is the position given by the final call */
+  bool done, refuse;
+};
+
+static bool test_progress_cb(void *etc, grf_handle handler, int pos, int max, const char *filename) {
+  struct test_progress *p = etc;
+  TEST_CHECK(!p->done && ((uint32_t)max == p->max));
+  if (filename == NULL) {
+    p->done = true;
+    p->end  = pos;
+    return true;
+  }
+  TEST_CHECK(((uint32_t)pos > p->last) && ((uint32_t)pos <= p->max));
+  p->last = pos;
+  if (++p->calls == p->cancel_at) grf_cancel(handler);
+  return !p->refuse;
+}
+
+/* progress: callback throttling, final call, polling, and stopping a merge or a load */
+void test_progress() {
+  const uint32_t count = 500;
+  grf_handle src = test_make("test_progress.grf", count, 16), dest;
+  struct test_progress p;
+  uint32_t max;
+  int fd;
+  /* each step */
+  dest = grf_new("test_progress2.grf", true);
+  memset(&p, 0, sizeof(p));
+  p.max = count;
+  grf_set_callback(dest, test_progress_cb, &p);
+  grf_set_progress_interval(dest, 0);
+  TEST_CHECK(grf_merge(dest, src, GRF_REPACK_FAST));
+  TEST_CHECK((p.calls == count) && p.done && (p.end == count));
+  TEST_CHECK((grf_progress(dest, &max) == count) && (max == count));
+  grf_free(dest);
+  /* an hour between calls: only the first one, and the final one */
+  unlink("test_progress2.grf");
+  dest = grf_new("test_progress2.grf", true);
+  memset(&p, 0, sizeof(p));
+  p.max = count;
+  grf_set_callback(dest, test_progress_cb, &p);
+  grf_set_progress_interval(dest, 3600 * 1000);
+  TEST_CHECK(grf_merge(dest, src, GRF_REPACK_FAST));
+  TEST_CHECK((p.calls == 1) && p.done && (p.end == count));
+  TEST_CHECK(grf_save(dest) && (grf_filecount(dest) == count));
+  grf_free(dest);
+  /* grf_cancel(): the merge keeps what was done */
+  unlink("test_progress2.grf");
+  dest = grf_new("test_progress2.grf", true);
+  memset(&p, 0, sizeof(p));
+  p.max       = count;
+  p.cancel_at = 100;
+  grf_set_callback(dest, test_progress_cb, &p);
+  grf_set_progress_interval(dest, 0);
+  TEST_CHECK(grf_merge(dest, src, GRF_REPACK_FAST));
+  TEST_CHECK((p.calls == 100) && p.done && (p.end < count) && (grf_progress(dest, NULL) == p.end));
+  TEST_CHECK(grf_save(dest) && (grf_filecount(dest) == 100));
+  grf_free(dest);
+  /* a failed write: the merge fails, but is over */
+  unlink("test_progress2.grf");
+  dest = grf_new("test_progress2.grf", true);
+  memset(&p, 0, sizeof(p));
+  p.max = count;
+  grf_set_callback(dest, test_progress_cb, &p);
+  grf_set_progress_interval(dest, 0);
+  fd = ((struct grf_handler *)dest)->fd;
+  ((struct grf_handler *)dest)->fd = open("test_progress2.grf", O_RDONLY);
+  TEST_CHECK(!grf_merge(dest, src, GRF_REPACK_FAST));
+  TEST_CHECK((p.calls == 1) && p.done && (grf_progress(dest, &max) == count) && (max == count));
+  close(((struct grf_handler *)dest)->fd);
+  ((struct grf_handler *)dest)->fd = fd;
+  grf_free(dest);
+  grf_free(src);
+  /* refused by the callback: the load fails */
+  src = grf_new("test_progress.grf", false);
+  TEST_CHECK(src != NULL);
+  memset(&p, 0, sizeof(p));
+  p.max    = count;
+  p.refuse = true;
+  grf_set_callback(src, test_progress_cb, &p);
+  TEST_CHECK((grf_load_from_new(src) == NULL) && (p.calls == 1));
+  /* no callback: polling still works */
+  src = grf_load("test_progress.grf", false);
+  TEST_CHECK((src != NULL) && (grf_progress(src, &max) == count) && (max == count));
+  grf_free(src);
+  unlink("test_progress.grf");
+  unlink("test_progress2.grf");
+  puts(" - test_progress(): OK");
+}
+
+/* checks json has "key":value */
+static bool test_json_has(const char *json, const char *key, uint64_t value) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\"%s\":%llu", key, (unsigned long long)value);
+  return strstr(json, buf) != NULL;
+}
+
+/* stats: off by default, what each operation counts, reset, JSON export */
+void test_stats() {
+  const uint32_t count = 200, size = 1000;
+  grf_handle handler = test_make("test_stats.grf", count, size);
+  grf_stats st;
+  char name[64], *json;
+  TEST_CHECK(!grf_stats_get(handler, &st) && (grf_stats_json(handler) == NULL));
+  grf_free(handler);
+  handler = grf_new("test_stats.grf", true);
+  TEST_CHECK(handler != NULL);
+  grf_stats_enable(handler, true);
+  TEST_CHECK(grf_load_from_new(handler) != NULL);
+  TEST_CHECK(grf_stats_get(handler, &st));
+  TEST_CHECK((st.count[GRF_STAT_TABLE_READ] > 0) && (st.count[GRF_STAT_TABLE_INFLATE] > 0) && (st.count[GRF_STAT_TABLE_PARSE] > 0));
+  TEST_CHECK((st.count[GRF_STAT_SORT] == 1) && (st.bytes_read > 0) && (st.bytes_written == 0) && (st.lookups == 0));
+  grf_stats_reset(handler);
+  TEST_CHECK(grf_stats_get(handler, &st) && (st.count[GRF_STAT_TABLE_READ] == 0) && (st.bytes_read == 0));
+  /* 10 reads, 5 misses */
+  for (uint32_t i = 0; i < 10; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  for (uint32_t i = count; i < count + 5; i++) {
+    test_name(name, i);
+    TEST_CHECK(grf_get_file(handler, name) == NULL);
+  }
+  TEST_CHECK(grf_stats_get(handler, &st) && (st.lookups == 15) && (st.lookup_hits == 10) && (st.bloom_rejects <= 5));
+  TEST_CHECK((st.count[GRF_STAT_INFLATE] == 10) && (st.bytes_read >= 10 * 8) && (st.count[GRF_STAT_DES] == 0));
+  /* adding and saving */
+  grf_stats_reset(handler);
+  test_add_range(handler, count, count + 3, size, 0);
+  TEST_CHECK(grf_save(handler));
+  TEST_CHECK(grf_stats_get(handler, &st) && (st.count[GRF_STAT_DEFLATE] == 3) && (st.count[GRF_STAT_TABLE_SAVE] == 1));
+  TEST_CHECK((st.count[GRF_STAT_WRITE] >= 3) && (st.bytes_written > 0) && (st.allocs > 0));
+  json = grf_stats_json(handler);
+  TEST_CHECK((json != NULL) && (strncmp(json, "{\"phases\":{\"table_read\":{\"count\":0,", 35) == 0));
+  TEST_CHECK(json[strlen(json) - 1] == '}');
+  TEST_CHECK(strstr(json, "\"deflate\":{\"count\":3,") && strstr(json, "\"table_save\":{\"count\":1,"));
+  TEST_CHECK(test_json_has(json, "bytes_written", st.bytes_written) && test_json_has(json, "lookups", st.lookups));
+  TEST_CHECK(test_json_has(json, "allocs", st.allocs) && test_json_has(json, "bloom_rejects", st.bloom_rejects));
+  free(json);
+  grf_stats_enable(handler, false);
+  TEST_CHECK(!grf_stats_get(handler, &st));
+  grf_free(handler);
+  unlink("test_stats.grf");
+  puts(" - test_stats(): OK");
+}
+
+/* tracepoints: compiled out by default (arguments and clock untouched), the
+ * traced paths (add, deflate, save, load, get_contents, inflate) unchanged */
+void test_trace() {
+  const uint32_t count = 50, size = 1000;
+  grf_handle handler;
+  int evals = 0;
+  uint64_t tt = GRF_TRACE_START();
+  GRF_TRACE(test, ++evals, tt);
+#ifdef GRF_USDT
+  TEST_CHECK(evals == 1);
+#else
+  TEST_CHECK((evals == 0) && (tt == 0) && (GRF_TRACE_ELAPSED(tt) == 0));
+#endif
+  handler = test_make("test_trace.grf", count, size);
+  grf_free(handler);
+  handler = grf_load("test_trace.grf", true);
+  TEST_CHECK(handler != NULL);
+  for (uint32_t i = 0; i < count; i++) TEST_CHECK(test_file_ok(handler, i, size));
+  test_add_range(handler, count, count + 5, size, 0);
+  TEST_CHECK(grf_save(handler));
+  grf_free(handler);
+  test_archive_ok("test_trace.grf", count + 5, size, NULL);
+  unlink("test_trace.grf");
+  puts(" - test_trace(): OK");
+}
+
 void test_load_file() {
   void *handler, *fhandler;
   void *filec;
@@ -220,5 +1522,31 @@ int main() {
   test_grf_version();
   test_new_handler();
   test_load_file();
+  test_repack_cancel();
+  test_repack_crash();
+  test_repack_layout();
+  test_defrag_step();
+  test_table_stream();
+  test_transaction();
+  test_large_header();
+  test_vfs();
+  test_bloom();
+  test_sorted();
+  test_tree();
+  test_tree_lazy();
+  test_search();
+  test_ext();
+  test_iterate();
+  test_ids();
+  test_add_fail();
+  test_table_order();
+  test_compact();
+  test_lazy();
+  test_table_chunks();
+  test_load_threads();
+  test_probe();
+  test_progress();
+  test_stats();
+  test_trace();
   return 0;
 }
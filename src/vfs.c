@@ -0,0 +1,283 @@
+/* vfs.c : several GRF files and directories seen as one
+ *
+ * The index maps each filename to the winning version (struct grf_vfs_entry),
+ * so a lookup costs a single hash lookup whatever the number of layers.
+ */
+
+#include <grf.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static void vfs_free_entry(struct grf_vfs_entry *entry) {
+  if (entry->path != NULL) free(entry->path);
+  free(entry);
+}
+
+/* does layer a hide layer b ? */
+static bool vfs_layer_wins(struct grf_vfs_layer *a, struct grf_vfs_layer *b) {
+  if (a->priority != b->priority) return a->priority > b->priority;
+  return a->seq > b->seq;
+}
+
+/* path on disk of filename in a directory layer */
+static char *vfs_dir_path(struct grf_vfs_layer *layer, const char *filename) {
+  size_t l   = strlen(layer->path);
+  char *path = malloc(l + strlen(filename) + 2);
+  if (path == NULL) return NULL;
+  sprintf(path, "%s/%s", layer->path, filename);
+  for (char *p = path + l; *p != 0; p++)
+    if (*p == '\\') *p = '/';
+  return path;
+}
+
+static struct grf_vfs_entry *vfs_new_entry(struct grf_vfs_layer *layer, struct grf_node *node, char *path) {
+  struct grf_vfs_entry *entry = malloc(sizeof(struct grf_vfs_entry));
+  if (entry == NULL) {
+    if (path != NULL) free(path);
+    return NULL;
+  }
+  entry->layer = layer;
+  entry->node  = node;
+  entry->path  = path;
+  return entry;
+}
+
+/* version of filename stored in layer, if any */
+static struct grf_vfs_entry *vfs_layer_lookup(struct grf_vfs_layer *layer, const char *filename) {
+  struct stat s;
+  char *path;
+  if (layer->grf != NULL) {
+    struct grf_node *node = grf_get_file(layer->grf, filename);
+    return (node == NULL) ? NULL : vfs_new_entry(layer, node, NULL);
+  }
+  path = vfs_dir_path(layer, filename);
+  if (path == NULL) return NULL;
+  if ((stat(path, &s) != 0) || !S_ISREG(s.st_mode)) {
+    free(path);
+    return NULL;
+  }
+  return vfs_new_entry(layer, NULL, path);
+}
+
+/* size the index for count files at once, before adding a whole grf (it grows by itself otherwise) */
+static void vfs_index_grow(struct grf_vfs *vfs, uint32_t count) {
+  if (count > vfs->index->size * 2) hash_resize(vfs->index, count * 2);
+}
+
+/* layer has filename (node or path), use it if it hides the current version */
+static void vfs_offer(struct grf_vfs *vfs, struct grf_vfs_layer *layer, const char *filename, struct grf_node *node, char *path) {
+  list_element *cur = hash_lookup_raw(vfs->index, filename);
+  struct grf_vfs_entry *entry;
+  if ((cur != NULL) && !vfs_layer_wins(layer, ((struct grf_vfs_entry *)cur->pointer)->layer)) {
+    if (path != NULL) free(path);
+    return;
+  }
+  entry = vfs_new_entry(layer, node, path);
+  if (entry == NULL) return;
+  if (cur != NULL) {
+    vfs_free_entry(cur->pointer);
+    cur->pointer = entry;
+  } else {
+    hash_add_element(vfs->index, (char *)filename, entry);
+  }
+}
+
+/* find again the winning version of filename */
+static void vfs_resolve(struct grf_vfs *vfs, const char *filename) {
+  struct grf_vfs_entry *entry = NULL;
+  list_element *cur;
+  for (uint32_t i = 0; (i < vfs->layer_count) && (entry == NULL); i++) entry = vfs_layer_lookup(vfs->layers[i], filename);
+  cur = hash_lookup_raw(vfs->index, filename);
+  if (entry == NULL) {
+    if (cur != NULL) hash_del_element(vfs->index, (char *)filename);
+  } else if (cur != NULL) {
+    vfs_free_entry(cur->pointer);
+    cur->pointer = entry;
+  } else {
+    hash_add_element(vfs->index, (char *)filename, entry);
+  }
+}
+
+void vfs_update_file(struct grf_vfs *vfs, const char *filename) { vfs_resolve(vfs, filename); }
+
+/* recursively offer the files found in layer->path/name */
+static void vfs_scan_dir(struct grf_vfs *vfs, struct grf_vfs_layer *layer, const char *name) {
+  char *path = vfs_dir_path(layer, name);
+  struct dirent *e;
+  DIR *dir;
+  if (path == NULL) return;
+  dir = opendir(path);
+  free(path);
+  if (dir == NULL) return;
+  while ((e = readdir(dir)) != NULL) {
+    struct stat s;
+    char *sub;
+    if ((strcmp(e->d_name, ".") == 0) || (strcmp(e->d_name, "..") == 0)) continue;
+    sub = malloc(strlen(name) + strlen(e->d_name) + 2);
+    if (sub == NULL) break;
+    sprintf(sub, "%s%s%s", name, (*name != 0) ? "\\" : "", e->d_name);
+    path = vfs_dir_path(layer, sub);
+    if ((path != NULL) && (stat(path, &s) == 0)) {
+      if (S_ISDIR(s.st_mode)) {
+        free(path);
+        vfs_scan_dir(vfs, layer, sub);
+      } else if (S_ISREG(s.st_mode)) {
+        vfs_offer(vfs, layer, sub, NULL, path);
+      } else {
+        free(path);
+      }
+    } else if (path != NULL) {
+      free(path);
+    }
+    free(sub);
+  }
+  closedir(dir);
+}
+
+static void vfs_fill_layer(struct grf_vfs *vfs, struct grf_vfs_layer *layer) {
+  if (layer->grf == NULL) {
+    vfs_scan_dir(vfs, layer, "");
+    return;
+  }
+  vfs_index_grow(vfs, vfs->index->count + layer->grf->fast_table->count);
+  for (struct grf_node *node = layer->grf->first_node; node != NULL; node = node->next)
+    vfs_offer(vfs, layer, node->filename, node, NULL);
+}
+
+static struct grf_vfs_layer *vfs_add_layer(struct grf_vfs *vfs, int priority) {
+  struct grf_vfs_layer *layer, **layers;
+  uint32_t i;
+  layers = realloc(vfs->layers, sizeof(struct grf_vfs_layer *) * (vfs->layer_count + 1));
+  if (layers == NULL) return NULL;
+  vfs->layers = layers;
+  layer       = calloc(1, sizeof(struct grf_vfs_layer));
+  if (layer == NULL) return NULL;
+  layer->priority = priority;
+  layer->seq      = ++vfs->seq;
+  // keep layers sorted, winning one first
+  for (i = 0; (i < vfs->layer_count) && vfs_layer_wins(vfs->layers[i], layer); i++)
+    ;
+  memmove(vfs->layers + i + 1, vfs->layers + i, sizeof(struct grf_vfs_layer *) * (vfs->layer_count - i));
+  vfs->layers[i] = layer;
+  vfs->layer_count++;
+  return layer;
+}
+
+GRFEXPORT grf_vfs grf_vfs_new(void) {
+  struct grf_vfs *vfs = calloc(1, sizeof(struct grf_vfs));
+  if (vfs == NULL) return NULL;
+  vfs->index = hash_create_table(GRF_VFS_HASH_SIZE, vfs_free_entry);
+  if (vfs->index == NULL) {
+    free(vfs);
+    return NULL;
+  }
+  return vfs;
+}
+
+GRFEXPORT bool grf_vfs_mount(grf_vfs vfs, grf_handle handler, int priority) {
+  struct grf_vfs_layer *layer;
+  if ((vfs == NULL) || (handler == NULL) || (handler->vfs != NULL)) return false;
+  if (handler->compact != NULL) return false; /* no files list to index */
+  layer = vfs_add_layer(vfs, priority);
+  if (layer == NULL) return false;
+  layer->grf   = handler;
+  handler->vfs = vfs;
+  vfs_fill_layer(vfs, layer);
+  return true;
+}
+
+GRFEXPORT bool grf_vfs_mount_dir(grf_vfs vfs, const char *path, int priority) {
+  struct grf_vfs_layer *layer;
+  struct stat s;
+  if ((vfs == NULL) || (path == NULL)) return false;
+  if ((stat(path, &s) != 0) || !S_ISDIR(s.st_mode)) return false;
+  layer = vfs_add_layer(vfs, priority);
+  if (layer == NULL) return false;
+  layer->path = strdup(path);
+  vfs_fill_layer(vfs, layer);
+  return true;
+}
+
+GRFEXPORT bool grf_vfs_unmount(grf_vfs vfs, grf_handle handler) {
+  struct grf_vfs_layer *layer = NULL;
+  uint32_t i;
+  if ((vfs == NULL) || (handler == NULL) || (handler->vfs != vfs)) return false;
+  for (i = 0; i < vfs->layer_count; i++) {
+    if (vfs->layers[i]->grf == handler) {
+      layer = vfs->layers[i];
+      break;
+    }
+  }
+  if (layer == NULL) return false;
+  vfs->layer_count--;
+  memmove(vfs->layers + i, vfs->layers + i + 1, sizeof(struct grf_vfs_layer *) * (vfs->layer_count - i));
+  handler->vfs = NULL;
+  // only the files this grf was providing need another lookup
+  for (struct grf_node *node = handler->first_node; node != NULL; node = node->next) {
+    struct grf_vfs_entry *entry = hash_lookup(vfs->index, node->filename);
+    if ((entry != NULL) && (entry->layer == layer)) vfs_resolve(vfs, node->filename);
+  }
+  free(layer);
+  return true;
+}
+
+GRFEXPORT void grf_vfs_refresh(grf_vfs vfs) {
+  hash_table *index = hash_create_table(GRF_VFS_HASH_SIZE, vfs_free_entry);
+  if (index == NULL) return;
+  hash_free_table(vfs->index);
+  vfs->index = index;
+  // lowest priority first, so each file is offered mostly once
+  for (uint32_t i = vfs->layer_count; i > 0; i--) vfs_fill_layer(vfs, vfs->layers[i - 1]);
+}
+
+GRFEXPORT uint32_t grf_vfs_filecount(grf_vfs vfs) { return vfs->index->count; }
+
+GRFEXPORT grf_vfs_file grf_vfs_get_file(grf_vfs vfs, const char *filename) { return hash_lookup(vfs->index, filename); }
+
+GRFEXPORT grf_node grf_vfs_file_get_node(grf_vfs_file file) { return file->node; }
+
+GRFEXPORT grf_handle grf_vfs_file_get_grf(grf_vfs_file file) { return file->layer->grf; }
+
+GRFEXPORT uint32_t grf_vfs_file_get_size(grf_vfs_file file) {
+  struct stat s;
+  if (file->node != NULL) return grf_file_get_size(file->node);
+  if (stat(file->path, &s) != 0) return 0;
+  return s.st_size;
+}
+
+GRFEXPORT uint32_t grf_vfs_file_get_contents(grf_vfs_file file, void *target) {
+  uint32_t size, p = 0;
+  int fd;
+  if (file->node != NULL) return grf_file_get_contents(file->node, target);
+  size = grf_vfs_file_get_size(file);
+  fd   = open(file->path, O_RDONLY | O_BINARY);
+  if (fd < 0) return 0;
+  while (p < size) {
+    int i = read(fd, (char *)target + p, size - p);
+    if (i <= 0) break;
+    p += i;
+  }
+  close(fd);
+  return p;
+}
+
+GRFEXPORT void grf_vfs_free(grf_vfs vfs) {
+  if (vfs == NULL) return;
+  for (uint32_t i = 0; i < vfs->layer_count; i++) {
+    if (vfs->layers[i]->grf != NULL) vfs->layers[i]->grf->vfs = NULL;
+    if (vfs->layers[i]->path != NULL) free(vfs->layers[i]->path);
+    free(vfs->layers[i]);
+  }
+  if (vfs->layers != NULL) free(vfs->layers);
+  hash_free_table(vfs->index);
+  free(vfs);
+}
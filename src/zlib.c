@@ -1,9 +1,12 @@
 #include <grf.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <zlib.h>
 
 int zlib_buffer_inflate(void *dest, int destlen, void *src, int srclen) {
   z_stream stream;
-  int err;
+  uint64_t t0 = GRF_TRACE_START();
+  int err, res = 0;
 
   stream.next_in  = src;
   stream.avail_in = srclen;
@@ -15,22 +18,18 @@ int zlib_buffer_inflate(void *dest, int destlen, void *src, int srclen) {
   stream.zfree  = (free_func)0;
 
   err = inflateInit(&stream);
-  if (err != Z_OK) return 0;
-
-  err = inflate(&stream, Z_FINISH);
-  if (err != Z_STREAM_END) {
-    inflateEnd(&stream);
-    return 0;
+  if (err == Z_OK) {
+    err = inflate(&stream, Z_FINISH);
+    if ((inflateEnd(&stream) == Z_OK) && (err == Z_STREAM_END)) res = stream.total_out;
   }
-
-  err = inflateEnd(&stream);
-  if (err != Z_OK) return 0;
-  return stream.total_out;
+  GRF_TRACE(inflate, srclen, destlen, res, GRF_TRACE_ELAPSED(t0));
+  return res;
 }
 
 int zlib_buffer_deflate(void *dest, int destlen, void *src, int srclen, int level) {
   z_stream stream;
-  int err;
+  uint64_t t0 = GRF_TRACE_START();
+  int err, res = 0;
 
   stream.next_in  = src;
   stream.avail_in = srclen;
@@ -42,15 +41,74 @@ int zlib_buffer_deflate(void *dest, int destlen, void *src, int srclen, int leve
   stream.zfree  = (free_func)0;
 
   err = deflateInit(&stream, level);
-  if (err != Z_OK) return 0;
+  if (err == Z_OK) {
+    err = deflate(&stream, Z_FINISH);
+    if ((deflateEnd(&stream) == Z_OK) && (err == Z_STREAM_END)) res = stream.total_out;
+  }
+  GRF_TRACE(deflate, srclen, res, level, GRF_TRACE_ELAPSED(t0));
+  return res;
+}
+
+/* incremental inflate of a deflated block read from a file, so a big block
+ * (the files table) can be used as it comes without holding all of it */
+struct zlib_stream {
+  z_stream stream;
+  int fd;
+  uint32_t left; /* compressed bytes not read yet */
+  uint32_t *crc; /* crc32 of the compressed bytes read so far, if asked for */
+  struct grf_stats *stats; /* table read and inflate time, if enabled */
+  bool ended;
+  unsigned char in[16384];
+};
 
-  err = deflate(&stream, Z_FINISH);
-  if (err != Z_STREAM_END) {
-    deflateEnd(&stream);
-    return 0;
+struct zlib_stream *zlib_stream_open(int fd, uint32_t srclen, uint32_t *crc, struct grf_stats *stats) {
+  struct zlib_stream *s = calloc(1, sizeof(struct zlib_stream));
+  if (s == NULL) return NULL;
+  s->fd    = fd;
+  s->left  = srclen;
+  s->crc   = crc;
+  s->stats = stats;
+  if (inflateInit(&s->stream) != Z_OK) {
+    free(s);
+    return NULL;
   }
+  return s;
+}
+
+/* inflates up to len bytes, returns the number of bytes produced, 0 at the end of the stream, -1 on error */
+int zlib_stream_read(struct zlib_stream *s, void *dest, int len) {
+  if (s->ended) return 0;
+  s->stream.next_out  = dest;
+  s->stream.avail_out = len;
+  while (s->stream.avail_out > 0) {
+    uint64_t t0;
+    int err;
+    if ((s->stream.avail_in == 0) && (s->left > 0)) {
+      int n;
+      t0 = GRF_STAT_START(s->stats);
+      n  = read(s->fd, s->in, (s->left < sizeof(s->in)) ? s->left : sizeof(s->in));
+      if (n <= 0) return -1;
+      GRF_STAT_END(s->stats, GRF_STAT_TABLE_READ, t0);
+      GRF_STAT_ADD(s->stats, bytes_read, n);
+      s->left -= n;
+      if (s->crc != NULL) *s->crc = crc32(*s->crc, s->in, n);
+      s->stream.next_in  = s->in;
+      s->stream.avail_in = n;
+    }
+    t0  = GRF_STAT_START(s->stats);
+    err = inflate(&s->stream, Z_NO_FLUSH);
+    GRF_STAT_END(s->stats, GRF_STAT_TABLE_INFLATE, t0);
+    if (err == Z_STREAM_END) {
+      s->ended = true;
+      break;
+    }
+    if (err != Z_OK) return -1; /* including a truncated stream */
+  }
+  return len - s->stream.avail_out;
+}
 
-  err = deflateEnd(&stream);
-  if (err != Z_OK) return 0;
-  return stream.total_out;
+void zlib_stream_close(struct zlib_stream *s) {
+  if (s == NULL) return;
+  inflateEnd(&s->stream);
+  free(s);
 }